@@ -4,6 +4,9 @@
 
     Please find the license in the provided COPYING file.
 */
+#include <ctype.h>
+#include <fcntl.h>
+#include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,7 +19,7 @@
 #include "main.h"
 extern int client_uid;
 
-static void c_end_of_job(const struct Result *res);
+static void c_end_of_job(int jobid, const struct Result *res);
 
 static void c_wait_job_send();
 
@@ -26,6 +29,48 @@ char *build_command_string() {
   return charArray_string(command_line.command.num, command_line.command.array);
 }
 
+/* Characters that need no quoting for the shell */
+static int is_shell_safe(const char *str) {
+  if (*str == '\0')
+    return 0;
+  for (; *str != '\0'; ++str) {
+    if (!isalnum((unsigned char)*str) && strchr("@%+=:,./_-", *str) == NULL)
+      return 0;
+  }
+  return 1;
+}
+
+/* Bytes of the argument quoted for the shell, without the null */
+static int shell_quoted_size(const char *str) {
+  int size = 2;
+  if (is_shell_safe(str))
+    return strlen(str);
+  for (; *str != '\0'; ++str)
+    size += (*str == '\'') ? 4 : 1;
+  return size;
+}
+
+static void strcat_shell_quoted(char *dest, const char *str) {
+  if (is_shell_safe(str)) {
+    strcat(dest, str);
+    return;
+  }
+  dest += strlen(dest);
+  *dest++ = '\'';
+  for (; *str != '\0'; ++str) {
+    if (*str == '\'') {
+      /* close the quote, add an escaped one, and reopen */
+      memcpy(dest, "'\\''", 4);
+      dest += 4;
+    } else
+      *dest++ = *str;
+  }
+  *dest++ = '\'';
+  *dest = '\0';
+}
+
+/* The arguments are quoted where needed, so the server can run the
+ * string again through the shell (see s_spawn_runner) */
 char *charArray_string(int num, char** array) {
   int size;
   int i;
@@ -37,7 +82,7 @@ char *charArray_string(int num, char** array) {
   for (i = 0; i < num; ++i) {
     /* The '1' is for spaces, and at the last i,
      * for the null character */
-    size = size + strlen(array[i]) + 1;
+    size = size + shell_quoted_size(array[i]) + 1;
   }
 
   /* Alloc */
@@ -46,15 +91,19 @@ char *charArray_string(int num, char** array) {
     error("Error in malloc for commandstring");
 
   /* Build the command */
-  strcpy(commandstring, array[0]);
+  commandstring[0] = '\0';
+  strcat_shell_quoted(commandstring, array[0]);
   for (i = 1; i < num; ++i) {
     strcat(commandstring, " ");
-    strcat(commandstring, array[i]);
+    strcat_shell_quoted(commandstring, array[i]);
   }
 
   return commandstring;
 }
 
+/* The environment of c_new_job(), until the server asks for it */
+static char *new_job_env = NULL;
+
 void c_new_job() {
   // printf("new _job \n");
   struct Msg m = default_msg();
@@ -74,9 +123,10 @@ void c_new_job() {
   m.u.newjob.command_size = strlen(new_command) + 1; /* add null */
   m.u.newjob.command_size_strip = strlen(new_command) - strlen(old_command);
   m.u.newjob.path_size = strlen(path) + 1; /* add null */
-  if (myenv)
+  if (myenv) {
     m.u.newjob.env_size = strlen(myenv) + 1; /* add null */
-  else
+    m.u.newjob.env_hash = env_hash(myenv);
+  } else
     m.u.newjob.env_size = 0;
   
   if (command_line.label)
@@ -100,6 +150,7 @@ void c_new_job() {
   m.u.newjob.taskpid = command_line.taskpid;
   m.u.newjob.start_time = command_line.start_time;
   m.u.newjob.taskset_flag = command_line.taskset_flag;
+  m.u.newjob.detach = command_line.detach;
   
   
   
@@ -123,11 +174,122 @@ void c_new_job() {
   /* Send the label */
   send_bytes(server_socket, command_line.email, m.u.newjob.email_size);
 
-  /* Send the environment */
-  send_bytes(server_socket, myenv, m.u.newjob.env_size);
+  /* The environment only goes if the server has not got it (NEWJOB_ENV) */
+  new_job_env = myenv;
 
   // free(new_command);
+}
+
+/* Append 'size' bytes to the growing buffer *buf of *len bytes */
+static void append_payload(char **buf, int *len, int *alloc, const char *data,
+                           int size) {
+  if (*len + size > *alloc) {
+    while (*len + size > *alloc)
+      *alloc = *alloc ? *alloc * 2 : 4096;
+    *buf = (char *)realloc(*buf, *alloc);
+    if (*buf == NULL)
+      error("Cannot allocate the batch of commands");
+  }
+  memcpy(*buf + *len, data, size);
+  *len += size;
+}
+
+/* Queue every line of command_line.batch_file as a detached job, with
+ * one message and one payload. Each line is run through "sh -c", and
+ * shares the options given on the command line, the cwd and the env. */
+void c_new_batch() {
+  struct Msg m = default_msg();
+  char path[2048];
+  char *myenv;
+  char *payload = NULL;
+  int len = 0, alloc = 0;
+  char *line = NULL;
+  size_t line_alloc = 0;
+  ssize_t line_len;
+  FILE *f;
+  int res;
+
+  if (strcmp(command_line.batch_file, "-") == 0)
+    f = stdin;
+  else
+    f = fopen(command_line.batch_file, "r");
+  if (f == NULL)
+    error("Cannot open the batch file %s", command_line.batch_file);
+
+  m.type = NEWJOB_BATCH;
+  m.u.newjob.batch_size = 0;
+  while ((line_len = getline(&line, &line_alloc, f)) != -1) {
+    char *sh_c[3];
+    char *command;
+    int size;
+
+    if (line_len > 0 && line[line_len - 1] == '\n')
+      line[--line_len] = '\0';
+    /* Skip blank lines and comments */
+    command = line + strspn(line, " \t");
+    if (*command == '\0' || *command == '#')
+      continue;
+
+    sh_c[0] = "sh";
+    sh_c[1] = "-c";
+    sh_c[2] = line;
+    command = charArray_string(3, sh_c);
+    size = strlen(command_line.linux_cmd) + 1 + strlen(command) + 1;
+    if (len + size < len)
+      error("Too many commands in the batch file");
+    append_payload(&payload, &len, &alloc, command_line.linux_cmd,
+                   strlen(command_line.linux_cmd));
+    append_payload(&payload, &len, &alloc, " ", 1);
+    append_payload(&payload, &len, &alloc, command, strlen(command) + 1);
+    free(command);
+    m.u.newjob.batch_size++;
+  }
+  free(line);
+  if (f != stdin)
+    fclose(f);
+
+  if (m.u.newjob.batch_size == 0) {
+    fprintf(stderr, "No commands to queue in %s\n", command_line.batch_file);
+    exit(-1);
+  }
+
+  getcwd(path, 2048);
+  myenv = get_environment();
+
+  m.u.newjob.command_size = len;
+  m.u.newjob.command_size_strip = strlen(command_line.linux_cmd) + 1;
+  m.u.newjob.path_size = strlen(path) + 1;
+  m.u.newjob.label_size =
+      command_line.label ? strlen(command_line.label) + 1 : 0;
+  m.u.newjob.email_size =
+      command_line.email ? strlen(command_line.email) + 1 : 0;
+  m.u.newjob.env_size = myenv ? strlen(myenv) + 1 : 0;
+  m.u.newjob.store_output = command_line.store_output;
+  m.u.newjob.should_keep_finished = command_line.should_keep_finished;
+  m.u.newjob.num_slots = command_line.num_slots;
+  m.u.newjob.taskset_flag = command_line.taskset_flag;
+  m.u.newjob.detach = 1;
+
+  append_payload(&payload, &len, &alloc, path, m.u.newjob.path_size);
+  append_payload(&payload, &len, &alloc, command_line.label,
+                 m.u.newjob.label_size);
+  append_payload(&payload, &len, &alloc, command_line.email,
+                 m.u.newjob.email_size);
+  append_payload(&payload, &len, &alloc, myenv, m.u.newjob.env_size);
   free(myenv);
+
+  send_msg(server_socket, &m);
+  send_bytes(server_socket, payload, len);
+  free(payload);
+
+  res = recv_msg(server_socket, &m);
+  if (res == -1)
+    error("Error in c_new_batch");
+  if (m.type != NEWJOB_OK) {
+    fprintf(stderr, "Error, the batch was not queued\n");
+    exit(EXITCODE_QUEUE_FULL);
+  }
+  printf("New JobIDs: %i-%i\n", m.jobid, m.jobid + m.u.newjob.batch_size - 1);
 }
 
 static void c_print_line(struct Msg* m) {
@@ -155,13 +317,26 @@ int c_wait_newjob_ok() {
     return c_wait_newjob_ok();
   }
 
+  if (m.type == NEWJOB_ENV) {
+    if (new_job_env == NULL)
+      error("The server asked for an environment not announced");
+    send_bytes(server_socket, new_job_env, strlen(new_job_env) + 1);
+    return c_wait_newjob_ok();
+  }
+  free(new_job_env);
+  new_job_env = NULL;
+
   if (m.type == NEWJOB_PID_NOK) {
     // fprintf(stderr, "Error, queue full\n");
     exit(EXITCODE_RELINK_FAILED);
   }
   if (m.type != NEWJOB_OK)
     error("Error getting the newjob_ok");
-  
+
+  /* The server may still want us to run it (e.g. we are its runner) */
+  if (!m.u.newjob.detach)
+    command_line.detach = 0;
+
   return m.jobid;
 }
 
@@ -193,7 +368,7 @@ int c_wait_server_commands() {
       } else {
         run_job(m.jobid, &result);
       }
-      c_end_of_job(&result);
+      c_end_of_job(m.jobid, &result);
       return result.errorlevel;
     }
   }
@@ -232,26 +407,206 @@ static int wait_server_lines_and_check(const char *pre_str) {
 
 void c_wait_server_lines() { wait_server_lines_and_check(""); }
 
-void c_list_jobs() {
+/* The uid of --user, a name or a number; -1 for all the users */
+static int user_uid(const char *user) {
+  struct passwd *pwd;
+  char *end;
+  int uid;
+
+  if (user == NULL)
+    return -1;
+  uid = strtol(user, &end, 10);
+  if (end != user && *end == '\0')
+    return uid;
+  pwd = getpwnam(user);
+  if (pwd == NULL)
+    error("Cannot find the user %s", user);
+  return pwd->pw_uid;
+}
+
+/* LIST or LIST_ALL, with the filter of the command line */
+static struct Msg list_msg(enum MsgTypes type) {
   struct Msg m = default_msg();
+  const char *label = command_line.label;
 
-  m.type = LIST;
+  m.type = type;
   m.u.list.list_format = command_line.list_format;
+  /* The columns are for the formats of the scripts */
+  if (command_line.list.fields != 0 && m.u.list.list_format == DEFAULT)
+    m.u.list.list_format = TAB;
   m.u.list.term_width = term_width;
-  // m.u.term_width = term_width;
+  m.u.list.uid = user_uid(command_line.user);
+  m.u.list.states = command_line.list.states;
+  m.u.list.jobid_from = command_line.list.jobid_from;
+  m.u.list.jobid_to = command_line.list.jobid_to;
+  m.u.list.offset = command_line.list.offset;
+  m.u.list.limit = command_line.list.limit;
+  m.u.list.fields = command_line.list.fields;
+  m.u.list.label_size = label != NULL ? strlen(label) + 1 : 0;
+  return m;
+}
+
+static void send_list(enum MsgTypes type) {
+  struct Msg m = list_msg(type);
+
   send_msg(server_socket, &m);
+  if (command_line.label != NULL)
+    send_bytes(server_socket, command_line.label, m.u.list.label_size);
 }
 
-void c_list_jobs_all() {
+void c_list_jobs() { send_list(LIST); }
+
+/* ts -l, -A and -s from the snapshot of the server, as it would answer
+ * them. -1 if there is none current, and then the server must answer. */
+int c_query_snapshot() {
+  switch (command_line.request) {
+  case c_LIST:
+  case c_LIST_ALL: {
+    enum MsgTypes type = command_line.request == c_LIST ? LIST : LIST_ALL;
+    struct Msg m = list_msg(type);
+    int ts_UID = 0;
+
+    if (snapshot_load() != 0)
+      return -1;
+    if (type == LIST) {
+      ts_UID = get_tsUID(client_uid);
+      /* The server does not take the user */
+      if (ts_UID == -1)
+        return -1;
+    }
+    s_list_filtered(LIST_STDOUT, ts_UID, &m, command_line.label);
+    return 0;
+  }
+  case c_GET_STATE: {
+    const struct Job *p;
+
+    if (snapshot_load() != 0)
+      return -1;
+    p = job_of_state(command_line.jobid);
+    /* The server tells the error */
+    if (p == NULL)
+      return -1;
+    printf("%s\n", jstate2string(p->state));
+    return 0;
+  }
+  default:
+    return -1;
+  }
+}
+
+void c_show_stats() {
   struct Msg m = default_msg();
 
-  m.type = LIST_ALL;
-  m.u.list.list_format = command_line.list_format;
-  m.u.list.term_width = term_width;
-  // m.u.list.plain_list = command_line.plain_list;
+  m.type = STATS;
   send_msg(server_socket, &m);
 }
 
+/* ts --history, a page per request, each one after the last job of the
+ * one before, until the server closes */
+void c_history() {
+  struct Msg m = default_msg();
+  const char *label = command_line.label;
+  long before_time = 0;
+  int before_jobid = 0;
+  int uid = user_uid(command_line.user);
+  int res;
+
+  while (1) {
+    m = default_msg();
+    m.type = HISTORY;
+    m.u.history.uid = uid;
+    m.u.history.since = command_line.history.since;
+    m.u.history.failed = command_line.history.failed;
+    m.u.history.label_size = label != NULL ? strlen(label) + 1 : 0;
+    m.u.history.before_time = before_time;
+    m.u.history.before_jobid = before_jobid;
+    send_msg(server_socket, &m);
+    if (label != NULL)
+      send_bytes(server_socket, label, m.u.history.label_size);
+
+    while (1) {
+      res = recv_msg(server_socket, &m);
+      if (res == 0)
+        return;
+      if (res != sizeof(m))
+        error("Error in c_history");
+      if (m.type == HISTORY_NEXT)
+        break;
+      if (m.type == LIST_LINE) {
+        char *buffer = (char *)malloc(m.u.size);
+        if (buffer == NULL)
+          error("Cannot allocate a line of the history");
+        if (recv_bytes(server_socket, buffer, m.u.size) != m.u.size)
+          error("Error in c_history - line size");
+        printf("%s", buffer);
+        free(buffer);
+      }
+    }
+    /* No one reads the rest, as after ts --history | head */
+    if (fflush(stdout) != 0)
+      return;
+    before_time = m.u.history.before_time;
+    before_jobid = m.u.history.before_jobid;
+  }
+}
+
+void c_list_jobs_all() { send_list(LIST_ALL); }
+
+/* The events of ts --watch, by enum JobEvent */
+static const char *event_names[] = {"submitted", "started", "paused",
+                                    "resumed",   "finished", "removed"};
+
+/* ts --watch: a line per event, until the server goes away. With -M json
+ * each line is an object. */
+void c_watch() {
+  struct Msg m = default_msg();
+  int json = command_line.list_format == JSON;
+  int res;
+
+  send_list(WATCH);
+  while (1) {
+    res = recv_msg(server_socket, &m);
+    if (res == 0)
+      return;
+    if (res != sizeof(m))
+      error("Error in c_watch");
+    if (m.type == LIST_LINE) {
+      /* The watch was refused */
+      char *buffer = (char *)malloc(m.u.size);
+      if (buffer == NULL)
+        error("Cannot allocate the answer to the watch");
+      if (recv_bytes(server_socket, buffer, m.u.size) != m.u.size)
+        error("Error in c_watch - line size");
+      printf("%s", buffer);
+      free(buffer);
+      continue;
+    }
+    if (m.type != EVENT || m.u.event.kind < EVENT_SUBMITTED ||
+        m.u.event.kind > EVENT_REMOVED)
+      error("Wrong message in c_watch");
+
+    if (json)
+      printf("{\"ID\":%i,\"Event\":\"%s\",\"UID\":%i", m.jobid,
+             event_names[m.u.event.kind], m.u.event.uid);
+    else
+      printf("%i\t%s\t%i", m.jobid, event_names[m.u.event.kind],
+             m.u.event.uid);
+    if (m.u.event.kind == EVENT_FINISHED) {
+      if (json)
+        printf(",\"E-Level\":%i,\"Signal\":%i", m.u.event.errorlevel,
+               m.u.event.signal);
+      else if (m.u.event.signal != 0)
+        printf("\t%i\tsignal %i", m.u.event.errorlevel, m.u.event.signal);
+      else
+        printf("\t%i", m.u.event.errorlevel);
+    }
+    printf(json ? "}\n" : "\n");
+    /* No one reads the rest, as after ts --watch | head */
+    if (fflush(stdout) != 0)
+      return;
+  }
+}
+
 /* Exits if wrong */
 void c_check_version() {
   struct Msg m = default_msg();
@@ -405,13 +760,36 @@ void c_send_runjob_ok(const char *ofname, int pid) {
     send_bytes(server_socket, ofname, m.u.output.ofilename_size);
 }
 
-static void c_end_of_job(const struct Result *res) {
+/* The server went down while the job ran. The server started again
+ * adopts the job by its pid, and reads the result from this file. */
+static void c_save_result(int jobid, const struct Result *res) {
+  char *path = create_status_path(jobid);
+  char *tmp = (char *)malloc(strlen(path) + 5);
+  int fd;
+
+  sprintf(tmp, "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd != -1) {
+    int complete = write(fd, res, sizeof(*res)) == sizeof(*res);
+
+    /* Renamed once complete, so it is never read half written */
+    if (close(fd) == 0 && complete)
+      rename(tmp, path);
+    else
+      unlink(tmp);
+  }
+  free(tmp);
+  free(path);
+}
+
+static void c_end_of_job(int jobid, const struct Result *res) {
   struct Msg m = default_msg();
 
   m.type = ENDJOB;
   m.u.result = *res; /* struct copy */
 
-  send_msg(server_socket, &m);
+  if (send(server_socket, &m, sizeof(m), 0) != sizeof(m))
+    c_save_result(jobid, res);
 }
 
 void c_shutdown_server() {
@@ -89,3 +89,15 @@ char *get_environment() {
 
     return ptr;
 }
+
+/* FNV-1a of the environment, never 0, which means no environment. The
+ * client sends it instead of the body, see envstore.c. */
+uint64_t env_hash(const char *env) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *env != '\0'; ++env) {
+        hash ^= (unsigned char) *env;
+        hash *= 1099511628211ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
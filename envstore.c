@@ -0,0 +1,182 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2009  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+
+/* The environments of the jobs (the output of TS_ENV), one per content
+ * and owner, shared by all the jobs of that user with the same one. A
+ * client sends the hash of its environment, and the body only when the
+ * server asks for it with NEWJOB_ENV, so a sweep submitted from one
+ * shell uploads it once. The hash is only trusted for the user who
+ * uploaded the body: another user, whatever hash it sends, uploads its
+ * own. An environment leaves the store with its last job.
+ *
+ * The body is kept here too, for ts -i. It is stored under a key, the
+ * hash of the body unless that key is taken by another user or another
+ * body, then the next free one. The buckets go by key. */
+
+enum { ENV_INITIAL_SIZE = 64 };
+
+static struct {
+  struct Env **buckets;
+  int size; /* a power of two */
+  int count;
+} envs;
+
+static struct {
+  int jobs;
+  long uploads;
+  long upload_bytes;
+} env_stats;
+
+static unsigned int env_bucket(uint64_t key) {
+  return (unsigned int)(key ^ (key >> 32)) & (envs.size - 1);
+}
+
+/* 0 is no environment */
+static uint64_t next_key(uint64_t key) { return key + 1 == 0 ? 1 : key + 1; }
+
+static void env_grow() {
+  struct Env **old = envs.buckets;
+  int old_size = envs.size;
+  int i;
+
+  envs.size = old_size ? old_size * 2 : ENV_INITIAL_SIZE;
+  envs.buckets = (struct Env **)calloc(envs.size, sizeof(struct Env *));
+  if (envs.buckets == NULL)
+    error("Cannot allocate the environments of %i buckets", envs.size);
+
+  for (i = 0; i < old_size; ++i) {
+    struct Env *e = old[i];
+    while (e != NULL) {
+      struct Env *next = e->next;
+      unsigned int b = env_bucket(e->key);
+
+      e->next = envs.buckets[b];
+      envs.buckets[b] = e;
+      e = next;
+    }
+  }
+  free(old);
+}
+
+static struct Env *env_by_key(uint64_t key) {
+  struct Env *e;
+
+  if (envs.size == 0)
+    return NULL;
+  for (e = envs.buckets[env_bucket(key)]; e != NULL; e = e->next)
+    if (e->key == key)
+      return e;
+  return NULL;
+}
+
+static struct Env *env_new(uint64_t key, uint64_t hash, int ts_UID,
+                           char *body) {
+  struct Env *e;
+  unsigned int b;
+
+  if (envs.count >= envs.size)
+    env_grow();
+  e = (struct Env *)malloc(sizeof(*e));
+  if (e == NULL)
+    error("Cannot allocate an environment");
+  e->key = key;
+  e->hash = hash;
+  e->ts_UID = ts_UID;
+  e->refs = 0;
+  e->body = body;
+  b = env_bucket(key);
+  e->next = envs.buckets[b];
+  envs.buckets[b] = e;
+  envs.count++;
+  return e;
+}
+
+/* One more job with the environment e */
+struct Env *env_hold(struct Env *e) {
+  e->refs++;
+  env_stats.jobs++;
+  return e;
+}
+
+/* The environment of ts_UID with that hash, or NULL if the body has to
+ * be uploaded. The keys are walked from the hash, up to a free one. */
+struct Env *env_find(int ts_UID, uint64_t hash) {
+  uint64_t key = hash;
+  struct Env *e;
+
+  for (; (e = env_by_key(key)) != NULL; key = next_key(key))
+    if (e->hash == hash && e->ts_UID == ts_UID)
+      return e;
+  return NULL;
+}
+
+/* One more job of ts_UID with the environment body, received from a
+ * client: hashed here, compared with the one of the same hash, and
+ * stored if new. Takes body. */
+struct Env *env_add(int ts_UID, char *body) {
+  uint64_t hash = env_hash(body);
+  uint64_t key = hash;
+  struct Env *e;
+
+  for (; (e = env_by_key(key)) != NULL; key = next_key(key))
+    if (e->hash == hash && e->ts_UID == ts_UID && strcmp(e->body, body) == 0) {
+      free(body);
+      return env_hold(e);
+    }
+  env_stats.uploads++;
+  env_stats.upload_bytes += strlen(body) + 1;
+  e = env_new(key, hash, ts_UID, body);
+  insert_env_DB(key, body);
+  return env_hold(e);
+}
+
+/* The environment stored under key, for a job of ts_UID restored */
+struct Env *env_restore(int ts_UID, uint64_t key) {
+  struct Env *e = env_by_key(key);
+
+  if (e == NULL) {
+    char *body = read_env_DB(key);
+
+    if (body == NULL)
+      return NULL;
+    e = env_new(key, env_hash(body), ts_UID, body);
+  }
+  return env_hold(e);
+}
+
+void env_release(struct Env *env) {
+  struct Env **link;
+
+  if (env == NULL)
+    return;
+  env_stats.jobs--;
+  if (--env->refs > 0)
+    return;
+
+  link = &envs.buckets[env_bucket(env->key)];
+  while (*link != env)
+    link = &(*link)->next;
+  *link = env->next;
+  envs.count--;
+  remove_env_DB(env->key);
+  free(env->body);
+  free(env);
+}
+
+void s_send_env_stats(int s) {
+  char line[256];
+
+  snprintf(line, sizeof(line),
+           "Environments: %i stored for %i jobs, %li uploaded (%.1f KiB)\n",
+           envs.count, env_stats.jobs, env_stats.uploads,
+           env_stats.upload_bytes / 1024.0);
+  send_list_line(s, line);
+}
@@ -155,7 +155,7 @@ void error(const char *str, ...) {
     // }
 
     problem(ERROR, str, ap);
-    close_sqlite();
+    close_store();
     exit(-1);
 }
 
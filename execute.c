@@ -5,6 +5,8 @@
     Please find the license in the provided COPYING file.
 */
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,7 +17,6 @@
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
-#include <sys/inotify.h>
 
 #include <time.h>
 #include <unistd.h>
@@ -28,46 +29,39 @@
 extern int signals_child_pid; /* 0, not set. otherwise, set. */
 extern int client_uid;
 
-/*
-static int wait_for_pid(int pid)
-{
-    char path[32];
-    int in_fd = inotify_init();
-    sprintf(path, "/proc/%i/exe", pid);
-    if (inotify_add_watch(in_fd, path, IN_CLOSE_NOWRITE) < 0) {
-        close(in_fd);
-        return -1;
-    }
-
-    sprintf(path, "/proc/%i", pid);
-    int dir_fd = open(path, 0);
-    if (dir_fd < 0) {
-        close(in_fd);
-        return -1;
-    }
-
-    int res = 0;
-    while (1) {
-        struct inotify_event event;
-        if (read(in_fd, &event, sizeof(event)) < 0) {
-            res = -1;
-            break;
-        }
-        int f = openat(dir_fd, "fd", 0);
-        if (f < 0) break;
-        close(f);
-    }
+/* Look at the ended process every WAIT_PID_POLL_MS with no pidfd_open() */
+enum { WAIT_PID_POLL_MS = 100 };
 
-    close(dir_fd);
-    close(in_fd);
-    return res;
-}
-*/
+/* Wait for pid, which is not our child, to end, and return its wait
+ * status, or -1 if it cannot be told (see proc_ended()). Its pidfd
+ * signals at the exit. */
 static int wait_for_pid(int pid) {
-  while(kill(pid, 0) == 0) {
-    sleep(1);
+  char path[32];
+  int dir_fd, pidfd;
+  int status = -1;
+
+  sprintf(path, "/proc/%i", pid);
+  dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1)
+    return -1;
+
+  pidfd = open_pidfd(pid);
+  if (pidfd != -1) {
+    struct pollfd pfd;
+
+    pfd.fd = pidfd;
+    pfd.events = POLLIN;
+    /* SIGINT, passed to the job, interrupts it */
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+      ;
+    close(pidfd);
+    proc_ended(dir_fd, &status);
+  } else {
+    while (!proc_ended(dir_fd, &status))
+      usleep(WAIT_PID_POLL_MS * 1000);
   }
-  return -1;
+  close(dir_fd);
+  return status;
 }
 
 static int ptrace_pid(int pid) {
@@ -113,7 +107,11 @@ static void run_relink(int pid, struct Result *result) {
     status = wait_for_pid(pid);
   }
 
-  if (WIFEXITED(status)) {
+  if (status == -1) {
+    /* Not our child, and reaped by its parent: unknown */
+    result->died_by_signal = 0;
+    result->errorlevel = -1;
+  } else if (WIFEXITED(status)) {
     /* We force the proper cast */
     signed char tmp;
     tmp = WEXITSTATUS(status);
@@ -0,0 +1,96 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2009  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdlib.h>
+
+#include "main.h"
+
+/* Hash tables of jobs, chained through the jobs themselves (id_next or
+ * pid_next), so adding a job allocates nothing. They grow by doubling,
+ * and the lookups are O(1) at any queue size. A zeroed struct JobIndex
+ * is an empty index by jobid. */
+
+enum { INDEX_INITIAL_SIZE = 256 };
+
+static int index_key(const struct JobIndex *ix, const struct Job *p) {
+  return ix->by_pid ? p->pid : p->jobid;
+}
+
+static struct Job **index_link(const struct JobIndex *ix, struct Job *p) {
+  return ix->by_pid ? &p->pid_next : &p->id_next;
+}
+
+static unsigned int index_bucket(const struct JobIndex *ix, int key) {
+  /* Fibonacci hashing; the jobids are consecutive, the pids nearly */
+  return ((unsigned int)key * 2654435769u) & (ix->size - 1);
+}
+
+static void index_grow(struct JobIndex *ix) {
+  struct Job **old = ix->buckets;
+  int old_size = ix->size;
+  int i;
+
+  ix->size = old_size ? old_size * 2 : INDEX_INITIAL_SIZE;
+  ix->buckets = (struct Job **)calloc(ix->size, sizeof(struct Job *));
+  if (ix->buckets == NULL)
+    error("Cannot allocate the job index of %i buckets", ix->size);
+
+  for (i = 0; i < old_size; ++i) {
+    struct Job *p = old[i];
+    while (p != NULL) {
+      struct Job **link = index_link(ix, p);
+      struct Job *next = *link;
+      unsigned int b = index_bucket(ix, index_key(ix, p));
+
+      *link = ix->buckets[b];
+      ix->buckets[b] = p;
+      p = next;
+    }
+  }
+  free(old);
+}
+
+void jobindex_insert(struct JobIndex *ix, struct Job *p) {
+  unsigned int b;
+
+  if (ix->count >= ix->size)
+    index_grow(ix);
+  b = index_bucket(ix, index_key(ix, p));
+  *index_link(ix, p) = ix->buckets[b];
+  ix->buckets[b] = p;
+  ix->count++;
+}
+
+/* Does nothing if p is not in the index */
+void jobindex_remove(struct JobIndex *ix, struct Job *p) {
+  struct Job **link;
+
+  if (ix->size == 0)
+    return;
+  link = &ix->buckets[index_bucket(ix, index_key(ix, p))];
+
+  while (*link != NULL) {
+    if (*link == p) {
+      *link = *index_link(ix, p);
+      *index_link(ix, p) = NULL;
+      ix->count--;
+      return;
+    }
+    link = index_link(ix, *link);
+  }
+}
+
+struct Job *jobindex_find(const struct JobIndex *ix, int key) {
+  struct Job *p;
+
+  if (ix->size == 0)
+    return NULL;
+  p = ix->buckets[index_bucket(ix, key)];
+
+  while (p != NULL && index_key(ix, p) != key)
+    p = *index_link(ix, p);
+  return p;
+}
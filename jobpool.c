@@ -0,0 +1,206 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2009  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+
+/* The Job records come from slabs of JOB_SLAB_SIZE, and the strings of a
+ * job (command, work_dir, label and email) share a single block, its
+ * string arena. A job is then one slot in a slab plus one allocation,
+ * instead of one malloc per record and per string. A slab goes back to
+ * the system when all its records are free, except the last one. */
+
+enum { JOB_SLAB_SIZE = 512 };
+
+struct JobSlab {
+  struct JobSlab *prev; /* in the list of slabs with free records */
+  struct JobSlab *next;
+  struct Job *free;     /* chained through next */
+  int used;
+  struct Job jobs[JOB_SLAB_SIZE];
+};
+
+static struct JobSlab *partial_slabs = NULL;
+
+static struct {
+  int slabs;
+  int jobs;
+  int peak_jobs;
+  int arenas;
+  long arena_bytes;
+  int arena_strings;
+} pool;
+
+static void slab_link(struct JobSlab *slab) {
+  slab->prev = NULL;
+  slab->next = partial_slabs;
+  if (partial_slabs != NULL)
+    partial_slabs->prev = slab;
+  partial_slabs = slab;
+}
+
+static void slab_unlink(struct JobSlab *slab) {
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    partial_slabs = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+  slab->prev = slab->next = NULL;
+}
+
+static struct JobSlab *new_slab() {
+  struct JobSlab *slab;
+  int i;
+
+  slab = (struct JobSlab *)malloc(sizeof(*slab));
+  if (slab == NULL)
+    error("Cannot allocate a slab of %i jobs", JOB_SLAB_SIZE);
+  slab->used = 0;
+  slab->free = NULL;
+  for (i = JOB_SLAB_SIZE - 1; i >= 0; --i) {
+    slab->jobs[i].next = slab->free;
+    slab->free = &slab->jobs[i];
+  }
+  slab_link(slab);
+  pool.slabs++;
+  return slab;
+}
+
+/* A zeroed job */
+struct Job *job_alloc() {
+  struct JobSlab *slab = partial_slabs;
+  struct Job *p;
+
+  if (slab == NULL)
+    slab = new_slab();
+
+  p = slab->free;
+  slab->free = p->next;
+  if (++slab->used == JOB_SLAB_SIZE)
+    slab_unlink(slab);
+
+  memset(p, 0, sizeof(*p));
+  p->pidfd = -1;
+  p->slab = slab;
+  if (++pool.jobs > pool.peak_jobs)
+    pool.peak_jobs = pool.jobs;
+  return p;
+}
+
+static void free_strings(struct Job *p) {
+  if (p->strings == NULL)
+    return;
+  pool.arenas--;
+  pool.arena_bytes -= p->strings_size;
+  pool.arena_strings -= (p->command != NULL) + (p->work_dir != NULL) +
+                        (p->label != NULL) + (p->email != NULL);
+  free(p->strings);
+  p->strings = NULL;
+  p->strings_size = 0;
+  p->command = p->work_dir = p->label = p->email = NULL;
+}
+
+/* Only the record and its string arena; destroy_job() frees the rest */
+void job_free(struct Job *p) {
+  struct JobSlab *slab = p->slab;
+
+  free_strings(p);
+  if (slab->used-- == JOB_SLAB_SIZE)
+    slab_link(slab);
+  p->next = slab->free;
+  slab->free = p;
+  pool.jobs--;
+
+  if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+    slab_unlink(slab);
+    free(slab);
+    pool.slabs--;
+  }
+}
+
+/* Room for size bytes of strings in the job, replacing the former ones.
+ * The caller places command, work_dir, label and email inside, and then
+ * calls job_count_strings(). */
+char *job_strings_alloc(struct Job *p, int size) {
+  free_strings(p);
+  if (size < 1)
+    size = 1;
+  p->strings = (char *)malloc(size);
+  if (p->strings == NULL)
+    error("Cannot allocate %i bytes for the strings of the job %i", size,
+          p->jobid);
+  p->strings_size = size;
+  pool.arenas++;
+  pool.arena_bytes += size;
+  return p->strings;
+}
+
+void job_count_strings(struct Job *p) {
+  pool.arena_strings += (p->command != NULL) + (p->work_dir != NULL) +
+                        (p->label != NULL) + (p->email != NULL);
+}
+
+static char *arena_copy(char **pos, const char *str) {
+  char *res;
+
+  if (str == NULL)
+    return NULL;
+  res = *pos;
+  strcpy(res, str);
+  *pos += strlen(str) + 1;
+  return res;
+}
+
+/* Any of the strings may be NULL */
+void job_set_strings(struct Job *p, const char *command, const char *work_dir,
+                     const char *label, const char *email) {
+  int size = 0;
+  char *pos;
+
+  if (command != NULL)
+    size += strlen(command) + 1;
+  if (work_dir != NULL)
+    size += strlen(work_dir) + 1;
+  if (label != NULL)
+    size += strlen(label) + 1;
+  if (email != NULL)
+    size += strlen(email) + 1;
+
+  pos = job_strings_alloc(p, size);
+  p->command = arena_copy(&pos, command);
+  p->work_dir = arena_copy(&pos, work_dir);
+  p->label = arena_copy(&pos, label);
+  p->email = arena_copy(&pos, email);
+  job_count_strings(p);
+}
+
+void s_send_pool_stats(int s) {
+  char line[256];
+  /* One malloc per record and per string, as before the pool */
+  long before = (long)pool.jobs + pool.arena_strings;
+  long now = (long)pool.slabs + pool.arenas;
+
+  snprintf(line, sizeof(line), "Jobs: %i (peak %i)\n", pool.jobs,
+           pool.peak_jobs);
+  send_list_line(s, line);
+  snprintf(line, sizeof(line),
+           "Job records: %i slabs of %i, %.1f KiB, %i free slots\n",
+           pool.slabs, JOB_SLAB_SIZE,
+           pool.slabs * sizeof(struct JobSlab) / 1024.0,
+           pool.slabs * JOB_SLAB_SIZE - pool.jobs);
+  send_list_line(s, line);
+  snprintf(line, sizeof(line),
+           "String arenas: %i holding %i strings, %.1f KiB\n", pool.arenas,
+           pool.arena_strings, pool.arena_bytes / 1024.0);
+  send_list_line(s, line);
+  snprintf(line, sizeof(line),
+           "Heap blocks: %li, instead of %li with one per record and string\n",
+           now, before);
+  send_list_line(s, line);
+}
@@ -6,17 +6,25 @@
 */
 #define _DEFAULT_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "cjson/cJSON.h"
 #include "default.inc"
 #include "main.h"
 #include "user.h"
@@ -38,6 +46,26 @@ struct Notify {
 /* Globals */
 static struct Job firstjob = {0};
 static struct Job first_finished_job = {0};
+/* The tail of the queue, and the indexes of the jobs in the queue and in
+ * the finished list. Only the jobs of the queue are indexed by pid. */
+static struct Job *lastjob = &firstjob;
+static struct JobIndex queue_index = {0};
+static struct JobIndex finished_index = {0};
+static struct JobIndex pid_index = {NULL, 0, 0, 1};
+
+/* The finished list keeps at most max_finished_jobs, evicting the oldest.
+ * The evicted rows are retired in batches, and the store may keep them
+ * for ts --history. */
+enum { FINISHED_DELETE_BATCH = 64 };
+static struct Job *last_finished_job = &first_finished_job;
+static int finished_count = 0;
+static int max_finished_jobs = 0;
+static int evicted_jobids[FINISHED_DELETE_BATCH];
+static int evicted_count = 0;
+/* The jobs of each state in the queue and in the finished list, so a
+ * listing filtered by state stops once it has passed them all */
+static int queue_states[LOCKED + 1];
+static int finished_states[LOCKED + 1];
 static int jobids = 1000;
 /* This is used for dependencies from jobs
  * already out of the queue */
@@ -50,10 +78,29 @@ static struct Notify *first_notify = 0;
 static char buff[256];
 /* server will access them */
 int max_jobs;
+/* Jobs in the queue holding a client connection, compared to max_jobs.
+ * Detached jobs do not count. */
+static int jobs_with_client = 0;
+
+/* The QUEUED jobs of each user whose dependencies finished, in queue
+ * order, so next_run_job() does not walk the whole queue. The RELINK
+ * jobs go in their own queue. */
+struct JobQueue {
+  struct Job *head;
+  struct Job *tail;
+};
+static struct JobQueue ready_queue[USER_MAX];
+static struct JobQueue relink_queue;
+/* The user next_run_job() looks at first, round robin */
+static int next_user = 0;
+static int holding_jobs = 0;
 
 static struct Job *get_job(int jobid);
+static void set_job_state(struct Job *p, enum Jobstate state);
+static void job_event(const struct Job *p, enum JobEvent kind);
 static int fork_cmd(int UID, const char *path, const char *cmd);
 static int safe_pause_pid(struct Job *p);
+static int launch_job(struct Job *p);
 
 void notify_errorlevel(struct Job *p);
 
@@ -127,16 +174,17 @@ static void sound_notify(struct Job *p) {
 static void destroy_job(struct Job *p) {
   if (p != NULL) {
     free(p->notify_errorlevel_to);
-    free(p->command);
-    free(p->work_dir);
     free(p->output_filename);
     pinfo_free(&p->info);
+    env_release(p->env);
+    if (p->pidfd != -1)
+      close(p->pidfd);
     free(p->depend_on);
-    free(p->label);
 #ifdef TASKSET
     free(p->cores);
 #endif
-    free(p);
+    /* With the command, work_dir, label and email */
+    job_free(p);
   }
 }
 
@@ -154,146 +202,43 @@ static void free_cores(struct Job *p) {
 #endif
 }
 
-static int config_running(struct Job *p) {
-  if (p == NULL || (p->state != PAUSE && p->state != QUEUED)) return 1;
-
-#ifdef TASKSET
-    set_task_cores(p);
-#endif
-
-  if (is_sleep(p->pid)) {
-    kill_pids(p->pid, SIGCONT, NULL);
-  }
-
+/* Balanced by free_cores() */
+static void charge_slots(struct Job *p) {
   int ts_UID = p->ts_UID;
   user_busy[ts_UID] += p->num_slots;
   busy_slots += p->num_slots;
   p->num_allocated = p->num_slots;
   user_jobs[ts_UID]++;
-  p->state = RUNNING;
-  return 0;
 }
 
-/* Serialize a job and add it to the JSON array. Returns 1 for success, 0 for
- * failure. */
-static int add_job_to_json_array(struct Job *p, cJSON *jobs) {
-  cJSON *job = cJSON_CreateObject();
-  if (job == NULL) {
-    error("Error initializing JSON object for job %i.", p->jobid);
-    return 0;
-  }
-  cJSON_AddItemToArray(jobs, job);
-
-  /* Add fields */
-  cJSON *field;
-
-  /* ID */
-  field = cJSON_CreateNumber(p->jobid);
-  if (field == NULL) {
-    error("Error initializing JSON object for job %i field ID.", p->jobid);
-    return 0;
-  }
-  cJSON_AddItemToObject(job, "ID", field);
-
-  /* State */
-  const char *state_string = jstate2string(p->state);
-  field = cJSON_CreateStringReference(state_string);
-  if (field == NULL) {
-    error(
-        "Error initializing JSON object for job %i field State (value %d/%s).",
-        p->jobid, p->state, state_string);
-    return 0;
-  }
-  cJSON_AddItemToObject(job, "State", field);
-
-  /* num_slots */
-  field = cJSON_CreateNumber(p->num_slots);
-  if (field == NULL) {
-    error("Error initializing JSON object for job %i field ID.", p->jobid);
-    return 0;
-  }
-  cJSON_AddItemToObject(job, "Proc.", field);
-
-  /* user */
-  field = cJSON_CreateStringReference(user_name[p->ts_UID]);
-  if (field == NULL) {
-    error(
-        "Error initializing JSON object for job %i field State (value %d/%s).",
-        p->jobid, p->state, state_string);
-    return 0;
-  }
-  cJSON_AddItemToObject(job, "User", field);
-
-  /* label */
-
-  if (p->label != NULL) {
-    field = cJSON_CreateStringReference(p->label);
-  } else {
-    field = cJSON_CreateNull();
-  }
-  if (field == NULL) {
-    error(
-        "Error initializing JSON object for job %i field State (value %d/%s).",
-        p->jobid, p->state, state_string);
-    return 0;
-  }
-  cJSON_AddItemToObject(job, "Label", field);
-
-  /* Output */
-  field = cJSON_CreateStringReference(p->output_filename);
-  if (field == NULL) {
-    error("Error initializing JSON object for job %i field Output (value %s).",
-          p->jobid, p->output_filename);
-    return 0;
-  }
-  cJSON_AddItemToObject(job, "Output", field);
+static int config_running(struct Job *p) {
+  enum Jobstate was;
 
-  /* E-Level */
-  if (p->state == FINISHED) {
-    field = cJSON_CreateNumber(p->result.errorlevel);
-  } else {
-    field = cJSON_CreateNull();
-  }
-  if (field == NULL) {
-    error("Error initializing JSON object for job %i field E-Level.", p->jobid);
-    return 0;
-  }
-  cJSON_AddItemToObject(job, "E-Level", field);
+  if (p == NULL || (p->state != PAUSE && p->state != QUEUED)) return 1;
+  was = p->state;
 
-  /* Time */
-  if (p->state == FINISHED) {
-    field = cJSON_CreateNumber(p->result.real_ms);
-    if (field == NULL) {
-      error(
-          "Error initializing JSON object for job %i field Time_ms (value %d).",
-          p->result.real_ms);
-      return 0;
-    }
-  } else {
-    field = cJSON_CreateNull();
-    if (field == NULL) {
-      error("Error initializing JSON object for job %i field Time_ms (no "
-            "result).");
-      return 0;
-    }
-  }
-  cJSON_AddItemToObject(job, "Time_ms", field);
+#ifdef TASKSET
+    set_task_cores(p);
+#endif
 
-  /* Command */
-  field = cJSON_CreateStringReference(p->command + p->command_strip);
-  if (field == NULL) {
-    error("Error initializing JSON object for job %i field Command (value %s).",
-          p->jobid, p->command);
-    return 0;
+  if (is_sleep(p->pid)) {
+    kill_pids(p->pid, SIGCONT, NULL);
   }
-  cJSON_AddItemToObject(job, "Command", field);
 
-  return 1;
+  charge_slots(p);
+  set_job_state(p, RUNNING);
+  job_event(p, was == PAUSE ? EVENT_RESUMED : EVENT_STARTED);
+  return 0;
 }
 
 void send_list_line(int s, const char *str) {
   struct Msg m = default_msg();
 
+  if (s == LIST_STDOUT) {
+    fputs(str, stdout);
+    return;
+  }
+
   /* Message */
   m.type = LIST_LINE;
   m.u.size = strlen(str) + 1;
@@ -341,46 +286,84 @@ void s_sort_jobs() {
     }
     p = p->next;
   }
+  p_queue->next = NULL;
   p_run->next = queue.next;
+
+  /* Link back the new order */
+  lastjob = &firstjob;
+  for (p = firstjob.next; p != NULL; p = p->next) {
+    p->prev = lastjob;
+    lastjob = p;
+  }
 }
 
+/* Only for the jobs in the queue */
 static struct Job *find_previous_job(const struct Job *final) {
-  struct Job *p;
+  if (final == NULL)
+    return NULL;
+  return final->prev;
+}
 
-  /* Show Queued or Running jobs */
-  p = &firstjob;
-  while (p != NULL) {
-    if (p->next == final)
-      return p;
-    p = p->next;
+/* Link p in the queue after 'after' (&firstjob for the first place) */
+static void queue_link_after(struct Job *after, struct Job *p) {
+  p->prev = after;
+  p->next = after->next;
+  if (after->next != NULL)
+    after->next->prev = p;
+  else
+    lastjob = p;
+  after->next = p;
+}
+
+static void queue_unlink(struct Job *p) {
+  p->prev->next = p->next;
+  if (p->next != NULL)
+    p->next->prev = p->prev;
+  else
+    lastjob = p->prev;
+  p->next = NULL;
+  p->prev = NULL;
+}
+
+/* Add p at the end of the queue, with its jobid (and pid) set */
+static void queue_append(struct Job *p) {
+  queue_link_after(lastjob, p);
+  jobindex_insert(&queue_index, p);
+  queue_states[p->state]++;
+  if (p->pid != 0)
+    jobindex_insert(&pid_index, p);
+}
+
+/* Take p out of the queue, and of its indexes */
+static void queue_remove(struct Job *p) {
+  queue_unlink(p);
+  jobindex_remove(&queue_index, p);
+  queue_states[p->state]--;
+  if (p->pid != 0) {
+    jobindex_remove(&pid_index, p);
+    procstat_forget(p->pid);
   }
+}
 
-  return NULL;
+static void set_job_pid(struct Job *p, int pid) {
+  if (p->pid != 0) {
+    jobindex_remove(&pid_index, p);
+    procstat_forget(p->pid);
+  }
+  p->pid = pid;
+  if (p->pid != 0)
+    jobindex_insert(&pid_index, p);
 }
 
 struct Job *findjob(int jobid) {
-  struct Job *p;
-  /* Show Queued or Running jobs */
-  p = firstjob.next;
-  while (p != 0) {
-    if (p->jobid == jobid)
-      return p;
-    p = p->next;
-  }
-  return NULL;
+  /* Queued or Running jobs */
+  return jobindex_find(&queue_index, jobid);
 }
 
 static struct Job *job_by_pid(int pid) {
   if (pid == 0)
     return NULL;
-  struct Job *p = &firstjob;
-
-  while (p->next != NULL) {
-    p = p->next;
-    if (p->pid == pid)
-      return p;
-  }
-  return NULL;
+  return jobindex_find(&pid_index, pid);
 }
 
 // return 1 for running, other is dead
@@ -445,45 +428,156 @@ static struct Job *findjob_holding_client() {
 }
 
 static struct Job *find_finished_job(int jobid) {
-  struct Job *p;
+  return jobindex_find(&finished_index, jobid);
+}
 
-  /* Show Queued or Running jobs */
-  p = first_finished_job.next;
-  while (p != 0) {
-    if (p->jobid == jobid)
-      return p;
-    p = p->next;
-  }
+static struct JobQueue *queue_of_state(const struct Job *p,
+                                       enum Jobstate state) {
+  if (state == QUEUED)
+    return p->pending_deps == 0 ? &ready_queue[p->ts_UID] : NULL;
+  if (state == RELINK)
+    return &relink_queue;
+  return NULL;
+}
 
-  return 0;
+static int in_job_queue(const struct JobQueue *q, const struct Job *p) {
+  return p->ready_prev != NULL || q->head == p;
 }
 
-static int count_not_finished_jobs() {
-  int count = 0;
-  struct Job *p;
+static void job_queue_unlink(struct JobQueue *q, struct Job *p) {
+  if (p->ready_prev != NULL)
+    p->ready_prev->ready_next = p->ready_next;
+  else
+    q->head = p->ready_next;
+  if (p->ready_next != NULL)
+    p->ready_next->ready_prev = p->ready_prev;
+  else
+    q->tail = p->ready_prev;
+  p->ready_prev = p->ready_next = NULL;
+}
 
-  /* Show Queued or Running jobs */
-  p = firstjob.next;
-  while (p != 0) {
-    ++count;
-    p = p->next;
+/* The place of p in the main queue. A job not stored yet is the last
+ * one: it gets the next order_id when it is. */
+static int queue_order(const struct Job *p) {
+  return p->order_id != 0 ? p->order_id : INT_MAX;
+}
+
+/* Put p in q by its order_id, to keep the order of the main queue. The
+ * walk starts at the tail, so new jobs and those whose dependencies end
+ * in order go in O(1), as do the urgent ones at the head. */
+static void job_queue_insert(struct JobQueue *q, struct Job *p) {
+  struct Job *prev = q->tail;
+  int order = queue_order(p);
+
+  if (q->head != NULL && order < queue_order(q->head))
+    prev = NULL;
+  else
+    while (prev != NULL && queue_order(prev) > order)
+      prev = prev->ready_prev;
+
+  p->ready_prev = prev;
+  p->ready_next = prev != NULL ? prev->ready_next : q->head;
+  if (p->ready_next != NULL)
+    p->ready_next->ready_prev = p;
+  else
+    q->tail = p;
+  if (prev != NULL)
+    prev->ready_next = p;
+  else
+    q->head = p;
+}
+
+/* All the state changes of the jobs in the queue go through here, to
+ * keep the ready queues and the user_queue counters right. A job fresh
+ * from calloc() is QUEUED, but in no queue yet. */
+static void set_job_state(struct Job *p, enum Jobstate state) {
+  struct JobQueue *from = queue_of_state(p, p->state);
+  struct JobQueue *to = queue_of_state(p, state);
+  int *states = NULL;
+
+  snapshot_changed();
+
+  if (findjob(p->jobid) == p)
+    states = queue_states;
+  else if (find_finished_job(p->jobid) == p)
+    states = finished_states;
+  if (states != NULL) {
+    states[p->state]--;
+    states[state]++;
+  }
+
+  if (from != NULL && in_job_queue(from, p))
+    job_queue_unlink(from, p);
+  if (p->state == HOLDING_CLIENT)
+    holding_jobs--;
+  if (p->in_user_queue) {
+    user_queue[p->ts_UID]--;
+    p->in_user_queue = 0;
+  }
+
+  p->state = state;
+
+  if (to != NULL)
+    job_queue_insert(to, p);
+  if (state == HOLDING_CLIENT)
+    holding_jobs++;
+  if (state == QUEUED || state == HOLDING_CLIENT) {
+    user_queue[p->ts_UID]++;
+    p->in_user_queue = 1;
   }
-  return count;
 }
 
-static void add_notify_errorlevel_to(struct Job *job, int jobid) {
-  int *p;
-  int newsize = (job->notify_errorlevel_to_size + 1) * sizeof(int);
-  p = (int *)realloc(job->notify_errorlevel_to, newsize);
+/* Take p out of its ready queue before moving it in the main queue.
+ * Returns the queue to put it back with job_queue_insert(), or NULL. */
+static struct JobQueue *job_queue_leave(struct Job *p) {
+  struct JobQueue *q = queue_of_state(p, p->state);
 
-  if (p == 0)
-    error("Cannot allocate more memory for notify_errorlist_to for jobid %i,"
-          " having already %i elements",
-          job->jobid, job->notify_errorlevel_to_size);
+  if (q == NULL || !in_job_queue(q, p))
+    return NULL;
+  job_queue_unlink(q, p);
+  return q;
+}
+
+/* Keep jobs_with_client right when a job enters or leaves the queue */
+static void count_job_client(const struct Job *p, int delta) {
+  if (!p->detached)
+    jobs_with_client += delta;
+}
+
+/* Make 'dependent' wait for 'job', which is still in the queue */
+static void add_notify_errorlevel_to(struct Job *job, struct Job *dependent) {
+  if (job->notify_errorlevel_to_size == job->notify_errorlevel_to_allocated) {
+    int *p;
+    int newalloc = job->notify_errorlevel_to_allocated * 2;
+
+    if (newalloc < 4)
+      newalloc = 4;
+    p = (int *)realloc(job->notify_errorlevel_to, newalloc * sizeof(int));
+    if (p == 0)
+      error("Cannot allocate more memory for notify_errorlist_to for jobid %i,"
+            " having already %i elements",
+            job->jobid, job->notify_errorlevel_to_size);
+    job->notify_errorlevel_to = p;
+    job->notify_errorlevel_to_allocated = newalloc;
+  }
 
-  job->notify_errorlevel_to = p;
-  job->notify_errorlevel_to_size += 1;
-  job->notify_errorlevel_to[job->notify_errorlevel_to_size - 1] = jobid;
+  job->notify_errorlevel_to[job->notify_errorlevel_to_size++] =
+      dependent->jobid;
+
+  /* Not ready to run until all of them finish */
+  if (dependent->pending_deps == 0)
+    job_queue_leave(dependent);
+  dependent->pending_deps++;
+}
+
+/* One of the jobs p depends on left the queue */
+static void dependency_done(struct Job *p) {
+  if (p->pending_deps <= 0) {
+    warning("The jobid %i has no pending dependencies", p->jobid);
+    return;
+  }
+  if (--p->pending_deps == 0 && p->state == QUEUED)
+    job_queue_insert(&ready_queue[p->ts_UID], p);
 }
 
 void s_kill_all_jobs(int s, int ts_UID) {
@@ -536,18 +630,13 @@ void s_get_label(int s, int jobid) {
 
   if (jobid == -1) {
     /* Find the last job added */
-    p = firstjob.next;
-
-    if (p != 0)
-      while (p->next != 0)
-        p = p->next;
+    if (lastjob != &firstjob)
+      p = lastjob;
 
     /* Look in finished jobs if needed */
     if (p == 0) {
-      p = first_finished_job.next;
-      if (p != 0)
-        while (p->next != 0)
-          p = p->next;
+      if (last_finished_job != &first_finished_job)
+        p = last_finished_job;
     }
 
   } else {
@@ -577,18 +666,13 @@ void s_send_cmd(int s, int jobid) {
 
   if (jobid == -1) {
     /* Find the last job added */
-    p = firstjob.next;
-
-    if (p != 0)
-      while (p->next != 0)
-        p = p->next;
+    if (lastjob != &firstjob)
+      p = lastjob;
 
     /* Look in finished jobs if needed */
     if (p == 0) {
-      p = first_finished_job.next;
-      if (p != 0)
-        while (p->next != 0)
-          p = p->next;
+      if (last_finished_job != &first_finished_job)
+        p = last_finished_job;
     }
 
   } else {
@@ -628,14 +712,18 @@ void s_mark_job_running(int jobid) {
   if (!p)
     error("Cannot mark the jobid %i RUNNING.", jobid);
   if (p->state == RELINK) {
+    /* The slots it held since the restore, charged again below */
+    if (p->num_allocated != 0)
+      free_cores(p);
     if (p->output_filename == NULL) {
       p->output_filename = get_ofile_from_FD(p->pid);
     }
     if (is_sleep(p->pid) == 1) {
-      p->state = PAUSE;
+      set_job_state(p, PAUSE);
+      job_event(p, EVENT_PAUSED);
       return;
     } else {
-      p->state = QUEUED;
+      set_job_state(p, QUEUED);
     }
   }
   if (config_running(p)) {
@@ -646,9 +734,12 @@ void s_mark_job_running(int jobid) {
 /* -1 means nothing awaken, otherwise returns the jobid awaken */
 int wake_hold_client() {
   struct Job *p;
+
+  if (holding_jobs == 0)
+    return -1;
   p = findjob_holding_client();
   if (p) {
-    p->state = QUEUED;
+    set_job_state(p, QUEUED);
     return p->jobid;
   }
   return -1;
@@ -691,148 +782,333 @@ const char *jstate2string(enum Jobstate s) {
   return jobstate;
 }
 
-void s_list(int s, int ts_UID, enum ListFormat listFormat) {
+/* The jobs a listing shows, from a LIST or LIST_ALL request */
+struct ListFilter {
+  int ts_UID;        /* -1 for all the users */
+  int states;        /* bits (1 << state), 0 for all */
+  const char *label; /* glob, NULL for any */
+  int jobid_from;    /* 0 for no bound */
+  int jobid_to;
+};
+
+static int state_listed(const struct ListFilter *f, const struct Job *p) {
+  return f->states == 0 || (f->states & (1 << p->state)) != 0;
+}
+
+/* The filter but for the states, as ts --watch takes it */
+static int job_match(const struct ListFilter *f, const struct Job *p) {
+  if (f->ts_UID != -1 && p->ts_UID != f->ts_UID)
+    return 0;
+  if (f->jobid_from != 0 && p->jobid < f->jobid_from)
+    return 0;
+  if (f->jobid_to != 0 && p->jobid > f->jobid_to)
+    return 0;
+  if (f->label != NULL &&
+      (p->label == NULL || fnmatch(f->label, p->label, 0) != 0))
+    return 0;
+  return 1;
+}
+
+static int list_match(const struct ListFilter *f, const struct Job *p) {
+  return p->state != HOLDING_CLIENT && state_listed(f, p) && job_match(f, p);
+}
+
+/* A walk over the queue and then the finished list. left[] are the jobs
+ * in the states of the filter not passed yet in each list: at 0 the rest
+ * of the list is skipped, so a filter on the running jobs does not walk
+ * the jobs queued behind them. */
+struct ListWalk {
+  const struct ListFilter *f;
+  struct Job *p; /* NULL past the ends */
+  int finished;  /* p is in the finished list */
+  int left[2];
+};
+
+static int states_count(const int *counts, int states) {
+  int i;
+  int n = 0;
+
+  for (i = 0; i <= LOCKED; ++i)
+    if (states == 0 || (states & (1 << i)) != 0)
+      n += counts[i];
+  return n;
+}
+
+static void walk_begin(struct ListWalk *w, const struct ListFilter *f) {
+  w->f = f;
+  w->p = NULL;
+  w->finished = 0;
+  w->left[0] = states_count(queue_states, f->states);
+  w->left[1] = states_count(finished_states, f->states);
+}
+
+static struct Job *walk_pass(struct ListWalk *w, struct Job *p) {
+  if (p != NULL && state_listed(w->f, p))
+    w->left[w->finished]--;
+  w->p = p;
+  return p;
+}
+
+/* From the start of the queue, on a fresh walk */
+static struct Job *walk_next(struct ListWalk *w) {
   struct Job *p;
+
+  if (w->p != NULL)
+    p = w->p->next;
+  else
+    p = w->finished ? first_finished_job.next : firstjob.next;
+
+  if (!w->finished && (p == NULL || w->left[0] <= 0)) {
+    w->finished = 1;
+    p = first_finished_job.next;
+  }
+  if (w->finished && w->left[1] <= 0)
+    p = NULL;
+  return walk_pass(w, p);
+}
+
+/* From the end of the finished list, on a fresh walk */
+static struct Job *walk_prev(struct ListWalk *w) {
+  struct Job *p;
+
+  if (w->p == NULL) {
+    w->finished = 1;
+    p = last_finished_job;
+  } else
+    p = w->p->prev;
+  if (w->finished && (p == &first_finished_job || w->left[1] <= 0)) {
+    w->finished = 0;
+    p = lastjob;
+  }
+  if (!w->finished && (p == &firstjob || w->left[0] <= 0))
+    p = NULL;
+  return walk_pass(w, p);
+}
+
+/* The jobs matching f, in the listing order, from the offset-th one (from
+ * the end if negative) and at most limit of them (0 for all). The cost is
+ * in the jobs passed, not in the size of the lists. */
+static void list_filtered(const struct ListFilter *f, int offset, int limit,
+                          const char *finished_header) {
+  struct ListWalk w;
+  struct Job *p;
+  int shown = 0;
+  int queue_shown = 0;
+
+  walk_begin(&w, f);
+  if (offset < 0) {
+    int found = 0;
+
+    /* Back to the -offset-th match from the end, or the first job */
+    while (found < -offset && (p = walk_prev(&w)) != NULL)
+      if (list_match(f, p))
+        found++;
+    if (found == -offset) {
+      /* The walk back passed the rest already */
+      w.left[0] = w.left[1] = INT_MAX;
+      w.p = w.p->prev;
+      if (w.p == &first_finished_job || w.p == &firstjob)
+        w.p = NULL;
+    } else
+      walk_begin(&w, f);
+    offset = 0;
+  }
+
+  while ((p = walk_next(&w)) != NULL) {
+    if (!list_match(f, p))
+      continue;
+    if (offset > 0) {
+      offset--;
+      continue;
+    }
+    if (w.finished && queue_shown > 0 && finished_header != NULL) {
+      list_text(finished_header);
+      finished_header = NULL;
+    }
+    list_job(p);
+    if (!w.finished)
+      queue_shown++;
+    if (++shown == limit)
+      break;
+  }
+}
+
+/* Receives the label glob of the request, if any. Returns -1 if wrong. */
+static int list_label_from_msg(int s, const struct Msg *m, char **label) {
+  int size = m->u.list.label_size;
+
+  *label = NULL;
+  if (size > 0) {
+    *label = (char *)malloc(size);
+    if (*label == NULL || recv_bytes(s, *label, size) != size) {
+      warning("Cannot receive the label of the list");
+      free(*label);
+      *label = NULL;
+      return -1;
+    }
+    (*label)[size - 1] = '\0';
+  }
+  return 0;
+}
+
+/* Keeps ts_UID to its own jobs but for the root. Returns -1 if wrong,
+ * told to s. */
+static int list_filter_from_msg(int s, int ts_UID, const struct Msg *m,
+                                const char *label, struct ListFilter *f) {
+  f->ts_UID = -1;
+  f->states = m->u.list.states;
+  f->label = label;
+  f->jobid_from = m->u.list.jobid_from;
+  f->jobid_to = m->u.list.jobid_to;
+
+  if (m->u.list.uid != -1) {
+    f->ts_UID = get_tsUID(m->u.list.uid);
+    if (f->ts_UID == -1) {
+      send_list_line(s, "The user is not in the server.\n");
+      return -1;
+    }
+  }
+  /* The users see their own jobs */
+  if (ts_UID != 0) {
+    if (f->ts_UID != -1 && f->ts_UID != ts_UID) {
+      send_list_line(s, "Only the root can see the jobs of other users.\n");
+      return -1;
+    }
+    f->ts_UID = ts_UID;
+  }
+  return 0;
+}
+
+void s_list(int s, int ts_UID, const struct Msg *m) {
+  char *label;
+
+  if (list_label_from_msg(s, m, &label) != 0)
+    return;
+  s_list_filtered(s, ts_UID, m, label);
+  free(label);
+}
+
+/* The listing of s_list() with its label glob, also printed by a client
+ * from the snapshot with s == LIST_STDOUT */
+void s_list_filtered(int s, int ts_UID, const struct Msg *m,
+                     const char *label) {
+  enum ListFormat listFormat = m->u.list.list_format;
+  struct ListFilter f;
   char *buffer;
+
+  if (list_filter_from_msg(s, ts_UID, m, label, &f) != 0)
+    return;
+
+  list_begin(s, listFormat, m->u.list.fields);
   if (listFormat == DEFAULT) {
     /* Times:   0.00/0.00/0.00 - 4+4+4+2 = 14*/
     buffer = joblist_headers();
-    send_list_line(s, buffer);
+    list_text(buffer);
     free(buffer);
+  }
+  list_filtered(&f, m->u.list.offset, m->u.list.limit,
+                listFormat == DEFAULT ? "----- Finished -----\n" : NULL);
+  list_end();
 
-    /* Show Queued or Running jobs */
-    p = firstjob.next;
-    while (p != NULL) {
-      if (p->state != HOLDING_CLIENT) {
-        if (p->ts_UID == ts_UID || ts_UID == 0) {
-          buffer = joblist_line(p);
-          // sprintf(buf, "== jobid = %d\n", p->jobid);
-          // send_list_line(s, buf);
-          send_list_line(s, buffer);
-          free(buffer);
-        }
-      }
-      p = p->next;
-    }
-
-    p = first_finished_job.next;
-    if (p != NULL && firstjob.next != NULL)
-      send_list_line(s, "----- Finished -----\n");
-
-    /* Show Finished jobs */
-    while (p != NULL) {
-      if (p->ts_UID == ts_UID || ts_UID == 0) {
-        buffer = joblist_line(p);
-        send_list_line(s, buffer);
-        free(buffer);
-      }
-      p = p->next;
-    }
+  if (listFormat == DEFAULT) {
     if (ts_UID == 0) {
       s_user_status_all(s);
     } else {
       s_user_status(s, ts_UID);
     }
-  } else if (listFormat == JSON) {
-    cJSON *jobs = cJSON_CreateArray();
-    if (jobs == NULL) {
-      error("Error initializing JSON array.");
-      goto end;
-    }
-    /* Serialize Queued or Running jobs */
-    p = firstjob.next;
-    while (p != NULL) {
-      if (p->state != HOLDING_CLIENT) {
-        int success = add_job_to_json_array(p, jobs);
-        if (success == 0) {
-          goto end;
-        }
-      }
-      p = p->next;
-    }
-
-    /* Serialize Finished jobs */
-    p = first_finished_job.next;
-    while (p != 0) {
-      int success = add_job_to_json_array(p, jobs);
-      if (success == 0) {
-        goto end;
-      }
-      p = p->next;
-    }
+  }
+}
 
-    buffer = cJSON_PrintUnformatted(jobs);
-    if (buffer == NULL) {
-      error("Error converting jobs to JSON.");
-      goto end;
-    }
+/* ts -A: the jobs of all the users, as root sees them */
+void s_list_all(int s, const struct Msg *m) { s_list(s, 0, m); }
 
-    // append newline
-    size_t buffer_strlen = strlen(buffer);
-    buffer = realloc(buffer, buffer_strlen + 1 + 1);
-    strcat(buffer, "\n");
+/* The clients of ts --watch, each told of the jobs matching its filter */
+struct Watcher {
+  int socket;
+  int dropped; /* shut down, until the server loop cleans it */
+  struct ListFilter filter;
+  char *label;
+  struct Watcher *next;
+};
 
-    send_list_line(s, buffer);
-    goto end;
+static struct Watcher *first_watcher = 0;
 
-  end:
-    cJSON_Delete(jobs);
-    free(buffer);
-    // end of Json
-  } else if (listFormat == TAB) {
-    /* Show Queued or Running jobs */
-    p = firstjob.next;
-    while (p != 0) {
-      if (p->state != HOLDING_CLIENT) {
-        buffer = joblist_line_plain(p);
-        send_list_line(s, buffer);
-        free(buffer);
-      }
-      p = p->next;
-    }
+/* Returns 0 if refused, and then the connection is closed */
+int s_watch(int s, int ts_UID, const struct Msg *m) {
+  struct Watcher *w;
+  struct ListFilter f;
+  char *label;
 
-    p = first_finished_job.next;
+  if (list_label_from_msg(s, m, &label) != 0)
+    return 0;
+  if (list_filter_from_msg(s, ts_UID, m, label, &f) != 0) {
+    free(label);
+    return 0;
+  }
+  /* An event is on the move between the states */
+  f.states = 0;
 
-    /* Show Finished jobs */
-    while (p != 0) {
-      buffer = joblist_line_plain(p);
-      send_list_line(s, buffer);
-      free(buffer);
-      p = p->next;
-    }
-  } // end of TAB
+  w = (struct Watcher *)malloc(sizeof(*w));
+  if (w == NULL) {
+    send_list_line(s, "Cannot allocate the watch.\n");
+    free(label);
+    return 0;
+  }
+  /* A watcher that does not read must not block the server */
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+  w->socket = s;
+  w->dropped = 0;
+  w->filter = f;
+  w->label = label;
+  w->next = first_watcher;
+  first_watcher = w;
+  return 1;
 }
 
-void s_list_all(int s, enum ListFormat listFormat) {
-  struct Job *p;
-  char *buffer;
+/* Tell the watchers of p. A watcher whose socket is full is shut down;
+ * it sees the end of the events, and the loop cleans its connection. */
+static void job_event(const struct Job *p, enum JobEvent kind) {
+  struct Watcher *w;
+  struct Msg m;
 
-  /* Times:   0.00/0.00/0.00 - 4+4+4+2 = 14*/
-  buffer = joblist_headers();
-  send_list_line(s, buffer);
-  free(buffer);
+  if (first_watcher == NULL)
+    return;
 
-  /* Show Queued or Running jobs */
-  p = firstjob.next;
-  while (p != 0) {
-    if (p->state != HOLDING_CLIENT) {
-      buffer = joblist_line(p);
-      send_list_line(s, buffer);
-      free(buffer);
+  m = default_msg();
+  m.type = EVENT;
+  m.jobid = p->jobid;
+  m.u.event.kind = kind;
+  m.u.event.uid = user_UID[p->ts_UID];
+  if (kind == EVENT_FINISHED) {
+    m.u.event.errorlevel = p->result.errorlevel;
+    m.u.event.signal = p->result.died_by_signal ? p->result.signal : 0;
+  }
+
+  for (w = first_watcher; w != NULL; w = w->next) {
+    if (w->dropped || !job_match(&w->filter, p))
+      continue;
+    if (send(w->socket, &m, sizeof(m), 0) != sizeof(m)) {
+      warning("Dropping the watcher %i, which does not read", w->socket);
+      shutdown(w->socket, SHUT_RDWR);
+      w->dropped = 1;
     }
-    p = p->next;
   }
+}
 
-  p = first_finished_job.next;
-  if (p != NULL && firstjob.next != NULL)
-    send_list_line(s, "\n ----- Finished -----\n");
+/* Don't complain, if the socket is not a watcher */
+void s_remove_watcher(int s) {
+  struct Watcher **link = &first_watcher;
 
-  /* Show Finished jobs */
-  while (p != 0) {
-    buffer = joblist_line(p);
-    send_list_line(s, buffer);
-    free(buffer);
-    p = p->next;
+  while (*link != NULL) {
+    struct Watcher *w = *link;
+
+    if (w->socket == s) {
+      *link = w->next;
+      free(w->label);
+      free(w);
+      return;
+    }
+    link = &w->next;
   }
 }
 
@@ -864,47 +1140,19 @@ void s_list_plain(int s) {
 }
 */
 
-static struct Job *newjobptr() {
+/* Add a blank job with the given jobid at the end of the queue */
+static struct Job *new_job(int jobid) {
   struct Job *p;
 
-  p = &firstjob;
-  while (p->next != 0)
-    p = p->next;
-
-  p->next = (struct Job *)calloc(sizeof(struct Job), sizeof(char));
+  p = job_alloc();
 #ifdef TASKSET
-  p->next->taskset_flag = 1;
+  p->taskset_flag = 1;
 #else
-  p->next->taskset_flag = 0;
+  p->taskset_flag = 0;
 #endif
-  /*
-  p->next->next = 0;
-  p->next->output_filename = 0;
-  p->next->pid = 0;
-  p->next->command  = NULL;
-  p->next->work_dir = NULL;
-  p->next->command_strip = 0;
-  p->next->depend_on = NULL;
-  p->next->notify_errorlevel_to = NULL;
-  p->result.errorlevel = 0;
-  #ifdef TASKSET
-  p->next->cores = NULL;
-  #endif
-
-
-  struct Procinfo* info= &(p->next->info);
-  info->enqueue_time.tv_sec  = 0;
-  info->start_time.tv_sec    = 0;
-  info->end_time.tv_sec      = 0;
-  info->enqueue_time.tv_usec = 0;
-  info->start_time.tv_usec   = 0;
-  info->end_time.tv_usec     = 0;
-  struct Result* result = &(p->next->result);
-  result->user_ms = 0.0;
-  result->system_ms = 0.0;
-  result->real_ms = 0.0;
-  */
-  return p->next;
+  p->jobid = jobid;
+  queue_append(p);
+  return p;
 }
 
 /* Returns -1 if no last job id found */
@@ -937,16 +1185,66 @@ static int find_last_stored_jobid_finished() {
   return last_jobid;
 }
 
+/* Receive the rest of a NEWJOB message and throw it away. The
+ * environment is not asked for. */
+static void s_discard_newjob(int s, const struct Msg *m) {
+  int sizes[4];
+  int i, n;
+
+  if (m->u.newjob.depend_on_size)
+    free(recv_ints(s, &n));
+
+  sizes[0] = m->u.newjob.command_size;
+  sizes[1] = m->u.newjob.path_size;
+  sizes[2] = m->u.newjob.label_size;
+  sizes[3] = m->u.newjob.email_size;
+  for (i = 0; i < 4; ++i) {
+    char *ptr;
+    if (sizes[i] <= 0)
+      continue;
+    ptr = (char *)malloc(sizes[i]);
+    if (ptr == 0)
+      error("Cannot allocate memory in s_discard_newjob (%i)", sizes[i]);
+    if (recv_bytes(s, ptr, sizes[i]) == -1)
+      error("wrong bytes received");
+    free(ptr);
+  }
+}
+
 /* Returns job id or -1 on error */
+/* The client went away in the middle of its job: a new job is dropped,
+ * a restored one stays as it was */
+static int newjob_failed(struct Job *p, int restored) {
+  warning("The client of the jobid %i went away while sending it", p->jobid);
+  if (!restored)
+    s_delete_job(p->jobid);
+  return -1;
+}
+
 int s_newjob(int s, struct Msg *m, int ts_UID) {
 
   struct Job *p = NULL;
   int res;
+  int restored;
   // int waitjob_flag = 0; // 0 for newjob, 1 for WAIT and 2 for DELINK
   if (m->jobid != 0) {
     p = findjob(m->jobid);
     // if p == NULL => Manual Relink
     if (p != NULL) {
+      if (job_awaits_runner(p->jobid)) {
+        /* The runner forked in s_spawn_runner(). The job was already
+         * defined, so only drain what the client sends. */
+        if (ts_UID != 0 && ts_UID != p->ts_UID)
+          return -1;
+        s_discard_newjob(s, m);
+        p->detached = 0;
+        if (p->pidfd != -1) {
+          close(p->pidfd);
+          p->pidfd = -1;
+        }
+        count_job_client(p, 1);
+        return p->jobid;
+      }
       // WAIT for restore queued tasks
       if (p->state == DELINK) {
         ; // waitjob_flag = 2;
@@ -962,45 +1260,65 @@ int s_newjob(int s, struct Msg *m, int ts_UID) {
     }
   }
 
+  /* A job restored from the database, the client submits it again */
+  restored = (p != NULL);
   if (p == NULL) {
-    p = newjobptr();
     if (m->jobid != 0) {
-      p->jobid = m->jobid;
+      p = new_job(m->jobid);
       jobids = jobids > m->jobid ? jobids : m->jobid + 1;
     } else {
-      p->jobid = jobids++;
+      p = new_job(jobids++);
     }
-    if (count_not_finished_jobs() < max_jobs) {
-      p->state = QUEUED;
-    } else
-      p->state = HOLDING_CLIENT;
-
-    // manually relink
+    /* The ready queues are per user */
+    p->ts_UID = ts_UID;
     if (m->u.newjob.taskpid != 0) {
-      p->state = RELINK;
+      // manually relink
+      set_job_state(p, RELINK);
       printf("relink to pid: %d\n", m->u.newjob.taskpid);
-    }
+    } else if (m->u.newjob.detach) {
+      /* No client will wait, so there is no reason to hold it */
+      p->detached = 1;
+      set_job_state(p, QUEUED);
+    } else if (jobs_with_client < max_jobs) {
+      set_job_state(p, QUEUED);
+    } else
+      set_job_state(p, HOLDING_CLIENT);
+    count_job_client(p, 1);
+  } else if (p->state == WAIT && m->u.newjob.detach) {
+    /* A restored queued job, submitted again by a detached client */
+    count_job_client(p, -1);
+    p->detached = 1;
   }
   // save the ts_UID and record the number of waiting jobs
   p->ts_UID = ts_UID; // get_tsUID(m->uid);
   p->num_slots = m->u.newjob.num_slots;
   p->store_output = m->u.newjob.store_output;
   p->should_keep_finished = m->u.newjob.should_keep_finished;
-  p->notify_errorlevel_to = 0;
-  p->notify_errorlevel_to_size = 0;
-  p->depend_on_size = m->u.newjob.depend_on_size;
-  p->depend_on = 0;
   p->taskset_flag = m->u.newjob.taskset_flag;
 
+  /* A restored job keeps the dependencies it was stored with, linked
+   * again by rebuild_dependencies() */
+  if (restored && m->u.newjob.depend_on_size) {
+    int foo;
+    free(recv_ints(s, &foo));
+  }
+
   /* this error level here is used internally to decide whether a job should be
    * run or not so it only matters whether the error level is 0 or not. thus,
    * summing the absolute error levels of all dependencies is sufficient.*/
-  p->dependency_errorlevel = 0;
-  if (m->u.newjob.depend_on_size) {
+  if (!restored) {
+    p->depend_on_size = m->u.newjob.depend_on_size;
+    p->depend_on = 0;
+    p->dependency_errorlevel = 0;
+  }
+  if (!restored && m->u.newjob.depend_on_size) {
     int *depend_on;
     int foo;
     depend_on = recv_ints(s, &foo);
     assert(p->depend_on_size == foo);
+    p->depend_on = (int *)malloc(p->depend_on_size * sizeof(int));
+    if (p->depend_on == NULL)
+      error("Cannot allocate the dependencies of the jobid %i", p->jobid);
 
     /* Depend on the last queued job. */
     int idx = 0;
@@ -1009,7 +1327,6 @@ int s_newjob(int s, struct Msg *m, int ts_UID) {
       if (depend_on[i] >= p->jobid)
         continue;
 
-      p->depend_on = (int *)realloc(p->depend_on, (idx + 1) * sizeof(int));
       /* As we already have 'p' in the queue,
        * neglect it during the find_last_jobid_in_queue() */
       if (depend_on[i] == -1) {
@@ -1028,7 +1345,7 @@ int s_newjob(int s, struct Msg *m, int ts_UID) {
           struct Job *depended_job;
           depended_job = findjob(p->depend_on[idx]);
           if (depended_job != 0)
-            add_notify_errorlevel_to(depended_job, p->jobid);
+            add_notify_errorlevel_to(depended_job, p);
           else
             warning("The jobid %i is queued to do_depend on the jobid %i"
                     " suddenly non existent in the queue",
@@ -1061,7 +1378,7 @@ int s_newjob(int s, struct Msg *m, int ts_UID) {
         depended_job = findjob(p->depend_on[idx]);
 
         if (depended_job != 0)
-          add_notify_errorlevel_to(depended_job, p->jobid);
+          add_notify_errorlevel_to(depended_job, p);
         else {
           struct Job *parent;
           parent = find_finished_job(p->depend_on[idx]);
@@ -1082,138 +1399,278 @@ int s_newjob(int s, struct Msg *m, int ts_UID) {
 
   /* if dependency list is empty after removing invalid dependencies, make it
    * independent */
-  if (p->depend_on_size == 0)
+  if (p->depend_on_size == 0) {
+    free(p->depend_on);
     p->depend_on = 0;
+  }
 
   if (p->state != DELINK && p->state != WAIT && p->state != LOCKED) {
     pinfo_init(&p->info);
     pinfo_set_enqueue_time(&p->info);
   }
 
-  /* load the command */
-
-  char *buff = malloc(m->u.newjob.command_size);
-  if (buff == 0)
-    error("Cannot allocate memory in s_newjob command_size (%i)",
-          m->u.newjob.command_size);
-  res = recv_bytes(s, buff, m->u.newjob.command_size);
-  if (res == -1)
-    error("wrong bytes received");
-
-  p->command = buff;
-  p->command_strip = m->u.newjob.command_size_strip;
-
-  /* load the work dir */
-  p->work_dir = 0;
-  if (m->u.newjob.path_size > 0) {
-    char *ptr;
-    ptr = (char *)malloc(m->u.newjob.path_size);
-    if (ptr == 0)
-      error("Cannot allocate memory in s_newjob path_size(%i)",
-            m->u.newjob.path_size);
-    res = recv_bytes(s, ptr, m->u.newjob.path_size);
-    if (res == -1)
-      error("wrong bytes received");
-    p->work_dir = ptr;
-  }
-
-  /* load the label */
-  p->label = NULL;
-  if (m->u.newjob.label_size > 0) {
-    char *ptr;
-    ptr = (char *)malloc(m->u.newjob.label_size);
-    if (ptr == 0)
-      error("Cannot allocate memory in s_newjob label_size(%i)",
-            m->u.newjob.label_size);
-    res = recv_bytes(s, ptr, m->u.newjob.label_size);
-    if (res == -1)
-      error("wrong bytes received");
-    p->label = ptr;
-  }
-
-  p->email = NULL;
-  if (m->u.newjob.email_size > 0) {
+  /* load the command, work dir, label and email, in one block */
+  {
+    int sizes[4];
+    char **fields[4];
     char *ptr;
-    ptr = (char *)malloc(m->u.newjob.email_size);
-    if (ptr == 0)
-      error("Cannot allocate memory in s_newjob email_size(%i)",
-            m->u.newjob.email_size);
-    res = recv_bytes(s, ptr, m->u.newjob.email_size);
-    if (res == -1)
-      error("wrong bytes received");
-    p->email = ptr;
+    int i;
+
+    sizes[0] = m->u.newjob.command_size;
+    sizes[1] = m->u.newjob.path_size;
+    sizes[2] = m->u.newjob.label_size;
+    sizes[3] = m->u.newjob.email_size;
+    fields[0] = &p->command;
+    fields[1] = &p->work_dir;
+    fields[2] = &p->label;
+    fields[3] = &p->email;
+
+    ptr = job_strings_alloc(p, sizes[0] + sizes[1] + sizes[2] + sizes[3]);
+    for (i = 0; i < 4; ++i) {
+      *fields[i] = NULL;
+      if (sizes[i] <= 0)
+        continue;
+      res = recv_bytes(s, ptr, sizes[i]);
+      if (res == -1)
+        return newjob_failed(p, restored);
+      ptr[sizes[i] - 1] = '\0';
+      *fields[i] = ptr;
+      ptr += sizes[i];
+    }
+    job_count_strings(p);
   }
+  p->command_strip = m->u.newjob.command_size_strip;
 
-  /* load the info */
+  /* The environment, only received if no other job of the user has it */
   if (m->u.newjob.env_size > 0) {
-    char *ptr;
-    ptr = (char *)malloc(m->u.newjob.env_size);
-    if (ptr == 0)
-      error("Cannot allocate memory in s_newjob env_size(%i)",
-            m->u.newjob.env_size);
-    res = recv_bytes(s, ptr, m->u.newjob.env_size);
-    if (res == -1)
-      error("wrong bytes received");
-    pinfo_addinfo(&p->info, m->u.newjob.env_size + 100, "Environment:\n%s",
-                  ptr);
-    free(ptr);
+    struct Env *env = env_find(ts_UID, m->u.newjob.env_hash);
+
+    if (env != NULL) {
+      env = env_hold(env);
+    } else {
+      struct Msg ask = default_msg();
+      char *ptr;
+      ptr = (char *)malloc(m->u.newjob.env_size);
+      if (ptr == 0) {
+        warning("Cannot allocate memory in s_newjob env_size(%i)",
+                m->u.newjob.env_size);
+        return newjob_failed(p, restored);
+      }
+      ask.type = NEWJOB_ENV;
+      send_msg(s, &ask);
+      res = recv_bytes(s, ptr, m->u.newjob.env_size);
+      if (res == -1) {
+        free(ptr);
+        return newjob_failed(p, restored);
+      }
+      ptr[m->u.newjob.env_size - 1] = '\0';
+      /* Hashed again: a client cannot store under another hash */
+      env = env_add(ts_UID, ptr);
+    }
+    /* A restored job submitted again had one already */
+    env_release(p->env);
+    p->env = env;
   }
 
   if (p->state == DELINK) {
-    p->state = RELINK;
+    set_job_state(p, RELINK);
     // manually insert
   } else if (p->state == WAIT) {
-    p->state = QUEUED;
-    user_queue[p->ts_UID]++;
+    set_job_state(p, QUEUED);
   } else if (p->state == RELINK) {
     /* for manually relink running task */
-    p->pid = m->u.newjob.taskpid;
+    set_job_pid(p, m->u.newjob.taskpid);
     p->info.start_time.tv_sec = m->u.newjob.start_time;
     p->info.start_time.tv_usec = 0;
     insert_or_replace_DB(p, "Jobs");
   } else if (p->state == QUEUED) {
     insert_DB(p, "Jobs");
-    user_queue[p->ts_UID]++;
   } else if (p->state == LOCKED) {
     ;
   } else {
     insert_DB(p, "Jobs");
-    user_queue[p->ts_UID]++;
   }
 
   set_jobids_DB(jobids);
+  if (!restored)
+    job_event(p, EVENT_SUBMITTED);
   return p->jobid;
 }
 
-/* This assumes the jobid exists */
-void s_delete_job(int jobid) {
-  struct Job *p;
-  struct Job *newnext;
-  /*
-  if (firstjob.next.jobid == jobid) {
-    struct Job *newfirst;
+/* Returns the string starting at *pos, and moves *pos past its null.
+ * NULL if there are no more nul-terminated strings before 'end'. */
+static char *next_batch_string(char **pos, const char *end) {
+  char *str = *pos;
+  char *nul;
 
-  // First job is to be removed //
-  newfirst = firstjob->next;
-  destroy_job(firstjob);
-  firstjob = newfirst;
-  return;
+  if (str >= end)
+    return NULL;
+  nul = memchr(str, '\0', end - str);
+  if (nul == NULL)
+    return NULL;
+  *pos = nul + 1;
+  return str;
+}
+
+/* The next field of 'size' bytes, which must end in a null. An empty
+ * field gives "" */
+static char *batch_field(char **pos, int size) {
+  char *str = *pos;
+
+  if (size == 0)
+    return "";
+  *pos += size;
+  if (str[size - 1] != '\0')
+    return NULL;
+  return str;
+}
+
+/* An empty field of the batch is a NULL string */
+static const char *batch_string(const char *str, int size) {
+  return size > 0 ? str : NULL;
+}
+
+/* The largest NEWJOB_BATCH payload taken, in bytes */
+enum { BATCH_MAX_PAYLOAD = 64 << 20 };
+
+/* Queue all the commands of a NEWJOB_BATCH at once. The payload comes
+ * in one piece: m->u.newjob.batch_size nul-terminated commands, then the
+ * work dir, label, email and environment shared by all of them.
+ * The jobs are detached, and get a contiguous range of jobids. They have
+ * no dependencies: the client refuses -d, -D and -W with --batch. */
+void s_newjob_batch(int s, struct Msg *m, int ts_UID) {
+  struct Msg reply = default_msg();
+  char *payload, *pos, *end, *commands;
+  char *path, *label, *email, *env;
+  struct Env *shared_env = NULL;
+  size_t size;
+  int i, first_jobid;
+
+  reply.type = NEWJOB_NOK;
+  if (m->u.newjob.batch_size <= 0 || m->u.newjob.command_size <= 0 ||
+      m->u.newjob.path_size < 0 || m->u.newjob.label_size < 0 ||
+      m->u.newjob.email_size < 0 || m->u.newjob.env_size < 0 ||
+      m->u.newjob.depend_on_size != 0) {
+    send_msg(s, &reply);
+    return;
   }
-  */
-  p = &firstjob;
-  /* Not first job */
-  while (p->next != 0) {
-    if (p->next->jobid == jobid)
+  /* With each size under the cap, the sum can not overflow */
+  size = (size_t)m->u.newjob.command_size + m->u.newjob.path_size +
+         m->u.newjob.label_size + m->u.newjob.email_size +
+         m->u.newjob.env_size;
+  if (m->u.newjob.command_size > BATCH_MAX_PAYLOAD ||
+      m->u.newjob.env_size > BATCH_MAX_PAYLOAD ||
+      m->u.newjob.path_size > BATCH_MAX_PAYLOAD ||
+      m->u.newjob.label_size > BATCH_MAX_PAYLOAD ||
+      m->u.newjob.email_size > BATCH_MAX_PAYLOAD ||
+      size > BATCH_MAX_PAYLOAD) {
+    warning("NEWJOB_BATCH of %zu bytes refused", size);
+    send_msg(s, &reply);
+    return;
+  }
+
+  payload = (char *)malloc(size);
+  if (payload == NULL) {
+    warning("Cannot allocate memory in s_newjob_batch (%zu)", size);
+    send_msg(s, &reply);
+    return;
+  }
+  if (recv_bytes(s, payload, size) == -1) {
+    warning("wrong bytes received in s_newjob_batch");
+    free(payload);
+    return;
+  }
+
+  /* Check the commands before queueing any */
+  commands = payload;
+  pos = payload;
+  end = payload + m->u.newjob.command_size;
+  for (i = 0; i < m->u.newjob.batch_size; ++i)
+    if (next_batch_string(&pos, end) == NULL)
       break;
-    p = p->next;
+  if (i < m->u.newjob.batch_size || pos != end) {
+    warning("Malformed NEWJOB_BATCH of %i commands", m->u.newjob.batch_size);
+    send_msg(s, &reply);
+    free(payload);
+    return;
+  }
+
+  path = batch_field(&pos, m->u.newjob.path_size);
+  label = batch_field(&pos, m->u.newjob.label_size);
+  email = batch_field(&pos, m->u.newjob.email_size);
+  env = batch_field(&pos, m->u.newjob.env_size);
+  if (path == NULL || label == NULL || email == NULL || env == NULL) {
+    warning("Malformed NEWJOB_BATCH strings");
+    send_msg(s, &reply);
+    free(payload);
+    return;
   }
-  if (p->next == 0)
+
+  /* One reference for the batch while the jobs take theirs */
+  if (m->u.newjob.env_size > 0)
+    shared_env = env_add(ts_UID, strdup(env));
+
+  first_jobid = jobids;
+  begin_transaction_DB();
+  pos = commands;
+  for (i = 0; i < m->u.newjob.batch_size; ++i) {
+    struct Job *p = new_job(jobids++);
+    const char *command = next_batch_string(&pos, end);
+
+    p->detached = 1;
+    p->ts_UID = ts_UID;
+    set_job_state(p, QUEUED);
+    p->num_slots = m->u.newjob.num_slots;
+    p->store_output = m->u.newjob.store_output;
+    p->should_keep_finished = m->u.newjob.should_keep_finished;
+    p->taskset_flag = m->u.newjob.taskset_flag;
+    pinfo_init(&p->info);
+    pinfo_set_enqueue_time(&p->info);
+
+    job_set_strings(p, command, batch_string(path, m->u.newjob.path_size),
+                    batch_string(label, m->u.newjob.label_size),
+                    batch_string(email, m->u.newjob.email_size));
+    p->command_strip = m->u.newjob.command_size_strip;
+    if (shared_env != NULL)
+      p->env = env_hold(shared_env);
+
+    insert_DB(p, "Jobs");
+    job_event(p, EVENT_SUBMITTED);
+  }
+  set_jobids_DB(jobids);
+  commit_transaction_DB();
+  env_release(shared_env);
+  free(payload);
+
+  reply.type = NEWJOB_OK;
+  reply.jobid = first_jobid;
+  reply.u.newjob.batch_size = m->u.newjob.batch_size;
+  reply.u.newjob.detach = 1;
+  durable_DB();
+  send_msg(s, &reply);
+}
+
+/* This assumes the jobid exists */
+void s_delete_job(int jobid) {
+  struct Job *p;
+
+  p = findjob(jobid);
+  if (p == NULL)
     error("Job to be removed not found. jobid=%i", jobid);
 
-  newnext = p->next->next;
+  count_job_client(p, -1);
+  job_event(p, EVENT_REMOVED);
+  /* Out of the ready queues */
+  set_job_state(p, FINISHED);
+  /* Its dependents do not wait for it any more */
+  for (int i = 0; i < p->notify_errorlevel_to_size; ++i) {
+    struct Job *dependent = findjob(p->notify_errorlevel_to[i]);
+    if (dependent != NULL)
+      dependency_done(dependent);
+  }
 
-  destroy_job(p->next);
-  p->next = newnext;
+  queue_remove(p);
+  destroy_job(p);
 }
 
 /* -1 if no one should be run. */
@@ -1225,19 +1682,11 @@ void s_delete_job(int jobid) {
 */
 int next_run_job() {
   struct Job *p;
+  int i;
 
-  /* If there are no jobs to run... */
-  if (firstjob.next == 0)
-    return -1;
-  p = firstjob.next;
-  while (p != 0) {
-    if (p->state == RELINK) {
-      return p->jobid;
-    }
-    p = p->next;
-  }
-  // start from a random sequence
-  int uid = rand() % user_number;
+  /* Relinked jobs go first, they are running already */
+  if (relink_queue.head != NULL)
+    return relink_queue.head->jobid;
 
   const int free_slots = max_slots - busy_slots;
 
@@ -1247,86 +1696,116 @@ int next_run_job() {
   if (free_slots <= 0)
     return -1;
 
-  /* Look for a runnable task */
-  for (int i = 0; i < user_number; i++) {
-    uid = (uid + 1) % user_number;
-    if (user_queue[uid] == 0) {
+  /* Look for a runnable task, in turns among the users */
+  for (i = 0; i < user_number; i++) {
+    int uid = (next_user + i) % user_number;
+    int user_free = user_max_slots[uid] - user_busy[uid];
+
+    /* A suspended user has negative max slots */
+    if (user_free <= 0)
       continue;
-    }
-    p = firstjob.next;
-    while (p != 0) {
-      if (p->state == QUEUED) {
-        if (p->depend_on_size) {
-          int ready = 1;
-          for (int i = 0; i < p->depend_on_size; i++) {
-            struct Job *do_depend_job = get_job(p->depend_on[i]);
-            /* We won't try to run any job do_depending on an unfinished
-             * job */
-            if (do_depend_job != NULL && (do_depend_job->state == QUEUED ||
-                                          do_depend_job->state == RUNNING)) {
-              /* Next try */
-              p = p->next;
-              ready = 0;
-              break;
-            }
-          }
-          if (ready != 1)
-            continue;
-        }
 
-        int num_slots = p->num_slots, id = p->ts_UID;
-        if (id == uid && free_slots >= num_slots &&
-            user_max_slots[id] - user_busy[id] >= num_slots) {
-          user_queue[id]--;
-          return p->jobid;
-        }
+    /* The first job in the queue order that fits in the free slots.
+     * The jobs waiting for others to finish are not in the ready queue. */
+    for (p = ready_queue[uid].head; p != NULL; p = p->ready_next) {
+      if (free_slots >= p->num_slots && user_free >= p->num_slots) {
+        next_user = (uid + 1) % user_number;
+        return p->jobid;
       }
-      p = p->next;
     }
   }
   return -1;
 }
 
 /* Returns 1000 if no limit, The limit otherwise. */
+/* TS_MAXFINISHED is read once, the server environment does not change */
 static int get_max_finished_jobs() {
   char *limit;
 
+  if (max_finished_jobs > 0)
+    return max_finished_jobs;
+
   limit = getenv("TS_MAXFINISHED");
-  if (limit == NULL)
-    return DEFAULT_MAXFINISHED;
-  int num = abs(atoi(limit));
-  if (num < 1)
-    num = DEFAULT_MAXFINISHED;
-  return num;
+  if (limit == NULL) {
+    max_finished_jobs = DEFAULT_MAXFINISHED;
+  } else {
+    max_finished_jobs = abs(atoi(limit));
+    if (max_finished_jobs < 1)
+      max_finished_jobs = DEFAULT_MAXFINISHED;
+  }
+  return max_finished_jobs;
 }
 
-/* Add the job to the finished queue. */
-static void new_finished_job(struct Job *j) {
-  struct Job *p;
-  int count = 0, max;
+static void finished_append(struct Job *j) {
+  j->prev = last_finished_job;
+  j->next = NULL;
+  last_finished_job->next = j;
+  last_finished_job = j;
+  finished_count++;
+  jobindex_insert(&finished_index, j);
+  finished_states[j->state]++;
+}
 
-  max = get_max_finished_jobs();
+static void finished_remove(struct Job *j) {
+  j->prev->next = j->next;
+  if (j->next != NULL)
+    j->next->prev = j->prev;
+  else
+    last_finished_job = j->prev;
+  j->next = NULL;
+  j->prev = NULL;
+  finished_count--;
+  jobindex_remove(&finished_index, j);
+  finished_states[j->state]--;
+}
 
-  p = &first_finished_job;
-  while (p->next != 0) {
-    p = p->next;
-    ++count;
-  }
+/* The queue and the finished list into the snapshot, when it is due */
+void publish_snapshot() {
+  const struct Job *p;
 
-  /* If too many jobs, wipe out the first */
-  if (count >= max) {
-    struct Job *tmp;
-    tmp = first_finished_job.next;
-    first_finished_job.next = tmp->next;
+  if (!snapshot_due())
+    return;
+  snapshot_begin();
+  for (p = firstjob.next; p != NULL; p = p->next)
+    snapshot_job(p, 0);
+  for (p = first_finished_job.next; p != NULL; p = p->next)
+    snapshot_job(p, 1);
+  snapshot_end();
+}
+
+/* A job of the snapshot read by a client, in the list it was in */
+void add_snapshot_job(struct Job *p, int finished) {
+  if (finished)
+    finished_append(p);
+  else
+    queue_append(p);
+}
+
+void flush_evicted_jobs() {
+  retire_jobs_DB(evicted_jobids, evicted_count);
+  evicted_count = 0;
+}
+
+/* Wipe out the oldest finished jobs beyond the limit */
+static void evict_finished_jobs(int max) {
+  while (finished_count > max) {
+    struct Job *tmp = first_finished_job.next;
+
+    finished_remove(tmp);
+    evicted_jobids[evicted_count++] = tmp->jobid;
+    if (evicted_count == FINISHED_DELETE_BATCH)
+      flush_evicted_jobs();
     destroy_job(tmp);
   }
-  p->next = j;
-  p->next->next = 0;
+}
 
-  int err = insert_DB(j, "Finished");
-  if (err == 0) {
-    delete_DB(j->jobid, "Jobs");
-  }
+/* Add the job to the finished queue. */
+static void new_finished_job(struct Job *j) {
+  /* If too many jobs, wipe out the first */
+  evict_finished_jobs(get_max_finished_jobs() - 1);
+  finished_append(j);
+
+  finish_DB(j);
 
 #ifdef TASKSET
   unlock_core_by_job(j);
@@ -1335,21 +1814,143 @@ static void new_finished_job(struct Job *j) {
   send_mail_via_ssmtp(j);
 }
 
-static int job_is_in_state(int jobid, enum Jobstate state) {
+static int job_is_in_state(int jobid, enum Jobstate state) {
+  struct Job *p;
+
+  p = findjob(jobid);
+  if (p == 0)
+    return 0;
+  if (p->state == state)
+    return 1;
+  return 0;
+}
+
+int job_is_running(int jobid) { return job_is_in_state(jobid, RUNNING); }
+
+int job_is_holding_client(int jobid) {
+  return job_is_in_state(jobid, HOLDING_CLIENT);
+}
+
+int job_is_detached(int jobid) {
+  struct Job *p = findjob(jobid);
+  return p != NULL && p->detached;
+}
+
+/* Dispatched, but its runner did not connect yet */
+int job_awaits_runner(int jobid) {
+  struct Job *p = findjob(jobid);
+  return p != NULL && p->detached && !p->launched && p->state == RUNNING;
+}
+
+static void runner_failed(struct Job *p) {
+  struct Result r = default_result();
+  int jobid = p->jobid;
+
+  r.errorlevel = -1;
+  job_finished(&r, jobid);
+  check_notify_list(jobid);
+}
+
+/* Start a client for a detached job that was just marked as running,
+ * unless the server runs the job itself (see launch_job).
+ * It is our own binary, run as the job owner in the job work dir, with
+ * the command line the job was queued with. It will connect with
+ * "-J jobid", and the server answers with RUNJOB right away. */
+void s_spawn_runner(int jobid) {
   struct Job *p;
+  char exe[PATH_MAX];
+  const char *args;
+  char *cmd;
+  int len, size, pid;
 
   p = findjob(jobid);
-  if (p == 0)
-    return 0;
-  if (p->state == state)
-    return 1;
-  return 0;
+  if (p == NULL)
+    error("Cannot spawn the runner of the jobid %i", jobid);
+  if (launch_job(p) == 0)
+    return;
+
+  len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len == -1)
+    error("Cannot find the ts binary to run the jobid %i", jobid);
+  exe[len] = '\0';
+
+  /* Skip the argv[0] the job was queued with */
+  args = strchr(p->command, ' ');
+  if (args == NULL)
+    args = "";
+
+  size = len + strlen(args) + 32;
+  cmd = (char *)malloc(size);
+  if (cmd == NULL)
+    error("Cannot allocate the runner command of the jobid %i", jobid);
+  snprintf(cmd, size, "'%s' -J %d%s", exe, jobid, args);
+
+  pid = fork_cmd(user_UID[p->ts_UID], p->work_dir, cmd);
+  free(cmd);
+  if (pid == -1) {
+    warning("Cannot fork the runner of the jobid %i", jobid);
+    runner_failed(p);
+    return;
+  }
+
+  /* Watched until it connects. The server loop did not look at its
+   * connection yet, so if it is already gone, it failed. */
+  p->pidfd = open_pidfd(pid);
+  if (p->pidfd != -1)
+    watch_runner(p->pidfd, jobid);
+  else if (errno == ESRCH)
+    runner_failed(p);
 }
 
-int job_is_running(int jobid) { return job_is_in_state(jobid, RUNNING); }
+/* A child of the server was reaped, with its status and times. If it
+ * is a job the server runs itself, it finished. */
+void s_launched_exit(int pid, int status, const struct rusage *ru) {
+  struct Result result = default_result();
+  struct Job *p = job_by_pid(pid);
+  struct timeval now;
+  int jobid;
 
-int job_is_holding_client(int jobid) {
-  return job_is_in_state(jobid, HOLDING_CLIENT);
+  if (p == NULL || !p->launched)
+    return;
+  jobid = p->jobid;
+  if (p->pidfd != -1) {
+    close(p->pidfd);
+    p->pidfd = -1;
+  }
+
+  result.errorlevel = -1;
+  if (WIFEXITED(status)) {
+    /* We force the proper cast */
+    result.errorlevel = (signed char)WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    result.signal = WTERMSIG(status);
+    result.died_by_signal = 1;
+  }
+  result.user_ms = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1000000.;
+  result.system_ms = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1000000.;
+  gettimeofday(&now, NULL);
+  result.real_ms = now.tv_sec - p->info.start_time.tv_sec +
+                   (now.tv_usec - p->info.start_time.tv_usec) / 1000000.;
+  job_finished(&result, jobid);
+  check_notify_list(jobid);
+}
+
+/* The runner of the job exited. If it never connected, the job can not
+ * run: it fails, and frees its slots. */
+void s_runner_exit(int jobid) {
+  struct Job *p = get_job(jobid);
+
+  if (p == NULL || p->adopted || p->pidfd == -1)
+    return;
+  close(p->pidfd);
+  p->pidfd = -1;
+  /* It is reaped at the end of the round (see launch_reap) */
+  if (p->launched)
+    return;
+  if (job_awaits_runner(jobid)) {
+    warning("The runner of the jobid %i exited before connecting", jobid);
+    runner_failed(p);
+  }
 }
 
 static int in_notify_list(int jobid) {
@@ -1388,98 +1989,383 @@ void job_finished(const struct Result *result, int jobid) {
 
   /* Mark state */
   if (result->skipped)
-    p->state = SKIPPED;
+    set_job_state(p, SKIPPED);
   else
-    p->state = FINISHED;
+    set_job_state(p, FINISHED);
 
   p->result = *result;
   last_finished_jobid = p->jobid;
   notify_errorlevel(p);
+  job_event(p, EVENT_FINISHED);
 
   pinfo_set_end_time(&p->info);
   if (result->real_ms == 0) {
     p->info.start_time = p->info.enqueue_time = p->info.end_time;
   }
 
-  if (p->result.died_by_signal)
-    pinfo_addinfo(&p->info, 100, "Exit status: killed by signal %i\n",
-                  p->result.signal);
-  else
-    pinfo_addinfo(&p->info, 100, "Exit status: died with exit code %i\n",
-                  p->result.errorlevel);
+  /* Remove it from the run queue */
+  queue_remove(p);
 
-  /* Find the pointing node, to
-   * update it removing the finished job. */
-  {
-    struct Job *jpointer = &firstjob;
-    struct Job *newfirst = p->next;
+  /* Add it to the finished queue (maybe temporarily) */
+  if (p->should_keep_finished || in_notify_list(p->jobid)) {
+    new_finished_job(p);
+    count_job_client(p, -1);
+  } else {
+    /* Nobody will ask for it again */
+    count_job_client(p, -1);
+    destroy_job(p);
+  }
+}
 
-    while (jpointer->next != p) {
-      jpointer = jpointer->next;
-    }
+static char *env_entry(const char *name, const char *value) {
+  int size = strlen(name) + strlen(value) + 2;
+  char *s = (char *)malloc(size);
+
+  if (s == NULL)
+    error("Cannot allocate the environment of a command");
+  snprintf(s, size, "%s=%s", name, value);
+  return s;
+}
+
+static void runas_free(struct RunAs *r) {
+  int i;
+
+  free(r->groups);
+  if (r->change) {
+    for (i = 0; r->envp[i] != NULL; ++i)
+      ;
+    /* Only the last three are ours (see runas_lookup) */
+    free(r->envp[i - 1]);
+    free(r->envp[i - 2]);
+    free(r->envp[i - 3]);
+    free(r->envp);
+  }
+}
 
-    /* Add it to the finished queue (maybe temporarily) */
-    if (p->should_keep_finished || in_notify_list(p->jobid))
-      new_finished_job(p);
+static int runas_lookup(struct RunAs *r, int UID) {
+  extern char **environ;
+  struct passwd *pw;
+  int i, n;
 
-    /* Remove it from the run queue */
-    if (jpointer == 0)
-      error("Cannot remove a finished job from the "
-            "queue list (jobid=%i)",
-            p->jobid);
+  memset(r, 0, sizeof(*r));
+  r->envp = environ;
+  r->max_fd = sysconf(_SC_OPEN_MAX);
+  if (UID == (int)getuid())
+    return 0;
 
-    jpointer->next = newfirst;
+  /* Never run a command as someone else than asked */
+  pw = getpwuid(UID);
+  if (pw == NULL) {
+    warning("Cannot find the user of the uid %i", UID);
+    return -1;
   }
+  r->uid = UID;
+  r->gid = pw->pw_gid;
+
+  n = 1;
+  getgrouplist(pw->pw_name, pw->pw_gid, &r->gid, &n);
+  r->groups = (gid_t *)malloc(sizeof(gid_t) * (n + 1));
+  if (r->groups == NULL)
+    error("Cannot allocate the groups of the uid %i", UID);
+  if (getgrouplist(pw->pw_name, pw->pw_gid, r->groups, &n) == -1) {
+    warning("Cannot find the groups of the uid %i", UID);
+    free(r->groups);
+    return -1;
+  }
+  r->ngroups = n;
+
+  /* Our environment, but with the home and name of the user */
+  for (n = 0; environ[n] != NULL; ++n)
+    ;
+  r->envp = (char **)malloc(sizeof(char *) * (n + 4));
+  if (r->envp == NULL)
+    error("Cannot allocate the environment of the uid %i", UID);
+  for (i = 0, n = 0; environ[i] != NULL; ++i)
+    if (strncmp(environ[i], "HOME=", 5) != 0 &&
+        strncmp(environ[i], "USER=", 5) != 0 &&
+        strncmp(environ[i], "LOGNAME=", 8) != 0)
+      r->envp[n++] = environ[i];
+  r->envp[n++] = env_entry("HOME", pw->pw_dir);
+  r->envp[n++] = env_entry("USER", pw->pw_name);
+  r->envp[n++] = env_entry("LOGNAME", pw->pw_name);
+  r->envp[n] = NULL;
+  r->change = 1;
+  return 0;
 }
 
+/* Run cmd through sh as the user UID, in path if not NULL, with no
+ * descriptor of the server. Returns the pid, or -1. */
 static int fork_cmd(const int UID, const char *path, const char *cmd) {
-  int pid = -1; //定义一个进程ID变量
+  struct RunAs r;
+  char *argv[4];
+  int pid;
 
-  pid = fork(); //调用fork()函数创建子进程
-  if (pid < 0)  //如果返回值小于0，表示fork失败
-  {
-    perror("fork error"); //打印错误信息
+  if (runas_lookup(&r, UID) == -1)
     return -1;
-  } else if (pid == 0) //如果返回值等于0，表示子进程正在运行
-  {
-    setuid(UID);
-    if (path != NULL)
-      chdir(path);
-    system(cmd);
-    exit(0);
-    /*
-    int cmd_array_size;
-    printf("cmd = %s\n", cmd);
-    char** cmd_arry = split_str(cmd, &cmd_array_size);
-    if (cmd_array_size > 0) {
-      printf("run cmd %s\n", cmd_arry[0]);
-      system(cmd);
-      exit(0);
-      // execvp(cmd_arry[0], cmd_arry);
+  argv[0] = "sh";
+  argv[1] = "-c";
+  argv[2] = (char *)cmd;
+  argv[3] = NULL;
+
+  pid = fork();
+  if (pid == -1) {
+    perror("fork error");
+  } else if (pid == 0) {
+    int fd;
+
+    /* Become the user fully, or do not run at all */
+    if (r.change && (setgroups(r.ngroups, r.groups) == -1 ||
+                     setgid(r.gid) == -1 || setuid(r.uid) == -1))
+      _exit(1);
+    if (path != NULL && chdir(path) == -1)
+      _exit(1);
+    /* Nothing of the server is for the command: the server runs with its
+     * std handles closed, so they may be the listen socket or the DB */
+    fd = open("/dev/null", O_RDWR);
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, 3, ~0U, 0) == -1)
+#endif
+      for (fd = 3; fd < r.max_fd; ++fd)
+        close(fd);
+    execve("/bin/sh", argv, r.envp);
+    _exit(127);
+  } else {
+    printf("[Child PID:%d] Add queued job: %s\n", pid, cmd);
+  }
+  runas_free(&r);
+  return pid;
+}
+
+/* The output file a runner of p would open: the label, or ts_out, and
+ * the jobid, in its work dir */
+static char *launch_output(const struct Job *p) {
+  const char *label = p->label != NULL ? p->label : "ts_out";
+  const char *dir = p->work_dir != NULL ? p->work_dir : "";
+  int size = strlen(dir) + strlen(label) + 32;
+  char *path = (char *)malloc(size);
+
+  if (path == NULL)
+    error("Cannot allocate the output file of the jobid %i", p->jobid);
+  snprintf(path, size, "%s/%s.%d", dir, label, p->jobid);
+  return path;
+}
+
+/* Run the detached job p, just marked as running, from the server
+ * itself (see launch.c), with what a runner would send on RUNJOB_OK.
+ * -1 if it needs a runner. */
+static int launch_job(struct Job *p) {
+  struct RunAs r;
+  char **argv;
+  char *output = NULL;
+  int pidfd = -1;
+  int pid;
+
+  if (!launch_enabled())
+    return -1;
+  argv = launch_argv(p);
+  if (argv == NULL)
+    return -1;
+  if (runas_lookup(&r, user_UID[p->ts_UID]) == -1) {
+    free(argv);
+    return -1;
+  }
+  if (p->store_output)
+    output = launch_output(p);
+
+  pid = launch_clone(&r, argv, p->work_dir, output, &pidfd);
+  runas_free(&r);
+  free(argv);
+  if (pid == -1) {
+    free(output);
+    return -1;
+  }
+
+  p->launched = 1;
+  p->pidfd = pidfd;
+  watch_runner(pidfd, p->jobid);
+  s_process_runjob_ok(p->jobid, output, pid);
+  return 0;
+}
+
+/* The jobs found running when the server starts are adopted with no
+ * client, by a pidfd watched in the server loop. If the old client of a
+ * job is still its parent, the pidfd is of that client: it leaves the
+ * result it cannot send us in a status file before it exits (see
+ * c_end_of_job()), so the file is there once the pidfd signals.
+ * Otherwise the job is watched, and its exit status is unknown. */
+
+/* The parent of pid, if it runs our own binary. 0 otherwise. */
+static int client_of_pid(int pid) {
+  char path[64], line[512], exe[PATH_MAX], self[PATH_MAX];
+  const char *end;
+  FILE *f;
+  int ppid = 0;
+  ssize_t len;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+  if (fgets(line, sizeof(line), f) != NULL) {
+    /* The command name, in parentheses, may hold spaces */
+    end = strrchr(line, ')');
+    if (end == NULL || sscanf(end + 1, " %*c %d", &ppid) != 1)
+      ppid = 0;
+  }
+  fclose(f);
+  if (ppid <= 1)
+    return 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/exe", ppid);
+  len = readlink(path, exe, sizeof(exe) - 1);
+  if (len == -1)
+    return 0;
+  exe[len] = '\0';
+  len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (len == -1)
+    return 0;
+  self[len] = '\0';
+  return strcmp(exe, self) == 0 ? ppid : 0;
+}
+
+/* The result the client of p could not send, if it left it */
+static int read_status_file(const struct Job *p, struct Result *result) {
+  char *path = create_status_path(p->jobid);
+  struct stat st;
+  int fd, res = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd != -1) {
+    /* Only the owner of the job can tell its result */
+    if (fstat(fd, &st) == 0 &&
+        (st.st_uid == user_UID[p->ts_UID] || st.st_uid == getuid()) &&
+        read(fd, result, sizeof(*result)) == sizeof(*result))
+      res = 1;
+    close(fd);
+    unlink(path);
+  }
+  free(path);
+  return res;
+}
+
+/* proc_ended() for pid. A zombie has ended, though kill() still finds it */
+static int pid_ended(int pid, int *status) {
+  char path[32];
+  int dir_fd;
+  int res;
+
+  *status = -1;
+  sprintf(path, "/proc/%i", pid);
+  dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1)
+    return 1;
+  res = proc_ended(dir_fd, status);
+  close(dir_fd);
+  return res;
+}
+
+/* status is the wait status of the job, if known, or -1 */
+static void finish_adopted(struct Job *p, int status) {
+  struct Result result = default_result();
+  int jobid = p->jobid;
+
+  if (!read_status_file(p, &result)) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    result.errorlevel = -1;
+    if (status != -1 && WIFEXITED(status)) {
+      result.errorlevel = (signed char)WEXITSTATUS(status);
+    } else if (status != -1 && WIFSIGNALED(status)) {
+      result.signal = WTERMSIG(status);
+      result.died_by_signal = 1;
     }
-    // execlp("ls", "-l", NULL); //执行ls -l命令，替换当前进程
-    */
+    result.real_ms = now.tv_sec - p->info.start_time.tv_sec +
+                     (now.tv_usec - p->info.start_time.tv_usec) / 1000000.;
+  }
+  p->adopted = 0;
+  job_finished(&result, jobid);
+  check_notify_list(jobid);
+}
+
+/* Take a live job of the Jobs table as running, and watch it.
+ * -1 if there is no pidfd_open(), so it needs a relink client. */
+static int adopt_job(struct Job *j) {
+  int client = client_of_pid(j->pid);
+  int pidfd = open_pidfd(client != 0 ? client : j->pid);
+
+  if (pidfd == -1)
     return -1;
-  } else //如果返回值大于0，表示父进程正在运行
-  {
-    printf("[Child PID:%d] Add queued job: %s\n", pid, cmd); //打印子进程的ID
+  j->adopted = 1;
+  j->pidfd = pidfd;
+  queue_append(j);
+  watch_pid(pidfd, j->pid);
+  /* Balanced by job_finished() */
+  count_job_client(j, 1);
+  /* A stopped job holds no slots until it continues */
+  set_job_state(j, PAUSE);
+  if (is_sleep(j->pid) != 1)
+    config_running(j);
+  return 0;
+}
+
+/* The pidfd watched for the adopted job of pid signalled */
+void s_adopted_exit(int pid) {
+  struct Job *p = job_by_pid(pid);
+  int status;
+
+  if (p == NULL || !p->adopted || p->pidfd == -1)
+    return;
+  close(p->pidfd);
+  p->pidfd = -1;
+
+  /* Its client was killed, but the job goes on: watch the job itself */
+  if (!pid_ended(pid, &status)) {
+    char *path = create_status_path(p->jobid);
+    int ended = access(path, F_OK) == 0;
+
+    free(path);
+    if (!ended && (p->pidfd = open_pidfd(pid)) != -1) {
+      watch_pid(p->pidfd, pid);
+      return;
+    }
+  }
+  finish_adopted(p, status);
+}
+
+/* The jobs that ended while the server was down, and left their result.
+ * Finished once all the queue and its dependencies are restored. */
+static void finish_ended_jobs() {
+  struct Job *p = firstjob.next;
+
+  while (p != NULL) {
+    struct Job *next = p->next;
+
+    if (p->adopted && p->pidfd == -1)
+      finish_adopted(p, -1);
+    p = next;
   }
-  return pid;
 }
 
-static void s_add_job(struct Job *j, struct Job **p) {
-  // if (j->state == RUNNING || j->state == HOLDING_CLIENT || j->state ==
-  // RELINK) {
+/* A job restored from the Jobs table. A queued job is left detached, so
+ * its runner is only forked once it is dispatched, like the jobs of a
+ * batch. A job still running is adopted by its pid. */
+static void s_add_job(struct Job *j) {
   if (j->state == RUNNING) {
+    jobids = jobids > j->jobid ? jobids : j->jobid + 1;
     if (j->pid > 0 && s_check_running_pid(j->pid) == 1) {
-      printf("add job %d\n", j->jobid);
-
-      j->state = DELINK;
+      if (adopt_job(j) == 0)
+        return;
 
-      // jobDB_Jobs[jobDB_num] = j;
-      // jobDB_num++;
-      (*p)->next = j;
-      (*p) = j;
+      set_job_state(j, DELINK);
+      queue_append(j);
+      count_job_client(j, 1);
+      /* It runs already: the queued jobs do not get its slots while the
+       * relink client starts */
+      charge_slots(j);
 
       char c[64];
       sprintf(c, " --relink %d -J %d ", j->pid, j->jobid);
@@ -1487,115 +2373,228 @@ static void s_add_job(struct Job *j, struct Job **p) {
 
       fork_cmd(user_UID[j->ts_UID], j->work_dir, str);
       free(str);
-      // fork_cmd(0, j->work_dir, str);
-
-      jobids = jobids > j->jobid ? jobids : j->jobid + 1;
-      j = NULL;
-    } else {
-      delete_DB(j->jobid, "Jobs");
+      return;
     }
-  } else if (j->state == QUEUED || j->state == LOCKED) {
-    printf("add the queue job %d\n", j->jobid);
-    if (j->state == QUEUED) {
-      j->state = WAIT;
+    /* It ended while the server was down, and its client left the
+     * result: finished by finish_ended_jobs() */
+    if (j->pid > 0) {
+      char *path = create_status_path(j->jobid);
+      int ended = access(path, F_OK) == 0;
+
+      free(path);
+      if (ended) {
+        j->adopted = 1;
+        j->pidfd = -1;
+        queue_append(j);
+        count_job_client(j, 1);
+        return;
+      }
     }
-
-    // jobDB_wait_num++;
-    (*p)->next = j;
-    (*p) = j;
-
-    char c[32];
-    sprintf(c, " -J %d ", j->jobid);
-    char *str = insert_chars_check(j->command_strip, j->command, c);
-
-    fork_cmd(user_UID[j->ts_UID], j->work_dir, str);
+    delete_DB(j->jobid, "Jobs");
+  } else if (j->state == QUEUED || j->state == LOCKED) {
+    /* Not counted in jobs_with_client */
+    j->detached = 1;
+    queue_append(j);
+    /* Into its ready queue, it was read QUEUED but in no queue yet */
+    set_job_state(j, j->state);
     jobids = jobids > j->jobid ? jobids : j->jobid + 1;
-    j = NULL;
-    free(str);
-    /*
-    printf("add job %d; CMD = %s\n", j->jobid, j->command);
-    jobDB_Jobs[jobDB_num] = j;
-    jobDB_num++;
-    user_queue[j->ts_UID]++;
-    (*p)->next = j;
-    (*p) = j;
-    */
+    return;
   }
 
   destroy_job(j);
 }
 
-void s_read_sqlite() {
-  int num_jobs, *jobs_DB = NULL;
-  struct Job *job, *p;
-  p = &firstjob;
-  num_jobs = read_jobid_DB(&(jobs_DB), "Jobs");
-  // printf("read from jobs %d\n", num_jobs);
-  // jobDB_Jobs = (struct Job**)malloc(sizeof(struct Job*) * num_jobs);
-  printf("Jobs:\n");
-  for (int i = 0; i < num_jobs; i++) {
-    job = read_DB(jobs_DB[i], "Jobs");
-    if (job == NULL) {
-      printf("Error in reading DB %d\n", jobs_DB[i]);
-    } else {
-      s_add_job(job, &p);
-    }
+/* Link again the dependencies of the restored queue from the depend_on
+ * of each job. The stored reverse edges may be stale, as a job is saved
+ * before its dependents are queued. */
+static void rebuild_dependencies() {
+  struct Job *p;
+  int i;
+
+  for (p = firstjob.next; p != NULL; p = p->next) {
+    free(p->notify_errorlevel_to);
+    p->notify_errorlevel_to = NULL;
+    p->notify_errorlevel_to_size = 0;
+    p->notify_errorlevel_to_allocated = 0;
+    p->pending_deps = 0;
   }
-  p->next = NULL;
-  // clear_DB("Jobs");
-
-  // finished jobs
-  p = &first_finished_job;
-  num_jobs = read_jobid_DB(&(jobs_DB), "Finished");
-  printf("Finished:\n");
-  for (int i = 0; i < num_jobs; i++) {
-    job = read_DB(jobs_DB[i], "Finished");
-    if (job == NULL) {
-      printf("Error in reading DB %d\n", jobs_DB[i]);
-    } else {
-      printf("add job: %d from %d\n", job->jobid, jobs_DB[i]);
-      p->next = job;
-      p = job;
+
+  for (p = firstjob.next; p != NULL; p = p->next) {
+    for (i = 0; i < p->depend_on_size; ++i) {
+      struct Job *depended_job = findjob(p->depend_on[i]);
+      if (depended_job != NULL && depended_job != p)
+        add_notify_errorlevel_to(depended_job, p);
     }
   }
-  p->next = NULL;
-  free(jobs_DB);
+}
+
+void s_read_sqlite() {
+  int n;
+
+  /* One ordered pass per table */
+  n = read_all_DB("Jobs", s_add_job);
+  if (n < 0)
+    warning("Cannot read the queued jobs from the database");
+  rebuild_dependencies();
+
+  n = read_all_DB("Finished", finished_append);
+  if (n < 0)
+    warning("Cannot read the finished jobs from the database");
+  /* After the finished jobs they go, with their dependencies linked */
+  finish_ended_jobs();
+  /* The evictions not flushed before the server went down */
+  evict_finished_jobs(get_max_finished_jobs());
+  flush_evicted_jobs();
   set_jobids_DB(jobids);
 }
 
 void s_clear_finished(int ts_UID) {
-  struct Job *p, *other_user_job = &first_finished_job;
-  if (first_finished_job.next == NULL)
-    return;
+  struct Job *p;
 
   p = first_finished_job.next;
-  other_user_job->next = NULL;
   while (p != NULL) {
     struct Job *tmp;
     tmp = p->next;
     if (p->ts_UID == ts_UID || ts_UID == 0) {
-      delete_DB(p->jobid, "Finished");
+      finished_remove(p);
+      evicted_jobids[evicted_count++] = p->jobid;
+      if (evicted_count == FINISHED_DELETE_BATCH)
+        flush_evicted_jobs();
       destroy_job(p);
-    } else {
-      other_user_job->next = p;
-      other_user_job = p;
     }
     p = tmp;
   }
-  other_user_job->next = NULL;
+  flush_evicted_jobs();
+}
+
+/* The rows of ts --history sent at once; the client asks for the next */
+enum { HISTORY_PAGE = 200 };
+
+struct HistoryPage {
+  int rows;
+  long last_time; /* of the last row sent */
+  int last_jobid;
+};
+
+static void send_history_line(const struct Job *p, void *arg) {
+  struct HistoryPage *page = (struct HistoryPage *)arg;
+  char *line = history_line(p);
+
+  list_text(line);
+  free(line);
+  page->rows++;
+  page->last_time = p->info.end_time.tv_sec;
+  page->last_jobid = p->jobid;
+}
+
+static int history_match(const struct Job *p, const struct HistoryQuery *q) {
+  if (q->ts_UID != -1 && p->ts_UID != q->ts_UID)
+    return 0;
+  if (q->since > 0 && p->info.end_time.tv_sec < q->since)
+    return 0;
+  if (q->label != NULL && (p->label == NULL || strcmp(p->label, q->label) != 0))
+    return 0;
+  if (q->failed && p->result.errorlevel == 0 && !p->result.died_by_signal)
+    return 0;
+  return 1;
+}
+
+/* ts --history: the finished jobs stored, the newest first. It goes one
+ * page per request, so the other clients are served in between; the page
+ * ends with HISTORY_NEXT if there may be more. Returns 1 if the client
+ * asks for the next one, 0 if it is done. */
+int s_history(int s, int ts_UID, struct Msg *m) {
+  struct HistoryQuery q;
+  struct HistoryPage page = {0, 0, 0};
+  char *label = NULL;
+  char *buffer;
+  int size = m->u.history.label_size;
+  int n;
+
+  if (size > 0) {
+    label = (char *)malloc(size);
+    if (label == NULL || recv_bytes(s, label, size) != size) {
+      warning("Cannot receive the label of the history");
+      free(label);
+      return 0;
+    }
+    label[size - 1] = '\0';
+  }
+
+  q.ts_UID = -1;
+  if (m->u.history.uid != -1) {
+    q.ts_UID = get_tsUID(m->u.history.uid);
+    if (q.ts_UID == -1) {
+      send_list_line(s, "The user is not in the server.\n");
+      free(label);
+      return 0;
+    }
+  }
+  /* The users see their own jobs, as in the list */
+  if (ts_UID != 0) {
+    if (q.ts_UID != -1 && q.ts_UID != ts_UID) {
+      send_list_line(s, "Only the root can see the jobs of other users.\n");
+      free(label);
+      return 0;
+    }
+    q.ts_UID = ts_UID;
+  }
+  q.since = m->u.history.since;
+  q.label = label;
+  q.failed = m->u.history.failed;
+  q.before_time = m->u.history.before_time;
+  q.before_jobid = m->u.history.before_jobid;
+  q.limit = HISTORY_PAGE;
+
+  list_begin(s, DEFAULT, 0);
+  if (q.before_jobid == 0) {
+    buffer = history_headers();
+    list_text(buffer);
+    free(buffer);
+  }
+
+  n = history_DB(&q, send_history_line, &page);
+  if (n < 0) {
+    /* No history in the store: the finished list, in one page */
+    if (q.before_jobid == 0) {
+      struct Job *p;
+
+      for (p = last_finished_job; p != &first_finished_job; p = p->prev)
+        if (history_match(p, &q))
+          send_history_line(p, &page);
+    }
+    n = 0;
+  }
+  list_end();
+  free(label);
+  if (n < q.limit)
+    return 0;
+
+  *m = default_msg();
+  m->type = HISTORY_NEXT;
+  m->u.history.before_time = page.last_time;
+  m->u.history.before_jobid = page.last_jobid;
+  send_msg(s, m);
+  return 1;
 }
 
+/* The paused jobs stay stopped, even if something else continues them.
+ * Checked at most once a second, and only up to the last paused job. */
 void s_check_holdon() {
+  static time_t last_check;
+  time_t now = time(NULL);
+  int left = queue_states[PAUSE];
   struct Job *p;
-  /* Show Queued or Running jobs */
-  p = firstjob.next;
-  while (p != 0) {
-    if (p->pid != 0 && p->state == PAUSE) {
-      if (is_sleep(p->pid) == 0) {
-        kill_pids(p->pid, SIGSTOP, NULL);
-      }
-    }
-    p = p->next;
+
+  if (left == 0 || now == last_check)
+    return;
+  last_check = now;
+  for (p = firstjob.next; p != NULL && left > 0; p = p->next) {
+    if (p->state != PAUSE)
+      continue;
+    left--;
+    if (p->pid != 0 && is_sleep(p->pid) == 0)
+      kill_pids(p->pid, SIGSTOP, NULL);
   }
 }
 
@@ -1612,7 +2611,7 @@ void s_process_runjob_ok(int jobid, char *oname, int pid) {
   if (p->state != RUNNING)
     error("Job %i not running, but %i on runjob_ok", jobid, p->state);
 
-  p->pid = pid;
+  set_job_pid(p, pid);
   if (oname != NULL && strlen(oname) != 0) {
     p->output_filename = oname;
   }
@@ -1623,7 +2622,7 @@ void s_process_runjob_ok(int jobid, char *oname, int pid) {
     //if (p->state == PAUSE) {
     // config_running(p);
     //}
-    insert_or_replace_DB(p, "Jobs");
+    start_DB(p);
   }
 
 }
@@ -1664,25 +2663,14 @@ void s_job_info(int s, int jobid) {
               "firstjob = %x",
               firstjob.next);
     } else {
-      p = first_finished_job.next;
-      if (p == 0) {
+      if (last_finished_job == &first_finished_job) {
         send_list_line(s, "No jobs.\n");
         return;
       }
-      while (p->next != 0)
-        p = p->next;
+      p = last_finished_job;
     }
   } else {
-    p = firstjob.next;
-    while (p != 0 && p->jobid != jobid)
-      p = p->next;
-
-    /* Look in finished jobs if needed */
-    if (p == 0) {
-      p = first_finished_job.next;
-      while (p != 0 && p->jobid != jobid)
-        p = p->next;
-    }
+    p = get_job(jobid);
   }
 
   if (p == 0) {
@@ -1696,7 +2684,19 @@ void s_job_info(int s, int jobid) {
 
   float t;
   send_msg(s, &m);
+  if (p->env != NULL) {
+    fd_nprintf(s, 100, "Environment:\n");
+    write(s, p->env->body, strlen(p->env->body));
+  }
   pinfo_dump(&p->info, s);
+  if (p->state == FINISHED || p->state == SKIPPED) {
+    if (p->result.died_by_signal)
+      fd_nprintf(s, 100, "Exit status: killed by signal %i\n",
+                 p->result.signal);
+    else
+      fd_nprintf(s, 100, "Exit status: died with exit code %i\n",
+                 p->result.errorlevel);
+  }
   fd_nprintf(s, 100, "Command: ");
   if (p->depend_on) {
     fd_nprintf(s, 100, "[%i,", p->depend_on[0]);
@@ -1705,7 +2705,7 @@ void s_job_info(int s, int jobid) {
     fd_nprintf(s, 100, "]&& ");
   }
   const char* status = "";
-  if (p->state != PAUSE && is_sleep(p->pid)) {
+  if (p->state == RUNNING && is_sleep(p->pid) == 1) {
     status = " in SLEEP!";
   }
   write(s, p->command + p->command_strip,
@@ -1714,6 +2714,16 @@ void s_job_info(int s, int jobid) {
   fd_nprintf(s, 100, "User: %s [%d]\n", user_name[p->ts_UID],
              user_UID[p->ts_UID]);
   fd_nprintf(s, 100, "State: %9s PID: %-6d%s\n", jstate2string(p->state), p->pid, status);
+  if (p->state == RUNNING || p->state == PAUSE) {
+    const struct ProcStat *ps = procstat_get(p->pid);
+
+    if (ps != NULL && ps->cpu >= 0)
+      fd_nprintf(s, 100, "Process: %c, %i threads, RSS %ld kB, CPU %.1f%%\n",
+                 ps->state, ps->threads, ps->rss_kb, ps->cpu);
+    else if (ps != NULL)
+      fd_nprintf(s, 100, "Process: %c, %i threads, RSS %ld kB\n", ps->state,
+                 ps->threads, ps->rss_kb);
+  }
 
 #ifdef TASKSET
   if (p->cores != NULL) {
@@ -1819,7 +2829,8 @@ void s_suspend_user(int s, int ts_UID) {
       // p->state = HOLDING_CLIENT;
       if (p->pid != 0) {
         safe_pause_pid(p);
-        p->state = PAUSE;
+        set_job_state(p, PAUSE);
+        job_event(p, EVENT_PAUSED);
       } else {
         char *label = "(...)";
         if (p->label != NULL)
@@ -1851,13 +2862,11 @@ void s_send_output(int s, int jobid) {
               "firstjob = %x",
               firstjob.next);
     } else {
-      p = first_finished_job.next;
-      if (p == 0) {
+      if (last_finished_job == &first_finished_job) {
         send_list_line(s, "No jobs.\n");
         return;
       }
-      while (p->next != 0)
-        p = p->next;
+      p = last_finished_job;
     }
   } else {
     p = get_job(jobid);
@@ -1905,19 +2914,26 @@ void notify_errorlevel(struct Job *p) {
 
   for (i = 0; i < p->notify_errorlevel_to_size; ++i) {
     struct Job *notified;
-    notified = get_job(p->notify_errorlevel_to[i]);
+    notified = findjob(p->notify_errorlevel_to[i]);
     if (notified) {
       notified->dependency_errorlevel += abs(p->result.errorlevel);
+      dependency_done(notified);
     }
   }
+  /* Each dependent is notified only once, even if p is removed later
+   * from the finished list */
+  free(p->notify_errorlevel_to);
+  p->notify_errorlevel_to = NULL;
+  p->notify_errorlevel_to_size = 0;
+  p->notify_errorlevel_to_allocated = 0;
 }
 
 /* jobid is input/output. If the input is -1, it's changed to the jobid
  * removed */
 int s_remove_job(int s, int *jobid, int client_tsUID) {
+  int in_queue;
   struct Job *p = 0;
   struct Msg m = default_msg();
-  struct Job *before_p = &firstjob;
 
   if (client_tsUID < 0 || client_tsUID > USER_MAX) {
     snprintf(buff, 255, "invalid ts_UID [%d] in job removal.\n", client_tsUID);
@@ -1927,39 +2943,21 @@ int s_remove_job(int s, int *jobid, int client_tsUID) {
 
   if (*jobid == -1) {
     /* Find the last job added */
-    p = firstjob.next;
-    if (p != 0) {
-      while (p->next != 0) {
-        before_p = p;
-        p = p->next;
-      }
+    if (lastjob != &firstjob) {
+      p = lastjob;
     } else {
       /* last 'finished' */
       p = first_finished_job.next;
-      before_p = &first_finished_job;
       if (p) {
-        while (p->next != 0) {
-          before_p = p;
+        while (p->next != 0)
           p = p->next;
-        }
       }
     }
   } else {
     p = findjob(*jobid);
-    before_p = find_previous_job(p);
     /* If not found, look in the 'finished' list */
-    if (p == 0 || p->jobid != *jobid) {
-      p = first_finished_job.next;
-      before_p = &first_finished_job;
-      if (p != 0) {
-        while (p->next != 0 && p->jobid != *jobid) {
-          before_p = p;
-          p = p->next;
-        }
-        if (p->jobid != *jobid)
-          p = 0;
-      }
-    }
+    if (p == 0)
+      p = find_finished_job(*jobid);
   }
 
   if (p != NULL && client_tsUID == 0) {
@@ -2015,9 +3013,11 @@ int s_remove_job(int s, int *jobid, int client_tsUID) {
   */
   /* Return the jobid found */
   *jobid = p->jobid;
+  in_queue = (findjob(p->jobid) == p);
   delete_DB(p->jobid, "Jobs");
+  job_event(p, EVENT_REMOVED);
   /* Tricks for the check_notify_list */
-  p->state = FINISHED;
+  set_job_state(p, FINISHED);
   p->result.errorlevel = -1;
   notify_errorlevel(p);
 
@@ -2025,8 +3025,12 @@ int s_remove_job(int s, int *jobid, int client_tsUID) {
   check_notify_list(m.jobid);
 
   /* Update the list pointers */
-  before_p->next = p->next;
-
+  if (in_queue) {
+    queue_remove(p);
+    count_job_client(p, -1);
+  } else {
+    finished_remove(p);
+  }
   destroy_job(p);
 
   m.type = REMOVEJOB_OK;
@@ -2150,23 +3154,30 @@ void s_unlock_server(int s, int ts_UID) {
 
 static void s_lock_queue(struct Job *p) {
   if (p->state == QUEUED) {
-    user_queue[p->ts_UID]--;
-    p->state = LOCKED;
+    set_job_state(p, LOCKED);
     set_state_DB(p->jobid, LOCKED);
+    job_event(p, EVENT_PAUSED);
   }
 }
 
 static void s_unlock_queue(struct Job *p) {
   if (p->state == LOCKED) {
-    user_queue[p->ts_UID]++;
-    p->state = QUEUED;
+    set_job_state(p, QUEUED);
     set_state_DB(p->jobid, QUEUED);
+    job_event(p, EVENT_RESUMED);
   }
 }
 
 static int safe_pause_pid(struct Job *p) {
+  int i;
+
   kill(p->pid, SIGSTOP);
   kill_pids(p->pid, SIGSTOP, NULL);
+  /* It stops once it is scheduled: wait up to 100 ms for it */
+  for (i = 0; i < 100 && is_sleep(p->pid) == 0; ++i) {
+    usleep(1000);
+    procstat_forget(p->pid);
+  }
   if (is_sleep(p->pid) == 1) {
     free_cores(p);
     return 0;
@@ -2220,7 +3231,8 @@ void s_hold_job(int s, int jobid, int ts_UID) {
   if (p->pid != 0 && (job_tsUID = ts_UID || ts_UID == 0)) {
     // kill_pid(p->pid, "kill -s STOP", NULL);
     if (safe_pause_pid(p) == 0) {
-      p->state = PAUSE;
+      set_job_state(p, PAUSE);
+      job_event(p, EVENT_PAUSED);
       snprintf(buff, 255, "To pause job [%d] successfully!\n", jobid);
     } else {
       snprintf(buff, 255, "Error: cannot pause job [%d] using kill SIGSTOP\n",
@@ -2272,6 +3284,7 @@ void s_cont_job(int s, int jobid, int ts_UID) {
       snprintf(buff, 255, "job [%d] is aleady in RUNNING.\n", jobid);
     } else {
       kill_pids(p->pid, SIGCONT, NULL);
+      job_event(p, EVENT_RESUMED);
       snprintf(buff, 255, "job [%d] is continued.\n", jobid);
     }
   } else {
@@ -2322,17 +3335,10 @@ void s_remove_notification(int s) {
 }
 
 static void destroy_finished_job(struct Job *j) {
-  struct Job *p = &first_finished_job;
-  while (p->next != 0) {
-    if (p->next != j) {
-      p = p->next;
-    } else {
-      p->next = j->next;
-      destroy_job(j);
-      return;
-    }
-  }
-  error("Cannot destroy the expected job %i", j->jobid);
+  if (find_finished_job(j->jobid) != j)
+    error("Cannot destroy the expected job %i", j->jobid);
+  finished_remove(j);
+  destroy_job(j);
 }
 
 /* This is called when a job finishes */
@@ -2370,30 +3376,16 @@ void s_wait_job(int s, int jobid) {
 
   if (jobid == -1) {
     /* Find the last job added */
-    p = firstjob.next;
-
-    if (p != 0)
-      while (p->next != 0)
-        p = p->next;
+    if (lastjob != &firstjob)
+      p = lastjob;
 
     /* Look in finished jobs if needed */
     if (p == 0) {
-      p = first_finished_job.next;
-      if (p != 0)
-        while (p->next != 0)
-          p = p->next;
+      if (last_finished_job != &first_finished_job)
+        p = last_finished_job;
     }
   } else {
-    p = firstjob.next;
-    while (p != 0 && p->jobid != jobid)
-      p = p->next;
-
-    /* Look in finished jobs if needed */
-    if (p == 0) {
-      p = first_finished_job.next;
-      while (p != 0 && p->jobid != jobid)
-        p = p->next;
-    }
+    p = get_job(jobid);
   }
 
   if (p == 0) {
@@ -2426,25 +3418,14 @@ void s_wait_running_job(int s, int jobid) {
               "firstjob = %x",
               firstjob.next);
     } else {
-      p = first_finished_job.next;
-      if (p == 0) {
+      if (last_finished_job == &first_finished_job) {
         send_list_line(s, "No jobs.\n");
         return;
       }
-      while (p->next != 0)
-        p = p->next;
+      p = last_finished_job;
     }
   } else {
-    p = firstjob.next;
-    while (p != 0 && p->jobid != jobid)
-      p = p->next;
-
-    /* Look in finished jobs if needed */
-    if (p == 0) {
-      p = first_finished_job.next;
-      while (p != 0 && p->jobid != jobid)
-        p = p->next;
-    }
+    p = get_job(jobid);
   }
 
   if (p == 0) {
@@ -2487,18 +3468,14 @@ void s_get_max_slots(int s) {
 void s_move_urgent(int s, int jobid) {
   struct Job *p = 0;
   struct Job *tmp1;
+  struct JobQueue *q;
 
   if (jobid == -1) {
     /* Find the last job added */
-    p = firstjob.next;
-
-    if (p != 0)
-      while (p->next != 0)
-        p = p->next;
+    if (lastjob != &firstjob)
+      p = lastjob;
   } else {
-    p = firstjob.next;
-    while (p != 0 && p->jobid != jobid)
-      p = p->next;
+    p = findjob(jobid);
   }
 
   // firstjob.next means no run job
@@ -2518,17 +3495,19 @@ void s_move_urgent(int s, int jobid) {
     send_list_line(s, buff);
     return;
   }
-  tmp1->next = p->next;
-  p->next = firstjob.next;
-  firstjob.next = p;
-  movetop_DB(jobid);
+  q = job_queue_leave(p);
+  queue_unlink(p);
+  queue_link_after(&firstjob, p);
+  movetop_DB(p);
+  if (q != NULL)
+    job_queue_insert(q, p);
   send_urgent_ok(s);
 }
 
 void s_swap_jobs(int s, int jobid1, int jobid2) {
   struct Job *p1, *p2;
   struct Job *prev1, *prev2;
-  struct Job *tmp;
+  struct JobQueue *q1, *q2;
 
   p1 = findjob(jobid1);
   p2 = findjob(jobid2);
@@ -2541,14 +3520,27 @@ void s_swap_jobs(int s, int jobid1, int jobid2) {
   }
 
   /* Interchange the pointers */
+  q1 = job_queue_leave(p1);
+  q2 = job_queue_leave(p2);
   prev1 = find_previous_job(p1);
   prev2 = find_previous_job(p2);
-  prev1->next = p2;
-  prev2->next = p1;
-  tmp = p1->next;
-  p1->next = p2->next;
-  p2->next = tmp;
-  swap_DB(jobid1, jobid2);
+  if (prev2 == p1) {
+    queue_unlink(p2);
+    queue_link_after(prev1, p2);
+  } else if (prev1 == p2) {
+    queue_unlink(p1);
+    queue_link_after(prev2, p1);
+  } else if (p1 != p2) {
+    queue_unlink(p1);
+    queue_unlink(p2);
+    queue_link_after(prev1, p2);
+    queue_link_after(prev2, p1);
+  }
+  swap_DB(p1, p2);
+  if (q1 != NULL)
+    job_queue_insert(q1, p1);
+  if (q2 != NULL)
+    job_queue_insert(q2, p2);
   send_swap_jobs_ok(s);
 }
 
@@ -2561,28 +3553,29 @@ static void send_state(int s, enum Jobstate state) {
   send_msg(s, &m);
 }
 
-void s_send_state(int s, int jobid) {
+/* The job of ts -s, the last added for -1. NULL if there is none. */
+const struct Job *job_of_state(int jobid) {
   struct Job *p = 0;
 
   if (jobid == -1) {
     /* Find the last job added */
-    p = firstjob.next;
-
-    if (p != 0)
-      while (p->next != 0)
-        p = p->next;
+    if (lastjob != &firstjob)
+      p = lastjob;
 
     /* Look in finished jobs if needed */
     if (p == 0) {
-      p = first_finished_job.next;
-      if (p != 0)
-        while (p->next != 0)
-          p = p->next;
+      if (last_finished_job != &first_finished_job)
+        p = last_finished_job;
     }
 
   } else {
     p = get_job(jobid);
   }
+  return p;
+}
+
+void s_send_state(int s, int jobid) {
+  const struct Job *p = job_of_state(jobid);
 
   if (p == 0) {
     if (jobid == -1)
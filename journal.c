@@ -0,0 +1,873 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2009  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/* The journal backend of the store (TS_STORE=journal). The state is an
+ * append-only log of binary records, <TS_SQLITE_PATH>.journal, on top of
+ * a compacted snapshot, <TS_SQLITE_PATH>.snapshot. A transaction is one
+ * write() and one fdatasync() of its records. A copy of the rows, as the
+ * tables Jobs and Finished would hold them, is kept in memory: the replay
+ * builds it, the commits apply their records to it once they are on disk,
+ * and the compaction writes it out as the new snapshot once the journal
+ * grows larger than the last one. The environments are
+ * records of their own, written once, that the rows refer to by hash.
+ *
+ * A record is its payload size and CRC-32, and the payload, which starts
+ * with the RecordType, all in host byte order. The journal and the
+ * snapshot start with a R_GENERATION record; a journal only follows the
+ * snapshot of its own generation. A torn record at the end is dropped. */
+
+enum RecordType {
+  R_GENERATION,
+  R_INSERT,
+  R_START,
+  R_FINISH,
+  R_DELETE,
+  R_STATE,
+  R_ORDER,
+  R_JOBIDS,
+  R_ENV,
+  R_REMOVE_ENV
+};
+
+enum { RECORD_HEADER = 8, JOURNAL_MIN_COMPACT = 4 << 20 };
+
+struct Buffer {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+struct Reader {
+  const char *pos;
+  const char *end;
+  int bad;
+};
+
+/* The rows of Jobs and Finished, by jobid, through row->job.id_next */
+static struct JobIndex rows[2];
+
+/* The environments, by hash. There are few different ones. */
+struct EnvRecord {
+  struct EnvRecord *next;
+  uint64_t hash;
+  int used; /* by a row, for the compaction */
+  char env[];
+};
+
+enum { ENV_BUCKETS = 256 };
+static struct EnvRecord *envs[ENV_BUCKETS];
+static int stored_jobids = 1000;
+static unsigned int generation = 0;
+static int journal_fd = -1;
+static char *journal_path = NULL;
+static char *snapshot_path = NULL;
+static long journal_size = 0;
+static long snapshot_size = 0;
+static struct Buffer pending; /* the records of the open transaction */
+
+static uint32_t record_crc(const char *data, size_t len) {
+  static uint32_t table[256];
+  uint32_t crc = 0xFFFFFFFFu;
+  size_t i;
+
+  if (table[1] == 0) {
+    for (i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      int k;
+      for (k = 0; k < 8; ++k)
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  for (i = 0; i < len; ++i)
+    crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFFu;
+}
+
+static char *path_with(const char *suffix) {
+  const char *base = get_sqlite_path();
+  char *path = (char *)malloc(strlen(base) + strlen(suffix) + 1);
+
+  if (path == NULL)
+    error("Cannot allocate the journal path");
+  strcpy(path, base);
+  strcat(path, suffix);
+  return path;
+}
+
+/* The rows */
+
+static struct JobRow *find_row(int table, int jobid) {
+  /* The job is the first member of its row */
+  return (struct JobRow *)jobindex_find(&rows[table], jobid);
+}
+
+static void drop_row(int table, int jobid) {
+  struct JobRow *row = find_row(table, jobid);
+
+  if (row == NULL)
+    return;
+  jobindex_remove(&rows[table], &row->job);
+  free(row);
+}
+
+static void put_row(int table, struct JobRow *row) {
+  drop_row(table, row->job.jobid);
+  jobindex_insert(&rows[table], &row->job);
+}
+
+static struct EnvRecord **find_env(uint64_t hash) {
+  struct EnvRecord **link = &envs[hash % ENV_BUCKETS];
+
+  while (*link != NULL && (*link)->hash != hash)
+    link = &(*link)->next;
+  return link;
+}
+
+static void drop_env(uint64_t hash) {
+  struct EnvRecord **link = find_env(hash);
+  struct EnvRecord *e = *link;
+
+  if (e == NULL)
+    return;
+  *link = e->next;
+  free(e);
+}
+
+static void put_env(uint64_t hash, const char *env) {
+  struct EnvRecord *e;
+
+  drop_env(hash);
+  e = (struct EnvRecord *)malloc(sizeof(*e) + strlen(env) + 1);
+  if (e == NULL)
+    error("Cannot allocate an environment of the journal");
+  e->hash = hash;
+  e->used = 0;
+  strcpy(e->env, env);
+  e->next = envs[hash % ENV_BUCKETS];
+  envs[hash % ENV_BUCKETS] = e;
+}
+
+static void free_rows() {
+  int t, i;
+
+  for (i = 0; i < ENV_BUCKETS; ++i)
+    while (envs[i] != NULL)
+      drop_env(envs[i]->hash);
+  for (t = 0; t < 2; ++t) {
+    for (i = 0; i < rows[t].size; ++i) {
+      struct Job *p = rows[t].buckets[i];
+      while (p != NULL) {
+        struct Job *next = p->id_next;
+        free(p);
+        p = next;
+      }
+    }
+    free(rows[t].buckets);
+    memset(&rows[t], 0, sizeof(rows[t]));
+  }
+}
+
+/* Encoding */
+
+static void put_bytes(struct Buffer *b, const void *data, size_t len) {
+  if (b->len + len > b->size) {
+    size_t size = b->size ? b->size : 4096;
+    while (size < b->len + len)
+      size *= 2;
+    b->data = (char *)realloc(b->data, size);
+    if (b->data == NULL)
+      error("Cannot allocate %li bytes for the journal", (long)size);
+    b->size = size;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void put_int(struct Buffer *b, int32_t v) {
+  put_bytes(b, &v, sizeof(v));
+}
+
+static void put_i64(struct Buffer *b, int64_t v) {
+  put_bytes(b, &v, sizeof(v));
+}
+
+static void put_float(struct Buffer *b, float v) {
+  put_bytes(b, &v, sizeof(v));
+}
+
+/* Its length with the final 0, or 0 for NULL */
+static void put_string(struct Buffer *b, const char *str) {
+  if (str == NULL) {
+    put_int(b, 0);
+    return;
+  }
+  put_int(b, strlen(str) + 1);
+  put_bytes(b, str, strlen(str) + 1);
+}
+
+static size_t begin_record(struct Buffer *b, enum RecordType type) {
+  size_t start = b->len;
+  char header[RECORD_HEADER] = {0};
+
+  put_bytes(b, header, RECORD_HEADER);
+  put_int(b, type);
+  return start;
+}
+
+static void end_record(struct Buffer *b, size_t start) {
+  uint32_t size = b->len - start - RECORD_HEADER;
+  uint32_t crc = record_crc(b->data + start + RECORD_HEADER, size);
+
+  memcpy(b->data + start, &size, 4);
+  memcpy(b->data + start + 4, &crc, 4);
+}
+
+static void put_row_values(struct Buffer *b, const struct JobRow *row) {
+  const struct Job *job = &row->job;
+
+  put_int(b, job->jobid);
+  put_int(b, job->state);
+  put_int(b, job->store_output);
+  put_int(b, job->pid);
+  put_int(b, job->ts_UID);
+  put_int(b, job->should_keep_finished);
+  put_int(b, job->depend_on_size);
+  put_int(b, job->notify_errorlevel_to_size);
+  put_int(b, job->dependency_errorlevel);
+  put_int(b, job->num_slots);
+  put_int(b, job->result.errorlevel);
+  put_int(b, job->result.died_by_signal);
+  put_int(b, job->result.signal);
+  put_int(b, job->result.skipped);
+  put_float(b, job->result.user_ms);
+  put_float(b, job->result.system_ms);
+  put_float(b, job->result.real_ms);
+  put_i64(b, job->info.enqueue_time.tv_sec);
+  put_i64(b, job->info.enqueue_time.tv_usec);
+  put_i64(b, job->info.start_time.tv_sec);
+  put_i64(b, job->info.start_time.tv_usec);
+  put_i64(b, job->info.end_time.tv_sec);
+  put_i64(b, job->info.end_time.tv_usec);
+  put_int(b, job->order_id);
+  put_int(b, job->command_strip);
+  put_string(b, job->command);
+  put_string(b, job->work_dir);
+  put_string(b, job->label);
+  put_string(b, job->email);
+  put_string(b, job->output_filename);
+  put_string(b, job->info.ptr);
+  put_string(b, row->depend_on);
+  put_string(b, row->notify_errorlevel_to);
+  put_i64(b, row->env_hash);
+}
+
+/* Decoding */
+
+static void get_bytes(struct Reader *r, void *data, size_t len) {
+  if (r->bad || r->end - r->pos < (long)len) {
+    r->bad = 1;
+    memset(data, 0, len);
+    return;
+  }
+  memcpy(data, r->pos, len);
+  r->pos += len;
+}
+
+static int32_t get_int(struct Reader *r) {
+  int32_t v;
+  get_bytes(r, &v, sizeof(v));
+  return v;
+}
+
+static int64_t get_i64(struct Reader *r) {
+  int64_t v;
+  get_bytes(r, &v, sizeof(v));
+  return v;
+}
+
+static float get_float(struct Reader *r) {
+  float v;
+  get_bytes(r, &v, sizeof(v));
+  return v;
+}
+
+/* It stays in the buffer read */
+static char *get_string(struct Reader *r) {
+  int32_t len = get_int(r);
+  const char *str = r->pos;
+
+  if (r->bad || len == 0)
+    return NULL;
+  if (len < 0 || r->end - r->pos < len || str[len - 1] != '\0') {
+    r->bad = 1;
+    return NULL;
+  }
+  r->pos += len;
+  return (char *)str;
+}
+
+static struct JobRow *get_row(struct Reader *r) {
+  struct Job job = {0};
+  char *depend_on, *notify_errorlevel_to;
+  uint64_t env_hash;
+  struct JobRow *row;
+
+  job.jobid = get_int(r);
+  job.state = get_int(r);
+  job.store_output = get_int(r);
+  job.pid = get_int(r);
+  job.ts_UID = get_int(r);
+  job.should_keep_finished = get_int(r);
+  job.depend_on_size = get_int(r);
+  job.notify_errorlevel_to_size = get_int(r);
+  job.dependency_errorlevel = get_int(r);
+  job.num_slots = get_int(r);
+  job.result.errorlevel = get_int(r);
+  job.result.died_by_signal = get_int(r);
+  job.result.signal = get_int(r);
+  job.result.skipped = get_int(r);
+  job.result.user_ms = get_float(r);
+  job.result.system_ms = get_float(r);
+  job.result.real_ms = get_float(r);
+  job.info.enqueue_time.tv_sec = get_i64(r);
+  job.info.enqueue_time.tv_usec = get_i64(r);
+  job.info.start_time.tv_sec = get_i64(r);
+  job.info.start_time.tv_usec = get_i64(r);
+  job.info.end_time.tv_sec = get_i64(r);
+  job.info.end_time.tv_usec = get_i64(r);
+  job.order_id = get_int(r);
+  job.command_strip = get_int(r);
+  job.command = get_string(r);
+  job.work_dir = get_string(r);
+  job.label = get_string(r);
+  job.email = get_string(r);
+  job.output_filename = get_string(r);
+  job.info.ptr = get_string(r);
+  depend_on = get_string(r);
+  notify_errorlevel_to = get_string(r);
+  env_hash = get_i64(r);
+  if (r->bad)
+    return NULL;
+  row = new_job_row(&job, depend_on, notify_errorlevel_to);
+  row->env_hash = env_hash;
+  return row;
+}
+
+/* Apply a record to the rows: the same for the replay and the writes */
+static void apply_record(const char *payload, size_t size) {
+  struct Reader r = {payload, payload + size, 0};
+  enum RecordType type = get_int(&r);
+  struct JobRow *row;
+  int table, jobid, n, i;
+
+  switch (type) {
+  case R_GENERATION:
+    generation = get_int(&r);
+    break;
+  case R_INSERT:
+    table = get_int(&r);
+    row = get_row(&r);
+    if (row != NULL && (table == JOBS_TABLE || table == FINISHED_TABLE))
+      put_row(table, row);
+    else
+      free(row);
+    break;
+  case R_START: {
+    struct Job job;
+    jobid = get_int(&r);
+    row = find_row(JOBS_TABLE, jobid);
+    if (row == NULL)
+      break;
+    job = row->job;
+    job.state = get_int(&r);
+    job.pid = get_int(&r);
+    job.info.start_time.tv_sec = get_i64(&r);
+    job.info.start_time.tv_usec = get_i64(&r);
+    job.output_filename = get_string(&r);
+    if (!r.bad) {
+      struct JobRow *started =
+          new_job_row(&job, row->depend_on, row->notify_errorlevel_to);
+      started->env_hash = row->env_hash;
+      put_row(JOBS_TABLE, started);
+    }
+    break;
+  }
+  case R_FINISH:
+    row = get_row(&r);
+    if (row != NULL) {
+      drop_row(JOBS_TABLE, row->job.jobid);
+      put_row(FINISHED_TABLE, row);
+    }
+    break;
+  case R_DELETE:
+    table = get_int(&r);
+    n = get_int(&r);
+    for (i = 0; i < n && !r.bad; ++i) {
+      jobid = get_int(&r);
+      if (!r.bad && (table == JOBS_TABLE || table == FINISHED_TABLE))
+        drop_row(table, jobid);
+    }
+    break;
+  case R_STATE:
+    jobid = get_int(&r);
+    row = find_row(JOBS_TABLE, jobid);
+    n = get_int(&r);
+    if (row != NULL && !r.bad)
+      row->job.state = n;
+    break;
+  case R_ORDER:
+    jobid = get_int(&r);
+    row = find_row(JOBS_TABLE, jobid);
+    n = get_int(&r);
+    if (row != NULL && !r.bad)
+      row->job.order_id = n;
+    break;
+  case R_JOBIDS:
+    n = get_int(&r);
+    if (!r.bad)
+      stored_jobids = n;
+    break;
+  case R_ENV: {
+    uint64_t hash = get_i64(&r);
+    char *env = get_string(&r);
+    if (!r.bad && env != NULL)
+      put_env(hash, env);
+    break;
+  }
+  case R_REMOVE_ENV: {
+    uint64_t hash = get_i64(&r);
+    if (!r.bad)
+      drop_env(hash);
+    break;
+  }
+  }
+}
+
+/* Replay the records of a file. Returns the size of its valid part;
+ * *first_generation is the generation it starts with, 0 if none. */
+static long replay_file(const char *path, int apply_all,
+                        unsigned int expected_generation,
+                        unsigned int *first_generation) {
+  struct stat st;
+  char *data;
+  long pos = 0;
+  int fd;
+
+  *first_generation = 0;
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  data = (char *)malloc(st.st_size);
+  if (data == NULL)
+    error("Cannot allocate %li bytes to read %s", (long)st.st_size, path);
+  if (read(fd, data, st.st_size) != st.st_size) {
+    warning("Cannot read %s", path);
+    free(data);
+    close(fd);
+    return 0;
+  }
+  close(fd);
+
+  while (st.st_size - pos >= RECORD_HEADER) {
+    uint32_t size, crc;
+    int32_t type;
+
+    memcpy(&size, data + pos, 4);
+    memcpy(&crc, data + pos + 4, 4);
+    if (size < 4 || size > st.st_size - pos - RECORD_HEADER ||
+        record_crc(data + pos + RECORD_HEADER, size) != crc)
+      break;
+    if (pos == 0) {
+      /* The generation comes first, or the file is not ours */
+      memcpy(&type, data + RECORD_HEADER, 4);
+      if (type != R_GENERATION || size < 8)
+        break;
+      memcpy(first_generation, data + RECORD_HEADER + 4, 4);
+      if (!apply_all && *first_generation != expected_generation)
+        break;
+    }
+    apply_record(data + pos + RECORD_HEADER, size);
+    pos += RECORD_HEADER + size;
+  }
+  free(data);
+  return pos;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t res = write(fd, data, len);
+    if (res == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += res;
+    len -= res;
+  }
+  return 0;
+}
+
+static void put_generation(struct Buffer *b) {
+  size_t start = begin_record(b, R_GENERATION);
+  put_int(b, generation);
+  end_record(b, start);
+}
+
+/* Start the journal again, empty, after the snapshot of this generation */
+static int restart_journal() {
+  struct Buffer b = {0};
+  int rc;
+
+  put_generation(&b);
+  rc = ftruncate(journal_fd, 0) == -1 ||
+       write_all(journal_fd, b.data, b.len) == -1 ||
+       fdatasync(journal_fd) == -1;
+  journal_size = b.len;
+  free(b.data);
+  if (rc)
+    fprintf(stderr, "[journal] Cannot restart %s: %s\n", journal_path,
+            strerror(errno));
+  return rc ? -1 : 0;
+}
+
+/* Write all the rows as the snapshot of a new generation, and empty the
+ * journal */
+static int compact() {
+  struct Buffer b = {0};
+  char *tmp_path = path_with(".snapshot.tmp");
+  size_t start;
+  int fd, t, i, rc;
+
+  generation++;
+  put_generation(&b);
+  start = begin_record(&b, R_JOBIDS);
+  put_int(&b, stored_jobids);
+  end_record(&b, start);
+  for (t = 0; t < 2; ++t)
+    for (i = 0; i < rows[t].size; ++i) {
+      struct Job *p;
+      for (p = rows[t].buckets[i]; p != NULL; p = p->id_next) {
+        start = begin_record(&b, R_INSERT);
+        put_int(&b, t);
+        put_row_values(&b, (struct JobRow *)p);
+        end_record(&b, start);
+      }
+    }
+  /* Only the environments of some row, whatever was not removed */
+  for (t = 0; t < 2; ++t)
+    for (i = 0; i < rows[t].size; ++i) {
+      struct Job *p;
+      for (p = rows[t].buckets[i]; p != NULL; p = p->id_next) {
+        struct EnvRecord *e = *find_env(((struct JobRow *)p)->env_hash);
+        if (e != NULL)
+          e->used = 1;
+      }
+    }
+  for (i = 0; i < ENV_BUCKETS; ++i) {
+    struct EnvRecord *e;
+    for (e = envs[i]; e != NULL; e = e->next) {
+      if (e->used) {
+        start = begin_record(&b, R_ENV);
+        put_i64(&b, e->hash);
+        put_string(&b, e->env);
+        end_record(&b, start);
+      }
+      e->used = 0;
+    }
+  }
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  rc = fd == -1 || write_all(fd, b.data, b.len) == -1 || fdatasync(fd) == -1;
+  if (fd != -1)
+    close(fd);
+  if (!rc)
+    rc = rename(tmp_path, snapshot_path) == -1;
+  if (rc) {
+    fprintf(stderr, "[journal] Cannot write the snapshot %s: %s\n",
+            snapshot_path, strerror(errno));
+    unlink(tmp_path);
+    generation--;
+  } else {
+    snapshot_size = b.len;
+    rc = restart_journal();
+  }
+  free(tmp_path);
+  free(b.data);
+  return rc ? -1 : 0;
+}
+
+static int journal_open(int sync_full) {
+  unsigned int snapshot_generation, journal_generation;
+  long valid;
+
+  journal_path = path_with(".journal");
+  snapshot_path = path_with(".snapshot");
+
+  snapshot_size = replay_file(snapshot_path, 1, 0, &snapshot_generation);
+  generation = snapshot_generation;
+  /* A journal of an older generation is already in the snapshot */
+  valid = replay_file(journal_path, 0, snapshot_generation,
+                      &journal_generation);
+  generation = snapshot_generation;
+
+  journal_fd =
+      open(journal_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (journal_fd == -1) {
+    printf("Can't open the journal %s: %s\n", journal_path, strerror(errno));
+    return -1;
+  }
+  if (valid == 0)
+    return restart_journal();
+  /* Drop a torn record at the end */
+  if (ftruncate(journal_fd, valid) == -1)
+    warning("Cannot truncate the journal %s", journal_path);
+  journal_size = valid;
+  return 0;
+}
+
+static int journal_close() {
+  int rc = 0;
+
+  if (journal_fd == -1)
+    return 0;
+  /* Once per stop, the rows are written out again, so the next start
+   * reads only the snapshot instead of replaying the journal */
+  if (journal_size > RECORD_HEADER + 8)
+    rc = compact();
+  close(journal_fd);
+  journal_fd = -1;
+  free_rows();
+  free(pending.data);
+  memset(&pending, 0, sizeof(pending));
+  free(journal_path);
+  free(snapshot_path);
+  journal_path = snapshot_path = NULL;
+  return rc;
+}
+
+static int journal_get_jobids() { return stored_jobids; }
+
+static int by_order_id(const void *a, const void *b) {
+  int x = (*(struct Job *const *)a)->order_id;
+  int y = (*(struct Job *const *)b)->order_id;
+
+  return x < y ? -1 : x > y;
+}
+
+static int journal_read_all(int table, void (*add)(struct Job *job)) {
+  struct Job **sorted;
+  int n = 0, i;
+
+  if (rows[table].count == 0)
+    return 0;
+  sorted = (struct Job **)malloc(rows[table].count * sizeof(struct Job *));
+  if (sorted == NULL)
+    error("Cannot allocate the %i rows of the journal", rows[table].count);
+  for (i = 0; i < rows[table].size; ++i) {
+    struct Job *p;
+    for (p = rows[table].buckets[i]; p != NULL; p = p->id_next)
+      sorted[n++] = p;
+  }
+  qsort(sorted, n, sizeof(struct Job *), by_order_id);
+  for (i = 0; i < n; ++i)
+    add(job_from_row((struct JobRow *)sorted[i]));
+  free(sorted);
+  return n;
+}
+
+static void journal_order_range(int *min, int *max) {
+  int t, i;
+
+  *min = *max = 0;
+  for (t = 0; t < 2; ++t)
+    for (i = 0; i < rows[t].size; ++i) {
+      struct Job *p;
+      for (p = rows[t].buckets[i]; p != NULL; p = p->id_next) {
+        if (p->order_id < *min)
+          *min = p->order_id;
+        if (p->order_id > *max)
+          *max = p->order_id;
+      }
+    }
+}
+
+static int journal_begin() { return 0; }
+
+/* Apply the records of the transaction to the rows */
+static void apply_pending() {
+  size_t pos = 0;
+
+  while (pos < pending.len) {
+    uint32_t size;
+
+    memcpy(&size, pending.data + pos, 4);
+    apply_record(pending.data + pos + RECORD_HEADER, size);
+    pos += RECORD_HEADER + size;
+  }
+}
+
+/* The records reach the rows only once they are on disk. If the write
+ * fails, the transaction is lost: its part already written is cut off,
+ * so the transactions after it do not follow a torn record. */
+static int journal_commit() {
+  if (pending.len > 0) {
+    if (write_all(journal_fd, pending.data, pending.len) == -1 ||
+        fdatasync(journal_fd) == -1) {
+      fprintf(stderr, "[journal] Cannot write %s: %s\n", journal_path,
+              strerror(errno));
+      if (ftruncate(journal_fd, journal_size) == -1)
+        fprintf(stderr, "[journal] Cannot truncate %s: %s\n", journal_path,
+                strerror(errno));
+      pending.len = 0;
+      return -1;
+    }
+    journal_size += pending.len;
+    apply_pending();
+    pending.len = 0;
+  }
+  if (journal_size > JOURNAL_MIN_COMPACT && journal_size > snapshot_size)
+    return compact();
+  return 0;
+}
+
+/* Queue the record started at start for the commit */
+static int add_record(size_t start) {
+  end_record(&pending, start);
+  return 0;
+}
+
+/* A row inserted again replaces the one there: with no constraint to
+ * check, the journal needs no 'replace' */
+static int journal_insert(const struct JobRow *row, int table, int replace) {
+  size_t start = begin_record(&pending, R_INSERT);
+
+  put_int(&pending, table);
+  put_row_values(&pending, row);
+  return add_record(start);
+}
+
+/* A job queued in the same transaction is not in the rows yet: it goes
+ * whole, as started */
+static int journal_start(const struct JobRow *row) {
+  const struct Job *job = &row->job;
+  size_t start;
+
+  if (find_row(JOBS_TABLE, job->jobid) == NULL)
+    return journal_insert(row, JOBS_TABLE, 1);
+  start = begin_record(&pending, R_START);
+  put_int(&pending, job->jobid);
+  put_int(&pending, job->state);
+  put_int(&pending, job->pid);
+  put_i64(&pending, job->info.start_time.tv_sec);
+  put_i64(&pending, job->info.start_time.tv_usec);
+  put_string(&pending, job->output_filename);
+  return add_record(start);
+}
+
+static int journal_finish(const struct JobRow *row) {
+  size_t start = begin_record(&pending, R_FINISH);
+
+  put_row_values(&pending, row);
+  return add_record(start);
+}
+
+static int journal_remove(const int *jobids, int n, int table) {
+  size_t start = begin_record(&pending, R_DELETE);
+  int i;
+
+  put_int(&pending, table);
+  put_int(&pending, n);
+  for (i = 0; i < n; ++i)
+    put_int(&pending, jobids[i]);
+  return add_record(start);
+}
+
+/* The rows live in memory until the snapshot, so the journal keeps no
+ * history: the rows leaving the finished list are dropped */
+static int journal_retire(const int *jobids, int n) {
+  return journal_remove(jobids, n, FINISHED_TABLE);
+}
+
+static int put_update(enum RecordType type, int jobid, int value) {
+  size_t start = begin_record(&pending, type);
+
+  put_int(&pending, jobid);
+  put_int(&pending, value);
+  return add_record(start);
+}
+
+static int journal_set_state(int jobid, int state) {
+  return put_update(R_STATE, jobid, state);
+}
+
+static int journal_set_order(int jobid, int order_id) {
+  return put_update(R_ORDER, jobid, order_id);
+}
+
+static int journal_set_jobids(int value) {
+  size_t start = begin_record(&pending, R_JOBIDS);
+
+  put_int(&pending, value);
+  return add_record(start);
+}
+
+static int journal_insert_env(uint64_t hash, const char *env) {
+  size_t start = begin_record(&pending, R_ENV);
+
+  put_i64(&pending, hash);
+  put_string(&pending, env);
+  return add_record(start);
+}
+
+static int journal_remove_env(uint64_t hash) {
+  size_t start = begin_record(&pending, R_REMOVE_ENV);
+
+  put_i64(&pending, hash);
+  return add_record(start);
+}
+
+static char *journal_read_env(uint64_t hash) {
+  struct EnvRecord *e = *find_env(hash);
+
+  return e == NULL ? NULL : strdup(e->env);
+}
+
+const struct StoreBackend journal_store = {
+    .name = "journal",
+    .open = journal_open,
+    .close = journal_close,
+    .get_jobids = journal_get_jobids,
+    .read_all = journal_read_all,
+    .order_range = journal_order_range,
+    .begin = journal_begin,
+    .commit = journal_commit,
+    .insert = journal_insert,
+    .start = journal_start,
+    .finish = journal_finish,
+    .remove = journal_remove,
+    .retire = journal_retire,
+    .set_state = journal_set_state,
+    .set_order = journal_set_order,
+    .set_jobids = journal_set_jobids,
+    .insert_env = journal_insert_env,
+    .remove_env = journal_remove_env,
+    .read_env = journal_read_env,
+};
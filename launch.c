@@ -0,0 +1,236 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2009  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#define _GNU_SOURCE /* execvpe */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/* With TS_SPAWN=1 at its start the server runs the detached jobs
+ * itself, instead of forking a runner client that runs them (see
+ * s_spawn_runner). The job is cloned with a pidfd, watched in the server
+ * loop, and the server stops ignoring SIGCHLD, so the job is left for it
+ * to reap, with its status and times, at the end of the round. The other
+ * children of the server, as the runners, are reaped there too.
+ * The server only knows some of the options of a job, the ones it was
+ * sent; a job queued with any other, as -z or -O, still gets a runner,
+ * and so does every job while TS_ONFINISH is set, as the runner calls
+ * it. */
+
+static int spawn;
+
+/* Whether the server reaps its children (see server_main) */
+int launch_start() {
+  const char *env = getenv("TS_SPAWN");
+
+  spawn = env != NULL && strcmp(env, "1") == 0;
+  return spawn;
+}
+
+int launch_enabled() { return spawn && getenv("TS_ONFINISH") == NULL; }
+
+void launch_reap() {
+  struct rusage ru;
+  int status;
+  int pid;
+
+  if (!spawn)
+    return;
+  while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+    s_launched_exit(pid, status, &ru);
+}
+
+/* Unquote the word at s, as charArray_string() quoted it, into out.
+ * Returns where it ends, or NULL if it is not quoted so: the line of a
+ * --batch is shell syntax, and is left to a runner. */
+static const char *unquote_word(const char *s, char *out) {
+  while (*s != '\0' && *s != ' ') {
+    if (*s == '\'') {
+      for (++s; *s != '\''; ++s) {
+        if (*s == '\0')
+          return NULL;
+        *out++ = *s;
+      }
+      ++s;
+    } else if (s[0] == '\\' && s[1] == '\'') {
+      *out++ = '\'';
+      s += 2;
+    } else if (isalnum((unsigned char)*s) || strchr("@%+=:,./_-", *s) != NULL) {
+      *out++ = *s++;
+    } else
+      return NULL;
+  }
+  *out = '\0';
+  return s;
+}
+
+/* Whether the server knows what the option word means for the job: it
+ * was sent to it, or it changes nothing in how the job runs. *arg tells
+ * that the next word is its argument. */
+static int known_option(const char *word, int *arg) {
+  *arg = 0;
+  if (word[0] != '-' || word[1] == '\0')
+    return 0;
+  if (word[1] == '-') {
+    if (strcmp(word, "--") == 0 || strcmp(word, "--detach") == 0 ||
+        strcmp(word, "--no-bind") == 0 ||
+        strncmp(word, "--label=", 8) == 0 || strncmp(word, "--jobid=", 8) == 0)
+      return 1;
+    if (strcmp(word, "--label") == 0 || strcmp(word, "--jobid") == 0) {
+      *arg = 1;
+      return 1;
+    }
+    return 0;
+  }
+  /* Short options may come together, as -nf, or -Lname */
+  for (++word; *word != '\0'; ++word) {
+    if (strchr("nfB", *word) != NULL)
+      continue;
+    if (strchr("LNJDm", *word) == NULL)
+      return 0;
+    *arg = word[1] == '\0';
+    return 1;
+  }
+  return 1;
+}
+
+/* The argv of the detached job p, if the server can run it itself, in
+ * one block to free(). NULL if it needs a runner. */
+char **launch_argv(const struct Job *p) {
+  const char *s = p->command;
+  const char *command;
+  char **argv;
+  char *out;
+  int words = 2;
+  int argc = 0;
+  int arg = 0;
+  size_t len;
+
+  len = strlen(s);
+  if (p->command_strip <= 0 || (size_t)p->command_strip > len)
+    return NULL;
+  command = s + p->command_strip;
+  for (; *s != '\0'; ++s)
+    if (*s == ' ')
+      ++words;
+
+  /* The unquoted words are never longer than the quoted ones */
+  argv = (char **)malloc(words * sizeof(char *) + len + 1);
+  if (argv == NULL)
+    return NULL;
+  out = (char *)(argv + words);
+
+  /* The options of ts, after its argv[0] */
+  s = unquote_word(p->command, out);
+  while (s != NULL && s < command) {
+    if (*s == ' ') {
+      ++s;
+      continue;
+    }
+    s = unquote_word(s, out);
+    if (s == NULL || s > command)
+      goto runner;
+    if (arg)
+      arg = 0;
+    else if (!known_option(out, &arg))
+      goto runner;
+  }
+  if (s == NULL || arg)
+    goto runner;
+
+  /* The command, with nothing left to the shell */
+  s = command;
+  while (*s != '\0') {
+    if (*s == ' ') {
+      ++s;
+      continue;
+    }
+    argv[argc] = out;
+    s = unquote_word(s, out);
+    if (s == NULL)
+      goto runner;
+    out += strlen(out) + 1;
+    ++argc;
+  }
+  if (argc == 0)
+    goto runner;
+  argv[argc] = NULL;
+  return argv;
+
+runner:
+  free(argv);
+  return NULL;
+}
+
+/* Run argv as r, in dir, with its output in output (or none), and no
+ * descriptor of the server, like the child of a runner would. Returns
+ * its pid, with its pidfd, or -1 if there is no clone3(). */
+int launch_clone(const struct RunAs *r, char **argv, const char *dir,
+                 const char *output, int *pidfd) {
+#if defined(SYS_clone3) && defined(CLONE_PIDFD)
+  static const char failed[] = "ts could not run the command\n";
+  struct clone_args args;
+  int pid;
+  int fd;
+
+  memset(&args, 0, sizeof(args));
+  args.flags = CLONE_PIDFD;
+  args.pidfd = (uint64_t)(uintptr_t)pidfd;
+  args.exit_signal = SIGCHLD;
+  pid = syscall(SYS_clone3, &args, sizeof(args));
+  if (pid != 0)
+    return pid;
+
+  /* A copy of the threaded server, with no fork() of the libc: only
+   * system calls from here. The uid is changed by them directly, as the
+   * libc would ask the threads of the server to change it too. */
+  signal(SIGCHLD, SIG_DFL);
+  restore_sigmask();
+  if (r->change && (syscall(SYS_setgroups, r->ngroups, r->groups) == -1 ||
+                    syscall(SYS_setgid, r->gid) == -1 ||
+                    syscall(SYS_setuid, r->uid) == -1))
+    _exit(255);
+  if (dir != NULL && chdir(dir) == -1)
+    _exit(255);
+
+  fd = open("/dev/null", O_RDWR);
+  dup2(fd, 0);
+  dup2(fd, 1);
+  dup2(fd, 2);
+  if (output != NULL) {
+    fd = open(output, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd != -1) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+  }
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, 3, ~0U, 0) == -1)
+#endif
+    for (fd = 3; fd < r->max_fd; ++fd)
+      close(fd);
+
+  /* Its own session, so kill -- -`ts -p` kills its process group */
+  setsid();
+  execvpe(argv[0], argv, r->envp);
+  write(2, failed, sizeof(failed) - 1);
+  _exit(255);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
@@ -5,6 +5,8 @@
     Please find the license in the provided COPYING file.
 */
 
+#include <float.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,34 +21,6 @@ extern int busy_slots;
 extern int max_slots;
 extern int core_usage;
 
-/* return 0 for running and 1 for sleep and -1 for error */
-int is_sleep(int pid) {
-  if (pid == 0) return -1;
-  char filename[256];
-  char name[256];
-  char status = '\0';
-  FILE *fp = NULL;
-  snprintf(filename, 256, "/proc/%d/stat", pid);
-
-  fp = fopen(filename, "r");
-  if (fp == NULL) {
-    fprintf(stderr, "[is_sleep] Error: Couldn't open [%s]\n", filename);
-    return -1;
-  }
-  int token = fscanf(fp, "%d %s %c", &pid, name, &status);
-  if (token < 3) {
-    fprintf(stderr, "[is_sleep] Error: not enough (3) tokens\n");
-    return -1;
-  }
-  fclose(fp);
-
-  if (status == 'T') {
-    return 1;
-  } else {
-    return 0;
-  }
-}
-
 static char *shorten(char *line, int len) {
   char *newline = (char *)malloc((len + 1) * sizeof(char));
   if (strlen(line) <= len)
@@ -93,6 +67,58 @@ char *joblist_headers() {
 
 static int max(int a, int b) { return a > b ? a : b; }
 
+/* A listing is rendered into one buffer, and sent to the client in chunks of
+ * LIST_CHUNK bytes instead of one message per line. With s == -1 the whole
+ * text stays in the buffer. */
+enum { LIST_CHUNK = 64 * 1024 };
+
+struct ListOut {
+  int s;
+  char *buf;
+  int len;
+  int size;
+};
+
+static void out_flush(struct ListOut *o) {
+  if (o->s == -1 || o->len == 0)
+    return;
+  send_list_line(o->s, o->buf);
+  o->len = 0;
+}
+
+/* Room for n chars and the '\0' at the end of the buffer */
+static char *out_reserve(struct ListOut *o, int n) {
+  if (o->len + n + 1 > o->size)
+    out_flush(o);
+  if (o->len + n + 1 > o->size) {
+    int size = o->len + n + 1;
+
+    if (o->s != -1 && size < LIST_CHUNK)
+      size = LIST_CHUNK;
+    o->buf = (char *)realloc(o->buf, size);
+    if (o->buf == NULL)
+      error("Malloc for %i failed.\n", size);
+    o->size = size;
+  }
+  o->buf[o->len] = '\0';
+  return o->buf + o->len;
+}
+
+/* After a snprintf of res chars into the maxlen reserved */
+static void out_advance(struct ListOut *o, int res, int maxlen) {
+  if (res < 0)
+    res = 0;
+  o->len += res < maxlen ? res : maxlen - 1;
+  o->buf[o->len] = '\0';
+}
+
+static void out_text(struct ListOut *o, const char *str) {
+  int len = strlen(str);
+
+  memcpy(out_reserve(o, len), str, len);
+  out_advance(o, len, len + 1);
+}
+
 static const char* jstate2string_result(const struct Job* p) {
   if (p->result.errorlevel != 0 || p->result.signal != 0 || p->result.died_by_signal != 0) {
     return "failed";
@@ -124,10 +150,11 @@ static const char *ofilename_shown(const struct Job *p) {
   return output_filename;
 }
 
-static char *print_noresult(const struct Job *p) {
+static void print_noresult(struct ListOut *o, const struct Job *p) {
   const char *jobstate;
   const char *output_filename;
   int maxlen;
+  int res;
   char *line;
   /* 20 chars should suffice for a string like "[int,int,..]&& " */
   char dependstr[1024] = "[]";
@@ -189,33 +216,22 @@ static char *print_noresult(const struct Job *p) {
     unit = time_rep(&real_ms);
   }
 
-  line = (char *)malloc(maxlen);
-  if (line == NULL)
-    error("Malloc for %i failed.\n", maxlen);
-
+  line = out_reserve(o, maxlen);
   cmd_len = max((strlen(p->command) + (term_width - maxlen)), 20);
   char *cmd = shorten(p->command + p->command_strip, cmd_len);
-  if (p->label) {
-    char *label = shorten(p->label, 10);
-    snprintf(line, maxlen, "%-4i %-9s %-6i %-7s %-10s %6.2f%s  %-21s | %s\n",
-             p->jobid, jobstate, p->num_slots, uname, label, real_ms, unit, cmd,
-             output_filename);
-    free(label);
-    free(cmd);
-  } else {
-    char *cmd = shorten(p->command + p->command_strip, cmd_len);
-    char *label = "(..)";
-    snprintf(line, maxlen, "%-4i %-9s %-6i %-7s %-10s %6.2f%s  %-21s | %s\n",
-             p->jobid, jobstate, p->num_slots, uname, label, real_ms, unit, cmd,
-             output_filename);
-    free(cmd);
-  }
-  return line;
+  char *label = shorten(p->label ? p->label : "(..)", 10);
+  res = snprintf(line, maxlen, "%-4i %-9s %-6i %-7s %-10s %6.2f%s  %-21s | %s\n",
+                 p->jobid, jobstate, p->num_slots, uname, label, real_ms, unit,
+                 cmd, output_filename);
+  out_advance(o, res, maxlen);
+  free(label);
+  free(cmd);
 }
 
-static char *print_result(const struct Job *p) {
+static void print_result(struct ListOut *o, const struct Job *p) {
   const char *jobstate;
   int maxlen;
+  int res;
   char *line;
   const char *output_filename;
   /* 20 chars should suffice for a string like "[int,int,..]&& " */
@@ -257,171 +273,355 @@ static char *print_result(const struct Job *p) {
     pos += snprintf(&dependstr[pos], sizeof(dependstr), "]&& ");
   }
 
-  line = (char *)malloc(maxlen);
-  if (line == NULL)
-    error("Malloc for %i failed.\n", maxlen);
-
+  line = out_reserve(o, maxlen);
   cmd_len = max((strlen(p->command) + (term_width - maxlen)), 20);
   char *cmd = shorten(p->command + p->command_strip, cmd_len);
-  if (p->label) {
-    char *label = shorten(p->label, 10);
-    snprintf(line, maxlen, "%-4i %-9s %-6i %-7s %-10s %6.2f%s  %-21s | %s\n",
-             p->jobid, jobstate, p->num_slots, uname, label, real_ms, unit, cmd,
-             output_filename);
-    free(label);
-    free(cmd);
-  } else {
-    char *cmd = shorten(p->command + p->command_strip, cmd_len);
-    char *label = "(..)";
-    snprintf(line, maxlen, "%-4i %-9s %-6i %-7s %-10s %6.2f%s  %-21s | %s\n",
-             p->jobid, jobstate, p->num_slots, uname, label, real_ms, unit, cmd,
-             output_filename);
-    free(cmd);
-  }
-
-  return line;
+  char *label = shorten(p->label ? p->label : "(..)", 10);
+  res = snprintf(line, maxlen, "%-4i %-9s %-6i %-7s %-10s %6.2f%s  %-21s | %s\n",
+                 p->jobid, jobstate, p->num_slots, uname, label, real_ms, unit,
+                 cmd, output_filename);
+  out_advance(o, res, maxlen);
+  free(label);
+  free(cmd);
 }
 
-static char *plainprint_noresult(const struct Job *p) {
+/* A line of the TAB listing, with the columns in fields */
+static void plainprint(struct ListOut *o, const struct Job *p, int fields) {
   const char *jobstate;
   const char *output_filename;
+  const char *label = p->label != NULL ? p->label : "(..)";
+  const char *sep = "";
   int maxlen;
+  int n = 0;
   char *line;
   /* 20 chars should suffice for a string like "[int,int,..]&& " */
-  char dependstr[256] = "[]&&";
-
-  jobstate = jstate2string(p->state);
-  output_filename = ofilename_shown(p);
-  char *uname = user_name[p->ts_UID];
-  maxlen = 4 + 1 + 10 + 1 + 20 + 1 + 8 + 1 + 25 + 1 + strlen(p->command) + 20 +
-           strlen(uname) + 2; /* 20 is the margin for errors */
-
-  char* label = "(..)";
-  if (p->label) {
-    label = p->label;
+  char dependstr[256];
+  float real_ms = 0;
+  const char *unit = "sx";
+
+  if (p->state == FINISHED) {
+    jobstate = jstate2string_result(p);
+    real_ms = p->result.real_ms;
+    if (real_ms == 0.0) {
+      real_ms = p->info.end_time.tv_sec - p->info.start_time.tv_sec;
+      real_ms += 1e-6 * (p->info.end_time.tv_usec - p->info.start_time.tv_usec);
+    }
+    unit = time_rep(&real_ms);
+    strcpy(dependstr, "[]");
+  } else {
+    jobstate = jstate2string(p->state);
+    if (p->state == RUNNING) {
+      struct timeval starttv = p->info.start_time;
+      struct timeval endtv;
+      gettimeofday(&endtv, NULL);
+      real_ms = endtv.tv_sec - starttv.tv_sec +
+                  ((float)(endtv.tv_usec - starttv.tv_usec) / 1000000.);
+      unit = time_rep(&real_ms);
+    }
+    strcpy(dependstr, "[]&&");
   }
-  maxlen += 3 + strlen(label);
+  output_filename = ofilename_shown(p);
 
   if (p->depend_on_size) {
-    maxlen += sizeof(dependstr);
     int pos = 0;
     if (p->depend_on[0] == -1)
-      pos += snprintf(&dependstr[pos], sizeof(dependstr), "[ ");
+      pos += snprintf(&dependstr[pos], sizeof(dependstr) - pos, "[ ");
     else
-      pos +=
-          snprintf(&dependstr[pos], sizeof(dependstr), "[%i", p->depend_on[0]);
+      pos += snprintf(&dependstr[pos], sizeof(dependstr) - pos, "[%i",
+                      p->depend_on[0]);
 
-    for (int i = 1; i < p->depend_on_size; i++) {
+    for (int i = 1; i < p->depend_on_size && pos < sizeof(dependstr); i++) {
       if (p->depend_on[i] == -1)
-        pos += snprintf(&dependstr[pos], sizeof(dependstr), ", ");
+        pos += snprintf(&dependstr[pos], sizeof(dependstr) - pos, ", ");
       else
-        pos += snprintf(&dependstr[pos], sizeof(dependstr), ",%i",
+        pos += snprintf(&dependstr[pos], sizeof(dependstr) - pos, ",%i",
                         p->depend_on[i]);
     }
-    pos += snprintf(&dependstr[pos], sizeof(dependstr), "]&& ");
+    if (pos < sizeof(dependstr))
+      snprintf(&dependstr[pos], sizeof(dependstr) - pos,
+               p->state == FINISHED ? "]" : "]&& ");
   }
 
-  line = (char *)malloc(maxlen);
-  if (line == NULL)
-    error("Malloc for %i failed.\n", maxlen);
-  
-  float real_ms = 0;
-  const char* unit = "sx";
-  if (p->state == RUNNING) {
-    struct timeval starttv = p->info.start_time;
-    struct timeval endtv;
-    gettimeofday(&endtv, NULL);
-    real_ms = endtv.tv_sec - starttv.tv_sec +
-                ((float)(endtv.tv_usec - starttv.tv_usec) / 1000000.);
-    unit = time_rep(&real_ms);
+  maxlen = 4 + 1 + 10 + 1 + 20 + 1 + 8 + 1 + 25 + 1 + strlen(p->command) +
+           30 + strlen(user_name[p->ts_UID]) + 3 + strlen(label) +
+           sizeof(dependstr) + strlen(output_filename); /* 30 is the margin */
+  line = out_reserve(o, maxlen);
+
+#define COLUMN(field, ...)                                                     \
+  if (fields & (field)) {                                                      \
+    n += snprintf(line + n, maxlen - n, "%s", sep);                            \
+    n += snprintf(line + n, maxlen - n, __VA_ARGS__);                          \
+    sep = "\t";                                                                \
   }
-  snprintf(line, maxlen, "%i\t%s\t%d\t%s\t%s\t%i\t%.2f%s\t%s\t%s\t%s\n", 
-    p->jobid, jobstate, p->num_slots, user_name[p->ts_UID], label,
-    p->result.errorlevel, real_ms, unit, p->command + p->command_strip,
-    dependstr, output_filename);
+  COLUMN(FIELD_ID, "%i", p->jobid);
+  COLUMN(FIELD_STATE, "%s", jobstate);
+  COLUMN(FIELD_PROC, "%d", p->num_slots);
+  COLUMN(FIELD_USER, "%s", user_name[p->ts_UID]);
+  COLUMN(FIELD_LABEL, "%s", label);
+  COLUMN(FIELD_ELEVEL, "%i", p->result.errorlevel);
+  COLUMN(FIELD_TIME, "%.2f%s", real_ms, unit);
+  COLUMN(FIELD_COMMAND, "%s", p->command + p->command_strip);
+  COLUMN(FIELD_DEPEND, "%s", dependstr);
+  COLUMN(FIELD_OUTPUT, "%s", output_filename);
+#undef COLUMN
+  n += snprintf(line + n, maxlen - n, "\n");
+  out_advance(o, n, maxlen);
+}
 
-  return line;
+char *joblist_line(const struct Job *p) {
+  struct ListOut o = {-1, NULL, 0, 0};
+
+  if (p->state == FINISHED)
+    print_result(&o, p);
+  else
+    print_noresult(&o, p);
+
+  return o.buf;
 }
 
+char *joblist_line_plain(const struct Job *p) {
+  struct ListOut o = {-1, NULL, 0, 0};
 
-static char *plainprint_result(const struct Job *p) {
-  const char *jobstate;
-  int maxlen;
-  char *line;
-  const char *output_filename;
-  /* 20 chars should suffice for a string like "[int,int,..]&& " */
-  char dependstr[256] = "[]";
-  float real_ms = p->result.real_ms;
-  if (real_ms == 0.0) {
-    real_ms = p->info.end_time.tv_sec - p->info.start_time.tv_sec;
-    real_ms += 1e-6 * (p->info.end_time.tv_usec - p->info.start_time.tv_usec);
+  plainprint(&o, p, FIELDS_TAB);
+  return o.buf;
+}
+
+/* JSON, as cJSON would print it */
+static void json_string(struct ListOut *o, const char *str) {
+  const unsigned char *c;
+  char *out;
+  int n = 0;
+
+  if (str == NULL)
+    str = "";
+  out = out_reserve(o, 2 + 6 * strlen(str));
+  out[n++] = '"';
+  for (c = (const unsigned char *)str; *c != '\0'; c++) {
+    switch (*c) {
+    case '"':
+    case '\\':
+      out[n++] = '\\';
+      out[n++] = *c;
+      break;
+    case '\b':
+      out[n++] = '\\';
+      out[n++] = 'b';
+      break;
+    case '\f':
+      out[n++] = '\\';
+      out[n++] = 'f';
+      break;
+    case '\n':
+      out[n++] = '\\';
+      out[n++] = 'n';
+      break;
+    case '\r':
+      out[n++] = '\\';
+      out[n++] = 'r';
+      break;
+    case '\t':
+      out[n++] = '\\';
+      out[n++] = 't';
+      break;
+    default:
+      if (*c < 32)
+        n += sprintf(out + n, "\\u%04x", *c);
+      else
+        out[n++] = *c;
+    }
   }
+  out[n++] = '"';
+  out_advance(o, n, n + 1);
+}
 
-  const char *unit = time_rep(&real_ms);
+static int same_double(double a, double b) {
+  double maxval = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
 
-  jobstate = jstate2string_result(p);
-  output_filename = ofilename_shown(p);
+  return fabs(a - b) <= maxval * DBL_EPSILON;
+}
 
-  maxlen = 4 + 1 + 10 + 1 + 20 + 1 + 8 + 1 + 25 + 1 + strlen(p->command) +
-           30 + strlen(user_name[p->ts_UID]); /* 30 is the margin for errors */
+static void json_number(struct ListOut *o, double d) {
+  char *out = out_reserve(o, 32);
+  double test;
+  int res;
 
-  
-  char* label = "(..)";
-  if (p->label) {
-    label = p->label;
+  if (isnan(d) || isinf(d))
+    res = snprintf(out, 32, "null");
+  else if (d == (int)d)
+    res = snprintf(out, 32, "%d", (int)d);
+  else {
+    res = snprintf(out, 32, "%1.15g", d);
+    if (sscanf(out, "%lg", &test) != 1 || !same_double(test, d))
+      res = snprintf(out, 32, "%1.17g", d);
   }
-  maxlen += 3 + strlen(label);
+  out_advance(o, res, 32);
+}
 
-  if (p->depend_on_size) {
-    maxlen += sizeof(dependstr);
-    int pos = 0;
-    if (p->depend_on[0] == -1)
-      pos += snprintf(&dependstr[pos], sizeof(dependstr), "[ ");
-    else
-      pos +=
-          snprintf(&dependstr[pos], sizeof(dependstr), "[%i", p->depend_on[0]);
+/* The separator before the first key is the '{' of the object */
+static void json_key(struct ListOut *o, int *keys, const char *name) {
+  out_text(o, *keys > 0 ? ",\"" : "{\"");
+  out_text(o, name);
+  out_text(o, "\":");
+  (*keys)++;
+}
 
-    for (int i = 1; i < p->depend_on_size; i++) {
-      if (p->depend_on[i] == -1)
-        pos += snprintf(&dependstr[pos], sizeof(dependstr), ", ");
-      else
-        pos += snprintf(&dependstr[pos], sizeof(dependstr), ",%i",
-                        p->depend_on[i]);
+static void json_job(struct ListOut *o, const struct Job *p, int fields) {
+  int keys = 0;
+
+  if (fields & FIELD_ID) {
+    json_key(o, &keys, "ID");
+    json_number(o, p->jobid);
+  }
+  if (fields & FIELD_STATE) {
+    json_key(o, &keys, "State");
+    json_string(o, jstate2string(p->state));
+  }
+  if (fields & FIELD_PROC) {
+    json_key(o, &keys, "Proc.");
+    json_number(o, p->num_slots);
+  }
+  if (fields & FIELD_USER) {
+    json_key(o, &keys, "User");
+    json_string(o, user_name[p->ts_UID]);
+  }
+  if (fields & FIELD_LABEL) {
+    json_key(o, &keys, "Label");
+    if (p->label != NULL)
+      json_string(o, p->label);
+    else
+      out_text(o, "null");
+  }
+  if (fields & FIELD_OUTPUT) {
+    json_key(o, &keys, "Output");
+    json_string(o, p->output_filename);
+  }
+  if (fields & FIELD_ELEVEL) {
+    json_key(o, &keys, "E-Level");
+    if (p->state == FINISHED)
+      json_number(o, p->result.errorlevel);
+    else
+      out_text(o, "null");
+  }
+  if (fields & FIELD_TIME) {
+    json_key(o, &keys, "Time_ms");
+    if (p->state == FINISHED)
+      json_number(o, p->result.real_ms);
+    else
+      out_text(o, "null");
+  }
+  if (fields & FIELD_COMMAND) {
+    json_key(o, &keys, "Command");
+    json_string(o, p->command + p->command_strip);
+  }
+  if (fields & FIELD_DEPEND) {
+    int i;
+
+    json_key(o, &keys, "Depend");
+    out_text(o, "[");
+    for (i = 0; i < p->depend_on_size; i++) {
+      if (i > 0)
+        out_text(o, ",");
+      json_number(o, p->depend_on[i]);
     }
-    pos += snprintf(&dependstr[pos], sizeof(dependstr), "]");
+    out_text(o, "]");
   }
+  out_text(o, keys > 0 ? "}" : "{}");
+}
 
-  line = (char *)malloc(maxlen);
-  if (line == NULL)
-    error("Malloc for %i failed.\n", maxlen);
+/* The listing going to a client. Its buffer is kept for the next one. */
+static struct ListOut list_out = {-1, NULL, 0, 0};
+static enum ListFormat list_format;
+static int list_fields;
+static int list_jobs;
+
+/* fields are the columns of TAB and JSON, 0 for all of the format */
+void list_begin(int s, enum ListFormat format, int fields) {
+  list_out.s = s;
+  list_out.len = 0;
+  list_format = format;
+  list_fields = fields;
+  if (fields == 0)
+    list_fields = format == JSON ? FIELDS_JSON : FIELDS_TAB;
+  list_jobs = 0;
+  if (format == JSON)
+    out_text(&list_out, "[");
+}
 
+void list_text(const char *str) { out_text(&list_out, str); }
+
+void list_job(const struct Job *p) {
+  switch (list_format) {
+  case JSON:
+    if (list_jobs > 0)
+      out_text(&list_out, ",");
+    json_job(&list_out, p, list_fields);
+    break;
+  case TAB:
+    plainprint(&list_out, p, list_fields);
+    break;
+  default:
+    if (p->state == FINISHED)
+      print_result(&list_out, p);
+    else
+      print_noresult(&list_out, p);
+  }
+  list_jobs++;
+}
 
-  snprintf(line, maxlen, "%i\t%s\t%d\t%s\t%s\t%i\t%.2f%s\t%s\t%s\t%s\n", 
-    p->jobid, jobstate, p->num_slots, user_name[p->ts_UID], label,
-    p->result.errorlevel, real_ms, unit, p->command + p->command_strip,
-    dependstr, output_filename);
-  return line;
+/* Sends what is left. The listing may go on with send_list_line(). */
+void list_end() {
+  if (list_format == JSON)
+    out_text(&list_out, "]\n");
+  out_flush(&list_out);
+  list_out.s = -1;
 }
 
-char *joblist_line(const struct Job *p) {
+char *history_headers() {
   char *line;
 
-  if (p->state == FINISHED)
-    line = print_result(p);
-  else
-    line = print_noresult(p);
-
+  line = malloc(256);
+  snprintf(line, 256, "%-6s %-7s %-10s %-19s  %-7s %7s  %s\n", "ID", "User",
+           "Label", "Ended", "Exit", "Time", "Command");
   return line;
 }
 
-char *joblist_line_plain(const struct Job *p) {
+/* A finished job of ts --history, which may be out of the finished list */
+char *history_line(const struct Job *p) {
+  int maxlen;
   char *line;
+  char ended[32];
+  char exit_status[16];
+  time_t end_time = p->info.end_time.tv_sec;
+  float real_ms = p->result.real_ms;
+  const char *unit;
+  const char *uname = "(gone)";
+  char *label = shorten(p->label != NULL ? p->label : "(..)", 10);
 
-  if (p->state == FINISHED)
-    line = plainprint_result(p);
+  if (real_ms == 0.0) {
+    real_ms = p->info.end_time.tv_sec - p->info.start_time.tv_sec;
+    real_ms += 1e-6 * (p->info.end_time.tv_usec - p->info.start_time.tv_usec);
+  }
+  unit = time_rep(&real_ms);
+  /* The users may have changed since */
+  if (p->ts_UID >= 0 && p->ts_UID < user_number)
+    uname = user_name[p->ts_UID];
+  strftime(ended, sizeof(ended), "%Y-%m-%d %H:%M:%S", localtime(&end_time));
+  if (p->result.skipped)
+    snprintf(exit_status, sizeof(exit_status), "skipped");
+  else if (p->result.died_by_signal)
+    snprintf(exit_status, sizeof(exit_status), "sig %i", p->result.signal);
   else
-    line = plainprint_noresult(p);
+    snprintf(exit_status, sizeof(exit_status), "%i", p->result.errorlevel);
 
+  maxlen = 6 + 1 + strlen(uname) + 1 + 10 + 1 + sizeof(ended) + 2 +
+           sizeof(exit_status) + 1 + 20 + 2 + strlen(p->command) + 20;
+  line = (char *)malloc(maxlen);
+  if (line == NULL)
+    error("Malloc for %i failed.\n", maxlen);
+  snprintf(line, maxlen, "%-6i %-7s %-10s %-19s  %-7s %6.2f%s  %s\n",
+           p->jobid, uname, label, ended, exit_status, real_ms, unit,
+           p->command + p->command_strip);
+  free(label);
   return line;
 }
 
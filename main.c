@@ -4,6 +4,7 @@
 
     Please find the license in the provided COPYING file.
 */
+#define _GNU_SOURCE /* strptime */
 #include <getopt.h>
 #include <pwd.h>
 #include <signal.h>
@@ -67,7 +68,18 @@ static void default_command_line() {
   command_line.taskpid = 0;
   command_line.start_time = 0;
   command_line.jobid = 0;
+  command_line.detach = 0;
+  command_line.batch_file = NULL;
   command_line.list_format = DEFAULT;
+  command_line.user = NULL;
+  command_line.list.states = 0;
+  command_line.list.jobid_from = 0;
+  command_line.list.jobid_to = 0;
+  command_line.list.offset = 0;
+  command_line.list.limit = 0;
+  command_line.list.fields = 0;
+  command_line.history.since = 0;
+  command_line.history.failed = 0;
 #ifdef TASKSET
   command_line.taskset_flag = 1;
 #else
@@ -150,16 +162,42 @@ static int get_two_jobs(const char *str, int *j1, int *j2) {
   return 1;
 }
 
+/* str is not changed, as it is also part of the job command line */
 int strtok_int(char *str, char *delim, int *ids) {
   int count = 0;
-  char *ptr = strtok(str, delim);
+  char *copy = strdup(str);
+  char *ptr = strtok(copy, delim);
   while (ptr != NULL) {
     ids[count++] = atoi(ptr);
     ptr = strtok(NULL, delim);
   }
+  free(copy);
   return count;
 }
 
+/* The command line without the --batch option */
+static char *batch_cmd(int argc, char **argv) {
+  char **args;
+  char *cmd;
+  int i, num = 0;
+
+  args = (char **)malloc(argc * sizeof(char *));
+  if (args == NULL)
+    error("Cannot allocate the batch arguments");
+  for (i = 0; i < argc; ++i) {
+    if (i > 0 && strncmp(argv[i], "--batch=", 8) == 0)
+      continue;
+    if (i > 0 && strcmp(argv[i], "--batch") == 0) {
+      ++i; /* and its argument */
+      continue;
+    }
+    args[num++] = argv[i];
+  }
+  cmd = charArray_string(num, args);
+  free(args);
+  return cmd;
+}
+
 static struct option longOptions[] = {
     {"get_label", required_argument, NULL, 'a'},
     {"count_running", no_argument, NULL, 'R'},
@@ -185,8 +223,133 @@ static struct option longOptions[] = {
     {"stime", required_argument, NULL, 0},
     {"check_daemon", no_argument, NULL, 0},
     {"no-bind", no_argument, NULL, 0},
+    {"detach", no_argument, NULL, 0},
+    {"batch", required_argument, NULL, 0},
+    {"stats", no_argument, NULL, 0},
+    {"history", no_argument, NULL, 0},
+    {"user", required_argument, NULL, 0},
+    {"since", required_argument, NULL, 0},
+    {"label", required_argument, NULL, 'L'},
+    {"failed", no_argument, NULL, 0},
+    {"state", required_argument, NULL, 0},
+    {"jobs", required_argument, NULL, 0},
+    {"fields", required_argument, NULL, 0},
+    {"offset", required_argument, NULL, 0},
+    {"limit", required_argument, NULL, 0},
+    {"watch", no_argument, NULL, 0},
     {NULL, 0, NULL, 0}};
 
+struct Name {
+  const char *name;
+  int bits;
+};
+
+/* The states of --state, as the list shows them */
+static const struct Name state_names[] = {
+    {"queued", 1 << QUEUED},     {"running", 1 << RUNNING},
+    {"holdon", 1 << PAUSE},      {"finished", 1 << FINISHED},
+    {"skipped", 1 << SKIPPED},   {"relink", 1 << RELINK},
+    {"wait", 1 << WAIT},         {"delink", 1 << DELINK},
+    {"locked", 1 << LOCKED},     {NULL, 0}};
+
+/* The columns of --fields, in the order of the TAB listing */
+static const struct Name field_names[] = {
+    {"id", FIELD_ID},         {"state", FIELD_STATE},
+    {"proc", FIELD_PROC},     {"user", FIELD_USER},
+    {"label", FIELD_LABEL},   {"elevel", FIELD_ELEVEL},
+    {"time", FIELD_TIME},     {"command", FIELD_COMMAND},
+    {"depend", FIELD_DEPEND}, {"output", FIELD_OUTPUT},
+    {NULL, 0}};
+
+/* The bits of a list of names separated by commas, as "running,queued" */
+static int parse_names(const char *option, const struct Name *names,
+                       const char *str) {
+  int bits = 0;
+
+  while (*str != '\0') {
+    int len = strcspn(str, ",");
+    int i;
+
+    for (i = 0; names[i].name != NULL; ++i)
+      if (strlen(names[i].name) == len && strncmp(names[i].name, str, len) == 0)
+        break;
+    if (names[i].name == NULL) {
+      fprintf(stderr, "Wrong value for --%s: %.*s\n", option, len, str);
+      exit(-1);
+    }
+    bits |= names[i].bits;
+    str += len;
+    if (*str == ',')
+      str++;
+  }
+  return bits;
+}
+
+/* The jobids of --jobs: "A-B", "A-", "-B" or "A" */
+static void parse_jobid_range(const char *str) {
+  const char *dash = strchr(str, '-');
+
+  if (dash == NULL) {
+    command_line.list.jobid_from = str2int(str);
+    command_line.list.jobid_to = command_line.list.jobid_from;
+    return;
+  }
+  if (dash != str)
+    command_line.list.jobid_from = str2int(str);
+  if (dash[1] != '\0')
+    command_line.list.jobid_to = str2int(dash + 1);
+}
+
+/* The time of --since: a date "YYYY-MM-DD[ HH:MM[:SS]]" in the local
+ * time, seconds since the epoch, or a time ago in s, m, h or d, as 2h */
+static long parse_since(const char *str) {
+  static const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M",
+                                  "%Y-%m-%d"};
+  struct tm tm;
+  char *end;
+  long n;
+  long unit;
+  int i;
+
+  for (i = 0; i < 3; ++i) {
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(str, formats[i], &tm);
+    if (end != NULL && *end == '\0') {
+      tm.tm_isdst = -1;
+      return mktime(&tm);
+    }
+  }
+
+  n = strtol(str, &end, 10);
+  if (end == str || n < 0) {
+    fprintf(stderr, "Wrong time for --since: %s\n", str);
+    exit(-1);
+  }
+  switch (*end) {
+  case '\0':
+    return n;
+  case 's':
+    unit = 1;
+    break;
+  case 'm':
+    unit = 60;
+    break;
+  case 'h':
+    unit = 60 * 60;
+    break;
+  case 'd':
+    unit = 24 * 60 * 60;
+    break;
+  default:
+    unit = 0;
+  }
+  if (unit == 0 || end[1] != '\0') {
+    fprintf(stderr, "Wrong time for --since: %s\n", str);
+    exit(-1);
+  }
+  return time(NULL) - n * unit;
+}
+
 void parse_opts(int argc, char **argv) {
   int c;
   int res;
@@ -264,6 +427,33 @@ void parse_opts(int argc, char **argv) {
         command_line.start_time = str2int(optarg);
       } else if (strcmp(longOptions[optionIdx].name, "no-bind") == 0) {
         command_line.taskset_flag = 0;
+      } else if (strcmp(longOptions[optionIdx].name, "detach") == 0) {
+        command_line.detach = 1;
+      } else if (strcmp(longOptions[optionIdx].name, "batch") == 0) {
+        command_line.request = c_BATCH;
+        command_line.batch_file = optarg;
+      } else if (strcmp(longOptions[optionIdx].name, "stats") == 0) {
+        command_line.request = c_STATS;
+      } else if (strcmp(longOptions[optionIdx].name, "history") == 0) {
+        command_line.request = c_HISTORY;
+      } else if (strcmp(longOptions[optionIdx].name, "user") == 0) {
+        command_line.user = optarg;
+      } else if (strcmp(longOptions[optionIdx].name, "since") == 0) {
+        command_line.history.since = parse_since(optarg);
+      } else if (strcmp(longOptions[optionIdx].name, "failed") == 0) {
+        command_line.history.failed = 1;
+      } else if (strcmp(longOptions[optionIdx].name, "state") == 0) {
+        command_line.list.states = parse_names("state", state_names, optarg);
+      } else if (strcmp(longOptions[optionIdx].name, "jobs") == 0) {
+        parse_jobid_range(optarg);
+      } else if (strcmp(longOptions[optionIdx].name, "fields") == 0) {
+        command_line.list.fields = parse_names("fields", field_names, optarg);
+      } else if (strcmp(longOptions[optionIdx].name, "offset") == 0) {
+        command_line.list.offset = str2int(optarg);
+      } else if (strcmp(longOptions[optionIdx].name, "limit") == 0) {
+        command_line.list.limit = str2int(optarg);
+      } else if (strcmp(longOptions[optionIdx].name, "watch") == 0) {
+        command_line.request = c_WATCH;
       } else
         error("Wrong option %s.", longOptions[optionIdx].name);
       break;
@@ -547,7 +737,16 @@ void parse_opts(int argc, char **argv) {
     
   }
 
-  command_line.linux_cmd = charArray_string(argc, argv);
+  if (command_line.request == c_BATCH) {
+    if (optind < argc)
+      error("--batch takes the commands from %s, not from the arguments",
+            command_line.batch_file);
+    if (command_line.depend_on_size != 0)
+      error("--batch does not take -d, -D or -W");
+    /* The jobs are queued with the same options, but --batch */
+    command_line.linux_cmd = batch_cmd(argc, argv);
+  } else
+    command_line.linux_cmd = charArray_string(argc, argv);
 
   if (command_line.request != c_SHOW_HELP &&
       command_line.request != c_SHOW_VERSION)
@@ -619,7 +818,7 @@ static void print_help(const char *cmd) {
   printf("  TS_MAXFINISHED   : Specifies the maximum number of finished jobs "
          "in the queue (default: %d).\n", DEFAULT_MAXFINISHED);
   printf("  TS_MAXCONN       : Sets the maximum number of 'ts' connections "
-         "allowed at once, must less than %d (default: %d).\n", MAXCONN, MAXCONN);
+         "allowed at once (default: the open files limit).\n");
   printf("  TS_ONFINISH      : Path to a binary called when a job finishes "
          "(receives job ID, error status, output file, and command).\n");
   printf("  TS_ENV           : Command executed on job enqueue to determine "
@@ -638,6 +837,10 @@ static void print_help(const char *cmd) {
          "server start).\n");
   printf("  TS_SORTJOBS      : Control the job sequence sorting (read on "
          "server start).\n");
+  printf("  TS_SNAPSHOT      : 0 to answer -l, -A and -s from the server "
+         "instead of its snapshot, <socket>.state.\n");
+  printf("  TS_SPAWN         : 1 to have the server run the detached jobs "
+         "itself, with no runner client (read on server start).\n");
   printf("  TMPDIR           : Directory where output files and the default "
          "socket are placed.\n");
 
@@ -685,6 +888,26 @@ static void print_help(const char *cmd) {
   printf("  --relink [PID]                  Relink running tasks using their "
          "[PID] in case of an unexpected failure.\n");
   printf("  --no-taskset                    turn off taskset\n");
+  printf("  --stats                         show the memory used by the jobs "
+         "in the server.\n");
+  printf("  -l [--state S,..] [--user U] [--label GLOB] [--jobs FROM-TO]\n"
+         "     [--offset N] [--limit N] [--fields F,..]\n"
+         "                                  list only the jobs that match; "
+         "a negative offset counts from the end.\n"
+         "                                  S: queued, running, holdon, "
+         "finished, skipped, relink, wait, delink, locked.\n"
+         "                                  F: id, state, proc, user, label, "
+         "elevel, time, command, depend, output (tab or json).\n");
+  printf("  --history [--user U] [--since T] [--label L] [--failed]\n"
+         "                                  show the finished jobs stored, "
+         "also out of the list, newest first.\n"
+         "                                  T is a date, 'YYYY-MM-DD[ "
+         "HH:MM[:SS]]', or a time ago as 2h.\n");
+  printf("  --watch [--user U] [--label GLOB] [--jobs FROM-TO]\n"
+         "                                  print a line per job submitted, "
+         "started, paused, resumed,\n"
+         "                                  finished or removed, as it "
+         "happens: id, event, uid, errorlevel.\n");
   printf("  --job [joibid] || -J [joibid]   set the jobid of the new or relink "
          "job\n");
   // printf("  --stime [start_time]            Set the relinked task by starting
@@ -742,6 +965,10 @@ static void print_help(const char *cmd) {
   printf("  -L [label]   name this task with a label, to be distinguished on "
          "listing.\n");
   printf("  -N [num]     number of slots required by the job (1 default).\n");
+  printf("  --detach     leave the job queued in the server and quit; a runner "
+         "is started when it is dispatched.\n");
+  printf("  --batch <file|->  queue each line of the file as a detached "
+         "'sh -c' job, in one request.\n");
 }
 
 static void print_version() { puts(version); }
@@ -789,6 +1016,12 @@ int main(int argc, char **argv) {
     c_check_daemon();
   }
 
+  /* Without asking the server, if it published a current snapshot */
+  if (command_line.need_server && c_query_snapshot() == 0) {
+    free(command_line.depend_on);
+    return errorlevel;
+  }
+
   if (command_line.need_server) {
     if (command_line.request == c_DAEMON) {
       ensure_server_up(1);
@@ -890,6 +1123,9 @@ int main(int argc, char **argv) {
       printf("New JobID: %i\n", command_line.jobid);
       fflush(stdout);
     }
+    /* The server keeps the job; a runner will be forked to run it */
+    if (command_line.detach)
+      break;
     if (command_line.should_go_background) {
       go_background();
       c_wait_server_commands();
@@ -1035,6 +1271,27 @@ int main(int argc, char **argv) {
       error("The command %i needs the server", command_line.request);
     c_unset_env();
     break;
+  case c_BATCH:
+    if (!command_line.need_server)
+      error("The command %i needs the server", command_line.request);
+    c_new_batch();
+    break;
+  case c_STATS:
+    if (!command_line.need_server)
+      error("The command %i needs the server", command_line.request);
+    c_show_stats();
+    c_wait_server_lines();
+    break;
+  case c_HISTORY:
+    if (!command_line.need_server)
+      error("The command %i needs the server", command_line.request);
+    c_history();
+    break;
+  case c_WATCH:
+    if (!command_line.need_server)
+      error("The command %i needs the server", command_line.request);
+    c_watch();
+    break;
   }
 
   if (command_line.need_server) {
@@ -4,12 +4,14 @@
 
     Please find the license in the provided COPYING file.
 */
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <sys/types.h>
 
 enum { 
   CMD_LEN = 500, 
-  PROTOCOL_VERSION = 730 
+  PROTOCOL_VERSION = 734 
 };
 
 enum MsgTypes {
@@ -61,7 +63,14 @@ enum MsgTypes {
   SET_LOGDIR,
   GET_ENV,
   SET_ENV,
-  UNSET_ENV
+  UNSET_ENV,
+  NEWJOB_BATCH,
+  STATS,
+  NEWJOB_ENV,
+  HISTORY,
+  HISTORY_NEXT,
+  WATCH,
+  EVENT
 };
 
 enum ListFormat {
@@ -70,6 +79,32 @@ enum ListFormat {
     TAB
 };
 
+/* The columns of the TAB and JSON listings, for --fields */
+enum ListField {
+  FIELD_ID = 1 << 0,
+  FIELD_STATE = 1 << 1,
+  FIELD_PROC = 1 << 2,
+  FIELD_USER = 1 << 3,
+  FIELD_LABEL = 1 << 4,
+  FIELD_ELEVEL = 1 << 5,
+  FIELD_TIME = 1 << 6,
+  FIELD_COMMAND = 1 << 7,
+  FIELD_DEPEND = 1 << 8,
+  FIELD_OUTPUT = 1 << 9,
+  FIELDS_TAB = (1 << 10) - 1,
+  FIELDS_JSON = FIELDS_TAB & ~FIELD_DEPEND
+};
+
+/* What happened to a job, in the EVENT messages of ts --watch */
+enum JobEvent {
+  EVENT_SUBMITTED,
+  EVENT_STARTED,
+  EVENT_PAUSED,
+  EVENT_RESUMED,
+  EVENT_FINISHED,
+  EVENT_REMOVED
+};
+
 enum Request {
   c_QUEUE,
   c_TAIL,
@@ -109,7 +144,11 @@ enum Request {
   c_SET_LOGDIR,
   c_GET_ENV,
   c_SET_ENV,
-  c_UNSET_ENV
+  c_UNSET_ENV,
+  c_BATCH,
+  c_STATS,
+  c_HISTORY,
+  c_WATCH
 };
 
 struct CommandLine {
@@ -141,8 +180,23 @@ struct CommandLine {
   int num_slots;      /* Slots for the job to use. Default 1 */
   int taskpid;       /* to restore task by pid */
   int require_elevel; /* whether requires error level of dependencies or not */
+  int detach;         /* leave the job queued in the server, with no client */
+  char *batch_file;   /* command lines to queue with --batch, "-" for stdin */
   long start_time;
   enum ListFormat list_format;
+  char *user; /* --user, name or uid, NULL for all the users */
+  struct {
+    int states;     /* bits (1 << state), 0 for all */
+    int jobid_from; /* 0 for no bound */
+    int jobid_to;
+    int offset;     /* negative, from the end */
+    int limit;      /* 0 for no limit */
+    int fields;     /* enum ListField bits, 0 for all */
+  } list;       /* the filter of the listing, with the label glob in label */
+  struct {
+    long since; /* end time, 0 for all */
+    int failed;
+  } history;    /* --history, with the label in label */
 };
 
 enum ProcessType { CLIENT, SERVER };
@@ -154,6 +208,7 @@ extern char *logdir;
 extern int term_width;
 
 struct Msg;
+struct rusage;
 
 enum Jobstate { 
   QUEUED, 
@@ -181,12 +236,15 @@ struct Msg {
       int label_size;
       int email_size;
       int env_size;
+      uint64_t env_hash; /* the body is only sent on NEWJOB_ENV */
       int depend_on_size;
       int wait_enqueuing;
       int num_slots;
       int taskpid;
       long start_time;
       int taskset_flag;
+      int detach;
+      int batch_size; /* command lines in a NEWJOB_BATCH */
     } newjob;
     struct {
       int ofilename_size;
@@ -216,7 +274,29 @@ struct Msg {
     struct {
       int term_width;
       enum ListFormat list_format;
+      int uid;        /* -1 for all the users */
+      int states;     /* bits (1 << state), 0 for all */
+      int jobid_from; /* 0 for no bound */
+      int jobid_to;
+      int offset;     /* negative, from the end */
+      int limit;      /* 0 for no limit */
+      int fields;
+      int label_size; /* the label glob follows, 0 for any */
     } list;
+    struct {
+      enum JobEvent kind;
+      int uid;        /* the owner of the job */
+      int errorlevel; /* of EVENT_FINISHED */
+      int signal;     /* of EVENT_FINISHED, 0 if it did not die by one */
+    } event;
+    struct {
+      int uid;          /* -1 for all the users */
+      int failed;
+      int label_size;   /* the label follows, 0 for any */
+      int before_jobid; /* the page goes on after this job, 0 first */
+      long before_time; /* its end time */
+      long since;
+    } history;
   } u;
 };
 
@@ -231,6 +311,7 @@ struct Procinfo {
 
 struct Job {
   struct Job *next;
+  struct Job *prev; /* in the queue and the finished list */
   int jobid;
   char *command;
   char *work_dir;
@@ -244,20 +325,85 @@ struct Job {
   int should_keep_finished;
   int *depend_on;
   int depend_on_size;
-  int *notify_errorlevel_to;
+  int *notify_errorlevel_to;  /* the jobs depending on this one */
   int notify_errorlevel_to_size;
+  int notify_errorlevel_to_allocated;
+  int pending_deps; /* jobs in depend_on still in the queue */
   int dependency_errorlevel;
   int taskset_flag;
   char *label;
   char *email;
   struct Procinfo info;
+  struct Env *env; /* its TS_ENV output, shared (envstore.c) */
   int num_slots;
   int num_allocated;
+  int detached; /* Queued with no client; a runner is forked to run it */
+  /* Found running at the start, and watched by the server loop through
+   * pidfd, of the job or of its old client (see adopt_job). If not
+   * adopted, pidfd is of the runner until it connects, or -1. */
+  int adopted;
+  int pidfd;
+  /* Run by the server itself, with no runner (launch.c): pidfd is of the
+   * job, and the server reaps it */
+  int launched;
+  /* Links in the ready queue of its owner while QUEUED with no pending
+   * dependencies, or in the relink queue while RELINK (see set_job_state) */
+  struct Job *ready_prev;
+  struct Job *ready_next;
+  int in_user_queue; /* counted in user_queue[ts_UID] */
+  /* Chains in the hash indexes by jobid and by pid (jobindex.c) */
+  struct Job *id_next;
+  struct Job *pid_next;
+  /* command, work_dir, label and email live in this block (jobpool.c) */
+  char *strings;
+  int strings_size;
+  struct JobSlab *slab;
+  int order_id; /* of its row in the database, 0 if not stored yet */
 #ifdef TASKSET
   char* cores;
 #endif
 };
 
+struct Env {
+  struct Env *next; /* in its bucket */
+  uint64_t key;     /* it is stored under, see envstore.c */
+  uint64_t hash;    /* of the body */
+  int ts_UID;       /* who uploaded it */
+  int refs;         /* the jobs using it */
+  char *body;
+};
+
+/* Who a forked command runs as. It is looked up before the fork, as the
+ * child of the threaded server may only make async-signal-safe calls. */
+struct RunAs {
+  int change; /* not the user of the server */
+  uid_t uid;
+  gid_t gid;
+  gid_t *groups;
+  int ngroups;
+  char **envp;
+  long max_fd;
+};
+
+struct ProcStat {
+  struct ProcStat *next; /* in its bucket */
+  int pid;
+  unsigned long tick; /* of the server loop, when it was read */
+  char state;         /* as in /proc/PID/stat: 'R', 'S', 'T'... */
+  int threads;
+  long rss_kb;
+  float cpu; /* % of a cpu between the last two reads, -1 before */
+  unsigned long long cpu_ticks;
+  struct timeval read_time;
+};
+
+struct JobIndex {
+  struct Job **buckets;
+  int size; /* a power of two */
+  int count;
+  int by_pid; /* keyed by pid, otherwise by jobid */
+};
+
 enum ExitCodes {
   EXITCODE_OK = 0,
   EXITCODE_UNKNOWN_ERROR = -1,
@@ -344,14 +490,29 @@ void c_set_env();
 
 void c_unset_env();
 
+void c_new_batch();
+void c_show_stats();
+void c_history();
+
+void c_watch();
+
+int c_query_snapshot();
+
 /* jobs.c */
-void s_list(int s, int ts_UID, enum ListFormat listFormat);
-void s_list_all(int s, enum ListFormat listFormat);
+void s_list(int s, int ts_UID, const struct Msg *m);
+void s_list_filtered(int s, int ts_UID, const struct Msg *m,
+                     const char *label);
+void s_list_all(int s, const struct Msg *m);
 
 void s_list_plain(int s);
+/* A listing printed by the client itself, from the snapshot */
+enum { LIST_STDOUT = -2 };
+void send_list_line(int s, const char *str);
 
 int s_newjob(int s, struct Msg *m, int ts_UID);
 
+void s_newjob_batch(int s, struct Msg *m, int ts_UID);
+
 void s_delete_job(int jobid);
 
 void job_finished(const struct Result *result, int jobid);
@@ -362,6 +523,8 @@ void s_mark_job_running(int jobid);
 
 void s_clear_finished(int ts_UID);
 
+int s_history(int s, int ts_UID, struct Msg *m);
+
 void s_process_runjob_ok(int jobid, char *oname, int pid);
 
 void s_send_output(int socket, int jobid);
@@ -370,6 +533,10 @@ int s_remove_job(int s, int *jobid, int client_uid);
 
 void s_remove_notification(int s);
 
+int s_watch(int s, int ts_UID, const struct Msg *m);
+
+void s_remove_watcher(int s);
+
 void check_notify_list(int jobid);
 
 void s_wait_job(int s, int jobid);
@@ -378,6 +545,8 @@ void s_wait_running_job(int s, int jobid);
 
 void s_move_urgent(int s, int jobid);
 
+const struct Job *job_of_state(int jobid);
+
 void s_send_state(int s, int jobid);
 
 void s_swap_jobs(int s, int jobid1, int jobid2);
@@ -408,6 +577,12 @@ int job_is_holding_client(int jobid);
 
 int wake_hold_client();
 
+int job_is_detached(int jobid);
+
+int job_awaits_runner(int jobid);
+
+void s_spawn_runner(int jobid);
+
 void s_get_label(int s, int jobid);
 
 void s_kill_all_jobs(int s, int ts_UID);
@@ -429,6 +604,9 @@ void dump_conns_struct(FILE *out);
 
 void s_send_cmd(int s, int jobid);
 
+void watch_pid(int pidfd, int pid);
+void watch_runner(int pidfd, int jobid);
+
 /* server_start.c */
 int try_connect(int s);
 
@@ -440,6 +618,8 @@ void notify_parent(int fd);
 
 void create_socket_path(char **path);
 
+char *create_status_path(int jobid);
+
 /* execute.c */
 int run_job(int jobid, struct Result *res);
 
@@ -503,6 +683,18 @@ char *joblistdump_torun(const struct Job *p);
 
 char *joblistdump_headers();
 
+char *history_headers();
+
+char *history_line(const struct Job *p);
+
+void list_begin(int s, enum ListFormat format, int fields);
+
+void list_text(const char *str);
+
+void list_job(const struct Job *p);
+
+void list_end();
+
 const char *time_rep(float *t);
 
 /* print.c */
@@ -533,6 +725,7 @@ void pinfo_init(struct Procinfo *p);
 
 /* env.c */
 char *get_environment();
+uint64_t env_hash(const char *env);
 
 /* tail.c */
 int tail_file(const char *fname, int last_lines);
@@ -562,7 +755,6 @@ char *charArray_string(int num, char** array);
 int user_locker;
 time_t locker_time;
 int jobsort_flag;
-int is_sleep(int pid);
 // int check_running_dead(int jobid);
 
 /* jobs.c */
@@ -582,7 +774,13 @@ int s_check_locker(int uid);
 void s_set_jobids(int i);
 void s_sort_jobs();
 int s_check_relink(int s, int pid, int ts_UID);
+void s_adopted_exit(int pid);
+void s_runner_exit(int jobid);
+void s_launched_exit(int pid, int status, const struct rusage *ru);
 void s_read_sqlite();
+void flush_evicted_jobs();
+void publish_snapshot();
+void add_snapshot_job(struct Job *p, int finished);
 int s_check_running_pid(int pid);
 void init_pause();
 void s_check_holdon();
@@ -600,20 +798,101 @@ int c_lock_server();
 int c_unlock_server();
 void c_check_daemon();
 
-/* sqlite.c */
-const char *get_sqlite_path();
-int open_sqlite();
-int close_sqlite();
+/* store.c */
+enum { JOBS_TABLE, FINISHED_TABLE };
+
+/* The stored values of a job, copied into one block. The strings of job
+ * point into text, and its other pointers are not used. */
+struct JobRow {
+  struct Job job;
+  uint64_t env_hash; /* 0 if none */
+  char *depend_on; /* as text, "1,2,3" */
+  char *notify_errorlevel_to;
+  char text[];
+};
+
+/* A page of ts --history, the newest jobs first */
+struct HistoryQuery {
+  int ts_UID;        /* -1 for all the users */
+  long since;        /* the end time from, 0 for all */
+  const char *label; /* NULL for any */
+  int failed;
+  long before_time;  /* the page starts after the end time and jobid */
+  int before_jobid;  /* 0 for the first page */
+  int limit;
+};
+
+/* A storage backend. The writes are run by the persistence thread, in
+ * transactions between begin() and commit(); the reads only happen before
+ * it starts, for the restore. The tables are JOBS_TABLE or FINISHED_TABLE.
+ * The environments are kept apart from the rows, once each, by the key
+ * the rows refer to. */
+struct StoreBackend {
+  const char *name; /* for TS_STORE */
+  int (*open)(int sync_full);
+  int (*close)();
+  int (*get_jobids)();
+  /* Every row of the table in one pass, in their order */
+  int (*read_all)(int table, void (*add)(struct Job *job));
+  void (*order_range)(int *min, int *max);
+  int (*begin)();
+  int (*commit)();
+  int (*insert)(const struct JobRow *row, int table, int replace);
+  int (*start)(const struct JobRow *row);  /* state, pid, start, output */
+  int (*finish)(const struct JobRow *row); /* from Jobs to Finished */
+  int (*remove)(const int *jobids, int n, int table);
+  /* The finished jobs leave the finished list; the rows may stay */
+  int (*retire)(const int *jobids, int n);
+  int (*set_state)(int jobid, int state);
+  int (*set_order)(int jobid, int order_id);
+  int (*set_jobids)(int value);
+  int (*insert_env)(uint64_t hash, const char *env);
+  int (*remove_env)(uint64_t hash);
+  char *(*read_env)(uint64_t hash); /* malloc()ed, NULL if none */
+  /* The finished rows kept, retired or not, for add() one by one. Run by
+   * the server loop on a connection of its own; NULL if the rows are not
+   * kept. Returns the number of rows, or -1. */
+  int (*history)(const struct HistoryQuery *q,
+                 void (*add)(const struct Job *job, void *arg), void *arg);
+};
+
+int open_store();
+int close_store();
 int insert_DB(struct Job* job, const char* table);
 int insert_or_replace_DB(struct Job* job, const char* table);
-struct Job* read_DB(int jobid, const char* table);
-int read_jobid_DB(int** jobids, const char* table);
+int read_all_DB(const char *table, void (*add)(struct Job *job));
 int delete_DB(int jobid, const char* table);
-int movetop_DB(int jobid);
-int swap_DB(int, int);
+int delete_jobs_DB(const int *jobids, int n, const char *table);
+int retire_jobs_DB(const int *jobids, int n);
+int history_DB(const struct HistoryQuery *q,
+               void (*add)(const struct Job *job, void *arg), void *arg);
+int movetop_DB(struct Job *job);
+int swap_DB(struct Job *job0, struct Job *job1);
 int set_jobids_DB(int value);
 int get_jobids_DB();
 int set_state_DB(int jobid, int state);
+int start_DB(struct Job *job);
+int finish_DB(struct Job *job);
+int insert_env_DB(uint64_t hash, const char *env);
+int remove_env_DB(uint64_t hash);
+char *read_env_DB(uint64_t hash);
+int begin_transaction_DB();
+int commit_transaction_DB();
+void flush_DB(int wait);
+void durable_DB();
+int persist_backlog_DB();
+void start_persist_DB();
+void s_send_persist_stats(int s);
+struct JobRow *new_job_row(const struct Job *job, const char *depend_on,
+                           const char *notify_errorlevel_to);
+struct Job *job_from_row(const struct JobRow *row);
+
+/* sqlite.c */
+extern const struct StoreBackend sqlite_store;
+const char *get_sqlite_path();
+
+/* journal.c */
+extern const struct StoreBackend journal_store;
 // int jobDB_num, jobDB_wait_num;
 // struct Job** jobDB_Jobs;
 
@@ -622,6 +901,55 @@ char* ints_to_chars(int n, int *array, const char *delim);
 int*  chars_to_ints(int *size, char* str, const char* delim);
 char* insert_chars_check(int pos, const char* input, const char* c);
 
+/* jobpool.c */
+struct Job *job_alloc();
+void job_free(struct Job *p);
+char *job_strings_alloc(struct Job *p, int size);
+void job_count_strings(struct Job *p);
+void job_set_strings(struct Job *p, const char *command, const char *work_dir,
+                     const char *label, const char *email);
+void s_send_pool_stats(int s);
+
+/* envstore.c */
+struct Env *env_find(int ts_UID, uint64_t hash);
+struct Env *env_hold(struct Env *e);
+struct Env *env_add(int ts_UID, char *body);
+struct Env *env_restore(int ts_UID, uint64_t key);
+void env_release(struct Env *env);
+void s_send_env_stats(int s);
+
+/* snapshot.c */
+void snapshot_start();
+void snapshot_stop();
+void snapshot_changed();
+int snapshot_timeout();
+int snapshot_due();
+void snapshot_begin();
+void snapshot_job(const struct Job *p, int finished);
+void snapshot_end();
+int snapshot_load();
+
+/* procstat.c */
+void procstat_tick();
+const struct ProcStat *procstat_get(int pid);
+void procstat_forget(int pid);
+int is_sleep(int pid);
+int open_pidfd(int pid);
+int proc_ended(int dir_fd, int *status);
+
+/* launch.c */
+int launch_start();
+int launch_enabled();
+void launch_reap();
+char **launch_argv(const struct Job *p);
+int launch_clone(const struct RunAs *r, char **argv, const char *dir,
+                 const char *output, int *pidfd);
+
+/* jobindex.c */
+void jobindex_insert(struct JobIndex *ix, struct Job *p);
+void jobindex_remove(struct JobIndex *ix, struct Job *p);
+struct Job *jobindex_find(const struct JobIndex *ix, int key);
+
 /* taskset.c */
 void init_taskset();
 int set_task_cores(struct Job* p);
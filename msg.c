@@ -40,6 +40,12 @@ int recv_bytes(const int fd, char *data, int bytes) {
             warning("Receiving %i bytes from %i.", bytes, fd);
             break;
         }
+        /* The peer went away in the middle of the data */
+        if (res == 0 && bytes > 0) {
+            warning("Receiving %i bytes from %i: end of file.", bytes, fd);
+            res = -1;
+            break;
+        }
         if (res == bytes)
             break;
         offset += res;
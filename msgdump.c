@@ -19,6 +19,32 @@ void msgdump(FILE *f, const struct Msg *m) {
     fprintf(f, " NEWJOB\n");
     fprintf(f, " Commandsize: %i\n", m->u.newjob.command_size);
     break;
+  case STATS:
+    fprintf(f, " STATS\n");
+    break;
+  case HISTORY:
+    fprintf(f, " HISTORY\n");
+    fprintf(f, " After: %li %i\n", m->u.history.before_time,
+            m->u.history.before_jobid);
+    break;
+  case HISTORY_NEXT:
+    fprintf(f, " HISTORY_NEXT\n");
+    break;
+  case WATCH:
+    fprintf(f, " WATCH\n");
+    break;
+  case EVENT:
+    fprintf(f, " EVENT\n");
+    fprintf(f, " JobID: '%i' Kind: %i\n", m->jobid, m->u.event.kind);
+    break;
+  case NEWJOB_BATCH:
+    fprintf(f, " NEWJOB_BATCH\n");
+    fprintf(f, " Commands: %i\n", m->u.newjob.batch_size);
+    fprintf(f, " Commandsize: %i\n", m->u.newjob.command_size);
+    break;
+  case NEWJOB_ENV:
+    fprintf(f, " NEWJOB_ENV\n");
+    break;
   case NEWJOB_OK:
     fprintf(f, " NEWJOB_OK\n");
     fprintf(f, " JobID: '%i'\n", m->jobid);
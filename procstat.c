@@ -0,0 +1,192 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2009  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/* The state of the processes of the running jobs, from /proc/PID/stat.
+ * A process is read at most once per tick of the server loop, however
+ * many listings, holds and infos look at it in the tick; the ticks are
+ * at least PROCSTAT_TICK_MS apart. A signal sent by kill_pids() forgets
+ * it, so the next look reads it again. The entries are dropped when the
+ * job leaves the queue (see set_job_pid). */
+
+enum { PROCSTAT_BUCKETS = 256, PROCSTAT_TICK_MS = 100 };
+
+static struct ProcStat *buckets[PROCSTAT_BUCKETS];
+static unsigned long current_tick = 1;
+static long long last_tick_ms;
+
+static unsigned int procstat_bucket(int pid) {
+  return (unsigned int)pid % PROCSTAT_BUCKETS;
+}
+
+void procstat_tick() {
+  struct timeval now;
+  long long ms;
+
+  gettimeofday(&now, NULL);
+  ms = now.tv_sec * 1000LL + now.tv_usec / 1000;
+  if (ms - last_tick_ms >= PROCSTAT_TICK_MS) {
+    current_tick++;
+    last_tick_ms = ms;
+  }
+}
+
+/* Fields 3 to 24 of /proc/PID/stat, after the command in parentheses,
+ * which may have spaces. Returns -1 if the process is gone. */
+static int read_stat(struct ProcStat *e) {
+  char filename[64];
+  char buf[1024];
+  const char *p;
+  unsigned long long utime, stime;
+  struct timeval now;
+  long rss;
+  int fd;
+  int n;
+
+  snprintf(filename, sizeof(filename), "/proc/%d/stat", e->pid);
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+
+  p = strrchr(buf, ')');
+  if (p == NULL ||
+      sscanf(p + 1,
+             " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu"
+             " %*d %*d %*d %*d %d %*d %*u %*u %ld",
+             &e->state, &utime, &stime, &e->threads, &rss) != 5)
+    return -1;
+
+  gettimeofday(&now, NULL);
+  if (e->read_time.tv_sec != 0) {
+    double dt = now.tv_sec - e->read_time.tv_sec +
+                1e-6 * (now.tv_usec - e->read_time.tv_usec);
+
+    if (dt > 0)
+      e->cpu = 100.0 * (utime + stime - e->cpu_ticks) /
+               sysconf(_SC_CLK_TCK) / dt;
+  }
+  e->cpu_ticks = utime + stime;
+  e->read_time = now;
+  e->rss_kb = rss * (sysconf(_SC_PAGESIZE) / 1024);
+  return 0;
+}
+
+/* NULL if the process is gone, and then it is forgotten */
+const struct ProcStat *procstat_get(int pid) {
+  struct ProcStat **link;
+  struct ProcStat *e;
+
+  if (pid <= 0)
+    return NULL;
+  link = &buckets[procstat_bucket(pid)];
+  for (e = *link; e != NULL; e = e->next)
+    if (e->pid == pid)
+      break;
+
+  if (e == NULL) {
+    e = (struct ProcStat *)calloc(1, sizeof(*e));
+    if (e == NULL) {
+      warning("Cannot allocate the state of the process %i", pid);
+      return NULL;
+    }
+    e->pid = pid;
+    e->cpu = -1;
+    e->next = *link;
+    *link = e;
+  } else if (e->tick == current_tick)
+    return e;
+
+  e->tick = current_tick;
+  if (read_stat(e) != 0) {
+    procstat_forget(pid);
+    return NULL;
+  }
+  return e;
+}
+
+/* Read it again at the next look, or drop it for a job that ended */
+void procstat_forget(int pid) {
+  struct ProcStat **link = &buckets[procstat_bucket(pid)];
+
+  while (*link != NULL) {
+    struct ProcStat *e = *link;
+
+    if (e->pid == pid) {
+      *link = e->next;
+      free(e);
+      return;
+    }
+    link = &e->next;
+  }
+}
+
+/* return 0 for running and 1 for sleep and -1 for error */
+int is_sleep(int pid) {
+  const struct ProcStat *e = procstat_get(pid);
+
+  if (e == NULL)
+    return -1;
+  return e->state == 'T' ? 1 : 0;
+}
+
+int open_pidfd(int pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* 0 while the process of the /proc/PID directory dir_fd runs, 1 once it
+ * ended. Its wait status is then in *status, from field 52 of the stat
+ * file, which is only there while the process is a zombie: -1 if its
+ * parent reaped it already. The directory stays bound to the process,
+ * so a reused pid is never read. */
+int proc_ended(int dir_fd, int *status) {
+  char buf[1024];
+  const char *p;
+  char state;
+  int field;
+  int fd;
+  int n;
+
+  *status = -1;
+  fd = openat(dir_fd, "stat", O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 1;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 1;
+  buf[n] = '\0';
+
+  p = strrchr(buf, ')');
+  if (p == NULL || sscanf(p + 1, " %c", &state) != 1)
+    return 1;
+  if (state != 'Z' && state != 'X')
+    return 0;
+  for (field = 3; field <= 52 && p != NULL; field++)
+    p = strchr(p + 1, ' ');
+  if (p == NULL || sscanf(p, " %d", status) != 1)
+    *status = -1;
+  return 1;
+}
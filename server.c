@@ -4,7 +4,7 @@
 
     Please find the license in the provided COPYING file.
 */
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -66,11 +66,30 @@ struct Client_conn {
 };
 
 /* Globals */
-static struct Client_conn client_cs[MAXCONN];
+static struct Client_conn *client_cs;
+static int client_cs_allocated;
 static int nconnections;
 static char *path;
 static int max_descriptors;
 
+/* The epoll instance of the server loop, and the map from a socket
+ * descriptor to its index in client_cs (-1 if it is not a client) */
+static int epoll_fd;
+static int *conn_of_fd;
+static int conn_of_fd_allocated;
+/* Whether the listen socket is registered in epoll_fd, and whether the
+ * last accept() ran out of descriptors, until a connection closes */
+static int accepting;
+static int out_of_descriptors;
+/* The events carry the descriptor, the pid of an adopted job with
+ * this bit set (see watch_pid), or the jobid of a detached job with the
+ * next one set (see watch_runner) */
+#define PID_EVENT ((uint64_t)1 << 32)
+#define RUNNER_EVENT ((uint64_t)2 << 32)
+
+/* How often the loop moves the spilled writes to the persistence queue */
+enum { BACKLOG_RETRY_MS = 10 };
+
 /* in jobs.c */
 extern int max_jobs;
 
@@ -83,7 +102,19 @@ static void s_send_version(int s) {
   send_msg(s, &m);
 }
 
+/* SIGTERM only wakes up the server loop through this pipe, which ends
+ * the server there, after the database writes are flushed */
+static int sigterm_pipe[2] = {-1, -1};
+
 static void sigterm_handler(int n) {
+  int saved_errno = errno;
+  char c = 0;
+
+  write(sigterm_pipe[1], &c, 1);
+  errno = saved_errno;
+}
+
+static void dump_joblist() {
   const char *dumpfilename;
   int fd;
 
@@ -97,10 +128,6 @@ static void sigterm_handler(int n) {
     } else
       warning("The TS_SAVELIST file \"%s\" cannot be opened", dumpfilename);
   }
-
-  /* path will be initialized for sure, before installing the handler */
-  unlink(path);
-  exit(1);
 }
 
 static void set_default_maxslots() {
@@ -124,6 +151,17 @@ static void initialize_log_dir() {
 
 static void install_sigterm_handler() {
   struct sigaction act;
+  struct epoll_event ev;
+
+  if (pipe(sigterm_pipe) == -1)
+    error("cannot create the SIGTERM pipe");
+  fcntl(sigterm_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sigterm_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(sigterm_pipe[1], F_SETFL, O_NONBLOCK);
+  ev.events = EPOLLIN;
+  ev.data.u64 = (uint32_t)sigterm_pipe[0];
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigterm_pipe[0], &ev) == -1)
+    error("epoll_ctl on the SIGTERM pipe");
 
   act.sa_handler = sigterm_handler;
   /* Reset the mask */
@@ -140,27 +178,28 @@ static int get_max_descriptors() {
   int res;
   const char *str;
 
-  max = MAXCONN;
+  max = INT_MAX;
 
   str = getenv("TS_MAXCONN");
   if (str != NULL) {
     int user_maxconn;
     user_maxconn = abs(atoi(str));
-    if (max > user_maxconn)
+    if (user_maxconn > 0)
       max = user_maxconn;
   }
 
-  if (max > FD_SETSIZE)
-    max = FD_SETSIZE - MARGIN;
-
-  /* I'd like to use OPEN_MAX or NR_OPEN, but I don't know if any
-   * of them is POSIX compliant */
-
+  /* epoll has no FD_SETSIZE limit, so only the open files limit counts.
+   * Raise the soft limit as far as the hard one allows. */
   res = getrlimit(RLIMIT_NOFILE, &rlim);
   if (res != 0)
     warning("getrlimit for open files");
   else {
-    if (max > rlim.rlim_cur)
+    if (rlim.rlim_cur < rlim.rlim_max) {
+      rlim.rlim_cur = rlim.rlim_max;
+      if (setrlimit(RLIMIT_NOFILE, &rlim) != 0)
+        getrlimit(RLIMIT_NOFILE, &rlim);
+    }
+    if (rlim.rlim_cur != RLIM_INFINITY && max > rlim.rlim_cur - MARGIN)
       max = rlim.rlim_cur - MARGIN;
   }
 
@@ -218,8 +257,12 @@ void server_main(int notify_fd, char *_path) {
   struct sockaddr_un addr;
   int res;
   char *dirpath;
-  signal(SIGCLD, SIG_IGN);
-  signal(SIGCHLD, SIG_IGN);
+  /* The kernel reaps the children, unless the server runs the jobs and
+   * reaps them itself (see launch.c) */
+  if (!launch_start()) {
+    signal(SIGCLD, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+  }
 
   process_type = SERVER;
   max_descriptors = get_max_descriptors();
@@ -248,10 +291,14 @@ void server_main(int notify_fd, char *_path) {
   if (res == -1)
     error("Error binding.");
 
-  res = listen(ls, 0);
+  res = listen(ls, SOMAXCONN);
   if (res == -1)
     error("Error listening.");
 
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1)
+    error("cannot create the epoll instance in the server");
+
   // setup root user
   user_number = 1;
   user_UID[0] = 0;
@@ -280,7 +327,7 @@ void server_main(int notify_fd, char *_path) {
   if (notify_fd != 0)
     notify_parent(notify_fd);
 
-  if (open_sqlite() != 0) {
+  if (open_store() != 0) {
     // debug_write("Cannot open sqlite database");
     error("Cannot open sqlite database");
   }
@@ -302,123 +349,290 @@ static int get_conn_of_jobid(int jobid) {
   return -1;
 }
 
+static void set_conn_of_fd(int fd, int index) {
+  if (fd >= conn_of_fd_allocated) {
+    int i, size = conn_of_fd_allocated == 0 ? MAXCONN : conn_of_fd_allocated;
+    while (size <= fd)
+      size *= 2;
+    conn_of_fd = realloc(conn_of_fd, size * sizeof(int));
+    if (conn_of_fd == NULL)
+      error("Cannot allocate the descriptor table");
+    for (i = conn_of_fd_allocated; i < size; ++i)
+      conn_of_fd[i] = -1;
+    conn_of_fd_allocated = size;
+  }
+  conn_of_fd[fd] = index;
+}
+
+static int get_conn_of_fd(int fd) {
+  if (fd < 0 || fd >= conn_of_fd_allocated)
+    return -1;
+  return conn_of_fd[fd];
+}
+
+/* Watch the pidfd of an adopted job in the server loop, found again by
+ * its pid. Closing it drops it from epoll_fd. */
+void watch_pid(int pidfd, int pid) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = PID_EVENT | (uint32_t)pid;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) == -1)
+    error("epoll_ctl adding the pidfd of the pid %i", pid);
+}
+
+void watch_runner(int pidfd, int jobid) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = RUNNER_EVENT | (uint32_t)jobid;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) == -1)
+    error("epoll_ctl adding the runner pidfd of the jobid %i", jobid);
+}
+
+static void set_accepting(int ls, int on) {
+  struct epoll_event ev;
+
+  if (accepting == on)
+    return;
+  ev.events = EPOLLIN;
+  ev.data.u64 = (uint32_t)ls;
+  if (epoll_ctl(epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, ls, &ev) == -1)
+    error("epoll_ctl on the listen socket");
+  accepting = on;
+}
+
+static void add_connection(int cs, int ts_UID) {
+  struct epoll_event ev;
+
+  if (nconnections == client_cs_allocated) {
+    client_cs_allocated =
+        client_cs_allocated == 0 ? MAXCONN : client_cs_allocated * 2;
+    client_cs =
+        realloc(client_cs, client_cs_allocated * sizeof(struct Client_conn));
+    if (client_cs == NULL)
+      error("Cannot allocate the connection table");
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = (uint32_t)cs;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cs, &ev) == -1) {
+    warning("epoll_ctl adding the client %i", cs);
+    close(cs);
+    return;
+  }
+
+  client_cs[nconnections].hasjob = 0;
+  client_cs[nconnections].jobid = 0;
+  client_cs[nconnections].socket = cs;
+  client_cs[nconnections].ts_UID = ts_UID;
+  set_conn_of_fd(cs, nconnections);
+  nconnections++;
+}
+
+static void accept_connection(int ls) {
+  int cs;
+  struct ucred scred;
+  unsigned int len = sizeof(struct ucred);
+  int ts_UID;
+
+  // wait the connection
+  cs = accept(ls, NULL, NULL);
+  if (cs == -1) {
+    /* Out of descriptors; the client waits in the backlog. The listen
+     * socket would stay ready, so stop watching it meanwhile. */
+    if (errno == EMFILE || errno == ENFILE) {
+      out_of_descriptors = 1;
+      set_accepting(ls, 0);
+      return;
+    }
+    if (errno == EINTR || errno == ECONNABORTED)
+      return;
+    error("Accepting from %i", ls);
+  }
+
+  if (getsockopt(cs, SOL_SOCKET, SO_PEERCRED, &scred, &len) == -1)
+    error("cannot read peer credentials from %i", cs);
+
+  ts_UID = get_tsUID(scred.uid);
+  if (ts_UID == -1)
+    close(cs);
+  else
+    add_connection(cs, ts_UID);
+}
+
+/* Start every job that fits in the free slots, not only the first one,
+ * so a capacity change is filled up in one loop iteration. The database
+ * writes of all of them go in one transaction. */
+static void dispatch_jobs() {
+  int newjob, awaken_job;
+  int started = 0;
+
+  /* This will return firstjob->jobid or -1 */
+  while ((newjob = next_run_job()) != -1) {
+    int conn;
+
+    if (started++ == 0)
+      begin_transaction_DB();
+    conn = get_conn_of_jobid(newjob);
+    /* This next marks the firstjob state to RUNNING */
+    s_mark_job_running(newjob);
+    if (conn != -1)
+      s_runjob(newjob, conn);
+    else if (job_is_detached(newjob))
+      s_spawn_runner(newjob);
+    else
+      warning("The job %i to run does not have a connection open", newjob);
+  }
+  if (started == 0)
+    return;
+  commit_transaction_DB();
+
+  while ((awaken_job = wake_hold_client()) != -1) {
+    int wake_conn = get_conn_of_jobid(awaken_job);
+    if (wake_conn == -1)
+      error("The job awaken does not have a connection open");
+    s_newjob_ok(wake_conn);
+  }
+}
+
 static void server_loop(int ls) {
-  fd_set readset;
+  struct epoll_event *events;
+  int max_events = MAXCONN;
+  int nevents;
   int i;
-  int maxfd;
   int keep_loop = 1;
-  int newjob;
+  int terminated = 0;
+
+  /* The restore wrote synchronously; from now on a thread does */
+  flush_DB(1);
+  start_persist_DB();
+  snapshot_start();
+
+  events = malloc(max_events * sizeof(struct epoll_event));
+  if (events == NULL)
+    error("Cannot allocate the epoll events");
 
   while (keep_loop) {
-    FD_ZERO(&readset);
-    maxfd = 0;
+    int listen_ready = 0;
+    int backlog = persist_backlog_DB();
+    int timeout = snapshot_timeout();
+
+    /* The processes of the jobs may be read again */
+    procstat_tick();
+
     /* If we can accept more connections, go on.
-     * Otherwise, the system block them (no accept will be done). */
-    if (nconnections < max_descriptors) {
-      FD_SET(ls, &readset);
-      maxfd = ls;
+     * Otherwise, the system block them (no accept will be done).
+     * Neither while the disk is a whole persistence queue behind. */
+    set_accepting(ls, nconnections < max_descriptors && !out_of_descriptors &&
+                          backlog == 0);
+
+    if (backlog != 0 && (timeout == -1 || timeout > BACKLOG_RETRY_MS))
+      timeout = BACKLOG_RETRY_MS;
+    nevents = epoll_wait(epoll_fd, events, max_events, timeout);
+    if (nevents == -1) {
+      if (errno == EINTR)
+        continue;
+      error("epoll_wait in the server loop");
     }
 
-    for (i = 0; i < nconnections; ++i) {
-      FD_SET(client_cs[i].socket, &readset);
-      if (client_cs[i].socket > maxfd)
-        maxfd = client_cs[i].socket;
-    }
+    for (i = 0; i < nevents && keep_loop; ++i) {
+      uint64_t data = events[i].data.u64;
+      int fd = (int)data;
+      int index;
+      enum Break b;
 
-    select(maxfd + 1, &readset, NULL, NULL, NULL);
-    if (FD_ISSET(ls, &readset)) {
-      int cs;
-      // wait the connection
-      cs = accept(ls, NULL, NULL);
-      if (cs == -1)
-        error("Accepting from %i", ls);
-
-      
-      struct ucred scred;
-      unsigned int len = sizeof(struct ucred);
-      if (getsockopt(cs, SOL_SOCKET, SO_PEERCRED, &scred, &len) == -1)
-        error("cannot read peer credentials from %i", cs);
-      
-      client_cs[nconnections].hasjob = 0;
-      client_cs[nconnections].socket = cs;
-      
-      client_cs[nconnections].ts_UID = get_tsUID(scred.uid);
-
-      if (client_cs[nconnections].ts_UID == -1) {
-        close(cs);
-      } else {
-        nconnections++;
+      if (data & PID_EVENT) {
+        s_adopted_exit(fd);
+        continue;
       }
-    }
-
-    for (i = 0; i < nconnections; ++i) {
-      if (FD_ISSET(client_cs[i].socket, &readset)) {
-        enum Break b;
-        b = client_read(i);
-        /* Check if we should break */
-        if (b == CLOSE) {
-          warning("Closing");
-          /* On unknown message, we close the client,
-             or it may hang waiting for an answer */
-          // printf("close to jobid %d nconnections = %d/%d\n", client_cs[i].jobid, i, nconnections);
-          clean_after_client_disappeared(client_cs[i].socket, i);
-        } else if (b == BREAK) {
-          keep_loop = 0;
-        }
-      } else {
-        /*
-        if (client_cs[i].hasjob && check_running_dead(client_cs[i].jobid) == 1) {
-          clean_after_client_disappeared(client_cs[i].socket, i);
-        }
-        */
+      if (data & RUNNER_EVENT) {
+        s_runner_exit(fd);
+        continue;
       }
-    } // nconnections
 
-    /* This will return firstjob->jobid or -1 */
-    newjob = next_run_job();
-    // printf("end of next_run, newjob = %d\n", newjob);
+      if (fd == sigterm_pipe[0]) {
+        keep_loop = 0;
+        terminated = 1;
+        break;
+      }
 
-    if (newjob != -1) {
-      int conn, awaken_job;
-      conn = get_conn_of_jobid(newjob);
-      /* This next marks the firstjob state to RUNNING */
-      s_mark_job_running(newjob);
-      s_runjob(newjob, conn);
+      if (fd == ls) {
+        /* Accepted at the end, so a descriptor closed in this round
+         * cannot be reused by a new client before its stale event */
+        listen_ready = 1;
+        continue;
+      }
 
-      while ((awaken_job = wake_hold_client()) != -1) {
-        int wake_conn = get_conn_of_jobid(awaken_job);
-        if (wake_conn == -1)
-          error("The job awaken does not have a connection open");
-        s_newjob_ok(wake_conn);
+      /* The client may have been closed by an earlier event */
+      index = get_conn_of_fd(fd);
+      if (index == -1)
+        continue;
+
+      b = client_read(index);
+      /* Check if we should break */
+      if (b == CLOSE) {
+        warning("Closing");
+        /* On unknown message, we close the client,
+           or it may hang waiting for an answer */
+        clean_after_client_disappeared(client_cs[index].socket, index);
+      } else if (b == BREAK) {
+        keep_loop = 0;
       }
-      // printf("end of next_run_job for jobid[%d]\n", newjob);
-    } // job != -1
+    }
+
+    if (listen_ready && keep_loop)
+      accept_connection(ls);
+
+    /* Grow the event buffer when it was filled up */
+    if (nevents == max_events) {
+      max_events *= 2;
+      events = realloc(events, max_events * sizeof(struct epoll_event));
+      if (events == NULL)
+        error("Cannot allocate the epoll events");
+    }
+
+    launch_reap();
+    dispatch_jobs();
     s_check_holdon();
+    flush_DB(0);
+    publish_snapshot();
   } // end of while (keep_loop)
 
+  free(events);
+  if (terminated)
+    dump_joblist();
   end_server(ls);
+  if (terminated)
+    exit(1);
 }
 
 static void end_server(int ls) {
+  close(epoll_fd);
   close(ls);
   unlink(path);
-  close_sqlite();
+  snapshot_stop();
+  flush_evicted_jobs();
+  close_store();
   /* This comes from the parent, in the fork after server_main.
    * This is the last use of path in this process.*/
   free(path);
 }
 
 static void remove_connection(int index) {
-  int i;
-
   if (client_cs[index].hasjob) {
     s_delete_job(client_cs[index].jobid);
   }
 
-  for (i = index; i < (nconnections - 1); ++i) {
-    memcpy(&client_cs[i], &client_cs[i + 1], sizeof(client_cs[0]));
-  }
+  /* The socket is already closed, which also drops it from epoll_fd.
+   * Fill the hole with the last connection, to keep this O(1). */
+  set_conn_of_fd(client_cs[index].socket, -1);
+  out_of_descriptors = 0;
   nconnections--;
+  if (index != nconnections) {
+    client_cs[index] = client_cs[nconnections];
+    set_conn_of_fd(client_cs[index].socket, index);
+  }
 }
 
 
@@ -444,31 +658,62 @@ static void clean_after_client_disappeared(int socket, int index) {
      * more related to the jobid, secially on remove_connection
      * when we receive the EOC. */
     client_cs[index].hasjob = 0;
-  } else
+  } else {
     /* If it doesn't have a running job,
-     * it may well be a notification */
+     * it may well be a notification or a watcher */
     s_remove_notification(socket);
+    s_remove_watcher(socket);
+  }
 
   close(socket);
   remove_connection(index);
 }
 
 
-static void s_remove_all_queues(int ts_UID) {
+/* Drop the connections of ts_UID without a running job, but the one of
+ * the caller. A removal moves the last connection into slot i, so i
+ * only advances past the connections kept. */
+static void s_remove_all_queues(int ts_UID, int caller) {
   int i = 0;
-  while(i < nconnections - 1) {
-    if (ts_UID == 0 || client_cs[i].ts_UID == ts_UID) {
-      if (job_is_running(client_cs[i].jobid) != 1) {
-        clean_after_client_disappeared(client_cs[i].socket, i);
-      } else {
-        i++; // To next one
-      }
+  while (i < nconnections) {
+    if (client_cs[i].socket != caller &&
+        (ts_UID == 0 || client_cs[i].ts_UID == ts_UID) &&
+        job_is_running(client_cs[i].jobid) != 1) {
+      clean_after_client_disappeared(client_cs[i].socket, i);
     } else {
       i++; // To next one
     }
   }
 }
 
+/* Whether the message may change what the snapshot shows, so it is
+ * marked pending before the answer */
+static int changes_jobs(enum MsgTypes type) {
+  switch (type) {
+  case LIST:
+  case LIST_ALL:
+  case HISTORY:
+  case INFO:
+  case LAST_ID:
+  case GET_LABEL:
+  case GET_CMD:
+  case ASK_OUTPUT:
+  case WAITJOB:
+  case WAIT_RUNNING_JOB:
+  case COUNT_RUNNING:
+  case GET_STATE:
+  case GET_MAX_SLOTS:
+  case GET_VERSION:
+  case GET_LOGDIR:
+  case GET_ENV:
+  case STATS:
+  case WATCH:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
 static enum Break client_read(int index) {
   // printf("client_read(%d)\n", index);
 
@@ -490,6 +735,9 @@ static enum Break client_read(int index) {
   // printf("client_read(%d), m.type = %d\n", index, m.type);
   int ts_UID = client_cs[index].ts_UID;
 
+  if (changes_jobs(m.type))
+    snapshot_changed();
+
   /* Process message */
   switch (m.type) {
   case REFRESH_USERS:
@@ -560,7 +808,7 @@ static enum Break client_read(int index) {
     if (m.u.newjob.taskpid != 0) {
       // check if taskpid isnot in queue and from a valid user.
       ts_UID = s_check_relink(s, m.u.newjob.taskpid, ts_UID);
-    } else {
+    } else if (!job_awaits_runner(m.jobid)) {
       if (s_check_locker(ts_UID) == 1) { break; }
     }
 
@@ -581,6 +829,20 @@ static enum Break client_read(int index) {
       clean_after_client_disappeared(s, index);
       break;
     }
+    if (job_is_detached(client_cs[index].jobid)) {
+      /* The job stays queued in the server alone */
+      s_newjob_ok(index);
+      client_cs[index].hasjob = 0;
+      close(s);
+      remove_connection(index);
+      break;
+    }
+    if (job_is_running(client_cs[index].jobid)) {
+      /* The runner of a detached job, dispatched already */
+      s_newjob_ok(index);
+      s_runjob(client_cs[index].jobid, index);
+      break;
+    }
     if (!job_is_holding_client(client_cs[index].jobid))
       s_newjob_ok(index);
     else if (!m.u.newjob.wait_enqueuing) {
@@ -588,6 +850,17 @@ static enum Break client_read(int index) {
       clean_after_client_disappeared(s, index);
     }
     break;
+  case NEWJOB_BATCH:
+    if (s_check_locker(ts_UID) == 1 || ts_UID < 0 || ts_UID > USER_MAX) {
+      struct Msg m = default_msg();
+      m.type = NEWJOB_NOK;
+      send_msg(s, &m);
+    } else
+      s_newjob_batch(s, &m, ts_UID);
+    /* All the jobs are detached: nobody waits on this connection */
+    close(s);
+    remove_connection(index);
+    break;
   case RUNJOB_OK: {
     char *buffer = 0;
     if (m.u.output.store_output) {
@@ -602,7 +875,9 @@ static enum Break client_read(int index) {
   } break;
   case KILL_ALL:
       s_kill_all_jobs(s, ts_UID);
-      s_remove_all_queues(ts_UID);
+      s_remove_all_queues(ts_UID, s);
+      /* The caller may have moved to another slot */
+      index = get_conn_of_fd(s);
       /* TODO to remove the queued jobs
       for (int i = 0; i < nconnections; i++) {
         client_cs[].hasjob = 0;
@@ -611,7 +886,7 @@ static enum Break client_read(int index) {
       */
   case LIST:
     term_width = m.u.list.term_width;
-    s_list(s, ts_UID, m.u.list.list_format); // list ts_UID user
+    s_list(s, ts_UID, &m); // list ts_UID user
 
     /* We must actively close, meaning End of Lines */
     close(s);
@@ -619,12 +894,26 @@ static enum Break client_read(int index) {
     break;
   case LIST_ALL:
     term_width = m.u.list.term_width;
-    s_list(s, 0, m.u.list.list_format); // list all
+    s_list_all(s, &m); // list all
 
     /* We must actively close, meaning End of Lines */
     close(s);
     remove_connection(index);
     break;
+  case HISTORY:
+    /* The connection stays for the next page */
+    if (s_history(s, ts_UID, &m) == 0) {
+      close(s);
+      remove_connection(index);
+    }
+    break;
+  case WATCH:
+    /* The connection stays for the events */
+    if (s_watch(s, ts_UID, &m) == 0) {
+      close(s);
+      remove_connection(index);
+    }
+    break;
   case INFO:
     s_job_info(s, m.jobid);
     close(s);
@@ -664,18 +953,21 @@ static enum Break client_read(int index) {
     /* Will update the jobid. If it's -1, will set the jobid found */
     went_ok = s_remove_job(s, &m.jobid, ts_UID);
     if (went_ok) {
-      int i;
-      for (i = 0; i < nconnections; ++i) {
-        if (client_cs[i].hasjob && client_cs[i].jobid == m.jobid) {
-          close(client_cs[i].socket);
+      int i = 0;
+      /* A removal moves the last connection into slot i */
+      while (i < nconnections) {
+        if (!client_cs[i].hasjob || client_cs[i].jobid != m.jobid) {
+          i++;
+          continue;
+        }
+        close(client_cs[i].socket);
 
-          /* So remove_connection doesn't call s_removejob again */
-          client_cs[i].hasjob = 0;
+        /* So remove_connection doesn't call s_removejob again */
+        client_cs[i].hasjob = 0;
 
-          /* We don't try to remove any notification related to
-           * 'i', because it will be for sure a ts client for a job */
-          remove_connection(i);
-        }
+        /* We don't try to remove any notification related to
+         * 'i', because it will be for sure a ts client for a job */
+        remove_connection(i);
       }
     }
   } break;
@@ -736,6 +1028,13 @@ static enum Break client_read(int index) {
   case GET_VERSION:
     s_send_version(s);
     break;
+  case STATS:
+    s_send_pool_stats(s);
+    s_send_env_stats(s);
+    s_send_persist_stats(s);
+    close(s);
+    remove_connection(index);
+    break;
   case GET_LOGDIR:
     s_get_logdir(s);
     break;
@@ -779,7 +1078,10 @@ static void s_newjob_ok(int index) {
 
   m.type = NEWJOB_OK;
   m.jobid = client_cs[index].jobid;
+  /* The client can go, nobody will ask it to run the job */
+  m.u.newjob.detach = job_is_detached(m.jobid);
 
+  durable_DB();
   send_msg(s, &m);
 }
 
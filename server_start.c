@@ -60,6 +60,21 @@ void create_socket_path(char **path) {
   should_check_owner = 1;
 }
 
+/* Where the client of a job leaves the result it could not send, for
+ * the server started again to read (see s_check_adopted()) */
+char *create_status_path(int jobid) {
+  char *socket;
+  char *status;
+  int size;
+
+  create_socket_path(&socket);
+  size = strlen(socket) + 32;
+  status = (char *)malloc(size);
+  snprintf(status, size, "%s.%d.status", socket, jobid);
+  free(socket);
+  return status;
+}
+
 int try_connect(int s) {
   struct sockaddr_un addr;
   int res;
@@ -0,0 +1,500 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2009  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "user.h"
+
+/* The server publishes its job table in <socket>.state, so the clients
+ * of ts -l, -A and -s read it instead of asking it. The file has a
+ * header page and two buffers: the server writes the one not read, then
+ * points the header to it. seq is odd while a buffer is written; a copy
+ * is good if no write began on its buffer meanwhile. pending tells that
+ * the table changed since, and then the clients ask the server, so they
+ * never see an older table than the last answer they got.
+ * The publishing is coalesced: at most once per SNAPSHOT_MIN_MS, or ten
+ * times the last publishing took, if more. */
+
+/* From jobs.c */
+extern int busy_slots;
+extern int max_slots;
+extern int core_usage;
+
+enum {
+  SNAPSHOT_MAGIC = 0x74737374, /* "tsst" */
+  SNAPSHOT_HEADER = 4096,
+  SNAPSHOT_MIN_MS = 50,
+  SNAPSHOT_TRIES = 100
+};
+
+struct SnapshotHeader {
+  unsigned int magic;
+  int protocol;
+  int sizes; /* of the records, for a client of another build */
+  int server_pid;
+  unsigned int pending;
+  unsigned int seq;
+  unsigned int active;
+  long long offset[2];
+  long long length[2];
+};
+
+struct SnapshotGlobals {
+  int busy_slots;
+  int max_slots;
+  int core_usage;
+  int user_locker;
+  long long locker_time;
+  int server_uid;
+  int user_number;
+  int jobs;
+};
+
+struct SnapshotUser {
+  int uid;
+  int max_slots;
+  int busy;
+  int jobs;
+  int queue;
+  int locked;
+  char name[USER_NAME_WIDTH];
+};
+
+/* Followed by the dependencies, the command, the label and the output
+ * file name, up to size */
+struct SnapshotJob {
+  int size;
+  int jobid;
+  int state;
+  int finished; /* in the finished list */
+  int ts_UID;
+  int num_slots;
+  int pid;
+  int store_output;
+  int command_strip;
+  int depend_on_size;
+  int command_size; /* with the '\0', 0 for NULL */
+  int label_size;
+  int output_size;
+  struct Result result;
+  struct timeval enqueue_time;
+  struct timeval start_time;
+  struct timeval end_time;
+};
+
+/* Changes with the layout of the records */
+static int snapshot_sizes() {
+  return sizeof(struct SnapshotGlobals) + (sizeof(struct SnapshotUser) << 8) +
+         (sizeof(struct SnapshotJob) << 16);
+}
+
+static char *snapshot_path() {
+  char *socket;
+  char *path;
+  int size;
+
+  create_socket_path(&socket);
+  size = strlen(socket) + sizeof(".state");
+  path = (char *)malloc(size);
+  if (path == NULL)
+    error("Cannot allocate the path of the snapshot");
+  snprintf(path, size, "%s.state", socket);
+  free(socket);
+  return path;
+}
+
+static int snapshot_enabled() {
+  const char *env = getenv("TS_SNAPSHOT");
+
+  return env == NULL || strcmp(env, "0") != 0;
+}
+
+static long long ms_of(const struct timeval *tv) {
+  return tv->tv_sec * 1000LL + tv->tv_usec / 1000;
+}
+
+/* The server side */
+static struct {
+  int fd;
+  char *path;
+  struct SnapshotHeader *header;
+  char *buf; /* the buffer being built */
+  int len;
+  int size;
+  long long capacity[2];
+  long long file_size;
+  int changed;
+  long long next_ms; /* of the next publishing */
+} pub = {-1};
+
+void snapshot_start() {
+  if (!snapshot_enabled())
+    return;
+
+  pub.path = snapshot_path();
+  pub.fd = open(pub.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (pub.fd == -1) {
+    warning("Cannot create the snapshot %s", pub.path);
+    return;
+  }
+  /* Read by the users of the server, as -A shows them all */
+  fchmod(pub.fd, 0644);
+  pub.file_size = SNAPSHOT_HEADER;
+  if (ftruncate(pub.fd, pub.file_size) == -1)
+    error("Cannot size the snapshot %s", pub.path);
+  pub.header = mmap(NULL, SNAPSHOT_HEADER, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    pub.fd, 0);
+  if (pub.header == MAP_FAILED)
+    error("Cannot map the snapshot %s", pub.path);
+
+  pub.header->protocol = PROTOCOL_VERSION;
+  pub.header->sizes = snapshot_sizes();
+  pub.header->server_pid = getpid();
+  pub.header->pending = 1;
+  __atomic_store_n(&pub.header->magic, SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+  pub.changed = 1;
+}
+
+void snapshot_stop() {
+  if (pub.fd == -1)
+    return;
+  unlink(pub.path);
+  munmap(pub.header, SNAPSHOT_HEADER);
+  close(pub.fd);
+  pub.fd = -1;
+  free(pub.path);
+  free(pub.buf);
+}
+
+/* Before the change is told to anyone */
+void snapshot_changed() {
+  if (pub.fd == -1)
+    return;
+  pub.changed = 1;
+  __atomic_store_n(&pub.header->pending, 1, __ATOMIC_RELAXED);
+}
+
+/* The milliseconds to the next publishing, -1 if there is nothing new */
+int snapshot_timeout() {
+  struct timeval now;
+  long long left;
+
+  if (pub.fd == -1 || !pub.changed)
+    return -1;
+  gettimeofday(&now, NULL);
+  left = pub.next_ms - ms_of(&now);
+  return left > 0 ? (int)left : 0;
+}
+
+int snapshot_due() { return snapshot_timeout() == 0; }
+
+/* Room for n bytes, aligned for the next record */
+static char *pub_reserve(int n) {
+  n = (n + 7) & ~7;
+  if (pub.len + n > pub.size) {
+    int size = pub.size == 0 ? 64 * 1024 : pub.size;
+
+    while (pub.len + n > size)
+      size *= 2;
+    pub.buf = (char *)realloc(pub.buf, size);
+    if (pub.buf == NULL)
+      error("Cannot allocate %i bytes for the snapshot", size);
+    pub.size = size;
+  }
+  memset(pub.buf + pub.len, 0, n);
+  pub.len += n;
+  return pub.buf + pub.len - n;
+}
+
+void snapshot_begin() {
+  struct SnapshotGlobals *g;
+  int i;
+
+  pub.len = 0;
+  g = (struct SnapshotGlobals *)pub_reserve(sizeof(*g));
+  g->busy_slots = busy_slots;
+  g->max_slots = max_slots;
+  g->core_usage = core_usage;
+  g->user_locker = user_locker;
+  g->locker_time = locker_time;
+  g->server_uid = server_uid;
+  g->user_number = user_number;
+
+  for (i = 0; i < user_number; ++i) {
+    struct SnapshotUser *u = (struct SnapshotUser *)pub_reserve(sizeof(*u));
+
+    u->uid = user_UID[i];
+    u->max_slots = user_max_slots[i];
+    u->busy = user_busy[i];
+    u->jobs = user_jobs[i];
+    u->queue = user_queue[i];
+    u->locked = user_locked[i];
+    memcpy(u->name, user_name[i], USER_NAME_WIDTH);
+  }
+}
+
+static int string_size(const char *str) {
+  return str != NULL ? strlen(str) + 1 : 0;
+}
+
+void snapshot_job(const struct Job *p, int finished) {
+  struct SnapshotJob j = {0};
+  char *pos;
+
+  j.jobid = p->jobid;
+  j.state = p->state;
+  j.finished = finished;
+  j.ts_UID = p->ts_UID;
+  j.num_slots = p->num_slots;
+  j.pid = p->pid;
+  j.store_output = p->store_output;
+  j.command_strip = p->command_strip;
+  j.depend_on_size = p->depend_on_size;
+  j.command_size = string_size(p->command);
+  j.label_size = string_size(p->label);
+  j.output_size = string_size(p->output_filename);
+  j.result = p->result;
+  j.enqueue_time = p->info.enqueue_time;
+  j.start_time = p->info.start_time;
+  j.end_time = p->info.end_time;
+  j.size = (sizeof(j) + j.depend_on_size * sizeof(int) + j.command_size +
+            j.label_size + j.output_size + 7) & ~7;
+
+  pos = pub_reserve(j.size);
+  memcpy(pos, &j, sizeof(j));
+  pos += sizeof(j);
+  memcpy(pos, p->depend_on, j.depend_on_size * sizeof(int));
+  pos += j.depend_on_size * sizeof(int);
+  memcpy(pos, p->command, j.command_size);
+  pos += j.command_size;
+  memcpy(pos, p->label, j.label_size);
+  pos += j.label_size;
+  memcpy(pos, p->output_filename, j.output_size);
+  ((struct SnapshotGlobals *)pub.buf)->jobs++;
+}
+
+void snapshot_end() {
+  struct SnapshotHeader *h = pub.header;
+  struct timeval start, now;
+  int t = !h->active;
+  long long took;
+
+  gettimeofday(&start, NULL);
+  if (pub.len > pub.capacity[t]) {
+    /* A buffer of its own at the end of the file, with room to grow */
+    pub.capacity[t] = ((2LL * pub.len) + SNAPSHOT_HEADER - 1) &
+                      ~(long long)(SNAPSHOT_HEADER - 1);
+    h->offset[t] = pub.file_size;
+    pub.file_size += pub.capacity[t];
+    if (ftruncate(pub.fd, pub.file_size) == -1) {
+      warning("Cannot grow the snapshot %s", pub.path);
+      return;
+    }
+  }
+
+  __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+  if (pwrite(pub.fd, pub.buf, pub.len, h->offset[t]) != pub.len)
+    warning("Cannot write the snapshot %s", pub.path);
+  h->length[t] = pub.len;
+  __atomic_store_n(&h->active, t, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->pending, 0, __ATOMIC_RELEASE);
+  pub.changed = 0;
+
+  gettimeofday(&now, NULL);
+  took = ms_of(&now) - ms_of(&start);
+  pub.next_ms = ms_of(&now) + (10 * took > SNAPSHOT_MIN_MS ? 10 * took
+                                                           : SNAPSHOT_MIN_MS);
+}
+
+/* The client side */
+
+/* A copy of the buffer published last, NULL if there is none current */
+static char *snapshot_copy(int *length) {
+  const struct SnapshotHeader *h;
+  struct stat st;
+  char *path;
+  char *map = MAP_FAILED;
+  char *copy = NULL;
+  size_t mapped = 0;
+  int fd;
+  int i;
+
+  path = snapshot_path();
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd == -1)
+    return NULL;
+
+  for (i = 0; i < SNAPSHOT_TRIES; ++i) {
+    unsigned int seq, active;
+    long long offset, len;
+
+    if (fstat(fd, &st) == -1 || st.st_size < SNAPSHOT_HEADER)
+      break;
+    if ((size_t)st.st_size != mapped) {
+      if (map != MAP_FAILED)
+        munmap(map, mapped);
+      mapped = st.st_size;
+      map = mmap(NULL, mapped, PROT_READ, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+        break;
+    }
+    h = (const struct SnapshotHeader *)map;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SNAPSHOT_MAGIC ||
+        h->protocol != PROTOCOL_VERSION || h->sizes != snapshot_sizes())
+      break;
+    /* Left by a server that is gone */
+    if (kill(h->server_pid, 0) == -1 && errno != EPERM)
+      break;
+
+    seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&h->pending, __ATOMIC_ACQUIRE))
+      break;
+    active = __atomic_load_n(&h->active, __ATOMIC_ACQUIRE);
+    offset = h->offset[active];
+    len = h->length[active];
+    if (offset < SNAPSHOT_HEADER || len <= 0 || offset + len > st.st_size)
+      continue; /* grown since the fstat */
+
+    free(copy);
+    copy = (char *)malloc(len);
+    if (copy == NULL)
+      break;
+    memcpy(copy, map + offset, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    /* Before its buffer was written again */
+    if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) - seq <= (seq & 1 ? 1 : 2)) {
+      *length = len;
+      munmap(map, mapped);
+      close(fd);
+      return copy;
+    }
+  }
+
+  free(copy);
+  if (map != MAP_FAILED)
+    munmap(map, mapped);
+  close(fd);
+  return NULL;
+}
+
+/* The state of the server as published, in the globals and the job lists
+ * of this client. Returns -1 if there is none current, and then the
+ * server must answer. The jobs point into the copy, kept until exit.
+ * The sizes are checked, as a damaged file must not crash the client. */
+int snapshot_load() {
+  const struct SnapshotGlobals *g;
+  struct Job *jobs;
+  char *buf;
+  char *pos;
+  char *end;
+  int length;
+  int i;
+
+  if (!snapshot_enabled())
+    return -1;
+  buf = snapshot_copy(&length);
+  if (buf == NULL)
+    return -1;
+  end = buf + length;
+
+  g = (const struct SnapshotGlobals *)buf;
+  pos = buf + ((sizeof(*g) + 7) & ~7);
+  if (length < sizeof(*g) || g->user_number < 0 || g->user_number > USER_MAX ||
+      g->jobs < 0 ||
+      pos + g->user_number * ((sizeof(struct SnapshotUser) + 7) & ~7) > end) {
+    free(buf);
+    return -1;
+  }
+
+  busy_slots = g->busy_slots;
+  max_slots = g->max_slots;
+  core_usage = g->core_usage;
+  user_locker = g->user_locker;
+  locker_time = g->locker_time;
+  server_uid = g->server_uid;
+  user_number = g->user_number;
+  for (i = 0; i < user_number; ++i) {
+    const struct SnapshotUser *u = (const struct SnapshotUser *)pos;
+
+    user_UID[i] = u->uid;
+    user_max_slots[i] = u->max_slots;
+    user_busy[i] = u->busy;
+    user_jobs[i] = u->jobs;
+    user_queue[i] = u->queue;
+    user_locked[i] = u->locked;
+    memcpy(user_name[i], u->name, USER_NAME_WIDTH);
+    user_name[i][USER_NAME_WIDTH - 1] = '\0';
+    pos += (sizeof(*u) + 7) & ~7;
+  }
+
+  jobs = (struct Job *)calloc(g->jobs > 0 ? g->jobs : 1, sizeof(struct Job));
+  if (jobs == NULL)
+    error("Cannot allocate the %i jobs of the snapshot", g->jobs);
+  for (i = 0; i < g->jobs; ++i) {
+    const struct SnapshotJob *j = (const struct SnapshotJob *)pos;
+    struct Job *p = &jobs[i];
+    char *str;
+
+    if (pos + sizeof(*j) > end || j->size < sizeof(*j) || pos + j->size > end ||
+        j->ts_UID < 0 || j->ts_UID >= user_number || j->command_size <= 0 ||
+        sizeof(*j) + j->depend_on_size * sizeof(int) + j->command_size +
+                j->label_size + j->output_size > j->size) {
+      warning("The snapshot of the server is damaged");
+      return -1;
+    }
+
+    p->jobid = j->jobid;
+    p->state = j->state;
+    p->ts_UID = j->ts_UID;
+    p->num_slots = j->num_slots;
+    p->pid = j->pid;
+    p->store_output = j->store_output;
+    p->command_strip = j->command_strip;
+    p->result = j->result;
+    p->info.enqueue_time = j->enqueue_time;
+    p->info.start_time = j->start_time;
+    p->info.end_time = j->end_time;
+    p->pidfd = -1;
+
+    str = pos + sizeof(*j);
+    p->depend_on_size = j->depend_on_size;
+    if (j->depend_on_size > 0) {
+      p->depend_on = (int *)malloc(j->depend_on_size * sizeof(int));
+      if (p->depend_on == NULL)
+        error("Cannot allocate the dependencies of the snapshot");
+      memcpy(p->depend_on, str, j->depend_on_size * sizeof(int));
+    }
+    str += j->depend_on_size * sizeof(int);
+    p->command = str;
+    p->command[j->command_size - 1] = '\0';
+    str += j->command_size;
+    if (j->label_size > 0) {
+      p->label = str;
+      p->label[j->label_size - 1] = '\0';
+    }
+    str += j->label_size;
+    if (j->output_size > 0) {
+      p->output_filename = str;
+      p->output_filename[j->output_size - 1] = '\0';
+    }
+
+    add_snapshot_job(p, j->finished);
+    pos += j->size;
+  }
+  return 0;
+}
@@ -1,4 +1,6 @@
+#include <limits.h>
 #include <sqlite3.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -6,8 +8,23 @@
 #include "default.inc"
 #include "main.h"
 
+/* The SQLite backend of the store (store.c): the tables Jobs and
+ * Finished, with one row per job, Envs for the environments they refer
+ * to, and Global for the next jobid. The rows of Finished stay after
+ * their job leaves the finished list, as the history of ts --history. */
+
 sqlite3 *db = NULL;
-char sql[1024*16] = "";
+/* Of the server loop, for the history (sqlite_history) */
+static sqlite3 *history_db = NULL;
+
+/* NULL strings are stored as "(null)", see column_string(): the text
+ * columns are NOT NULL in the databases already out there */
+#define NULLSTR(str) ((str) == NULL ? "(null)" : (str))
+
+/* Another process holding the database only delays the persistence
+ * thread, so it waits for it instead of losing the write. The server loop
+ * waits less for the history. */
+enum { DB_BUSY_TIMEOUT_MS = 10000, HISTORY_BUSY_TIMEOUT_MS = 100 };
 
 const char *get_sqlite_path() {
   char *str;
@@ -19,13 +36,12 @@ const char *get_sqlite_path() {
   }
 }
 
-static void copy_with_nullcheck(char **dst, char *src) {
-  if (strcmp(src, "(null)") != 0 && strcmp(src, "(..)") != 0) {
-    dst[0] = (char *)malloc(sizeof(char) * (strlen(src) + 1));
-    strcpy(dst[0], src);
-  } else {
-    dst[0] = NULL;
-  }
+/* The text of the column, or NULL for "(null)" and the empty label "(..)" */
+static const char *column_string(sqlite3_stmt *stmt, int col) {
+  const char *str = (const char *)sqlite3_column_text(stmt, col);
+  if (str == NULL || strcmp(str, "(null)") == 0 || strcmp(str, "(..)") == 0)
+    return NULL;
+  return str;
 }
 
 static int callback(void *max, int argc, char **argv, char **azColName) {
@@ -37,46 +53,169 @@ static int callback(void *max, int argc, char **argv, char **azColName) {
   return 0;
 }
 
-static int check_order_id(const char *op, int* err) {
-  char *err_msg = NULL;
-  sprintf(sql, "SELECT %s(order_id) FROM Jobs", op);
-  int value = 0;
-  int rc = sqlite3_exec(db, sql, callback, &value, &err_msg);
+/* The failed jobs of the history. The query has the same term as the
+ * index, so it can use it. */
+#define HISTORY_FAILED "(errorlevel!=0 OR died_by_signal!=0)"
+
+/* The columns of the tables Jobs and Finished, in their order */
+#define JOB_COLUMNS                                                            \
+  "jobid, command, state, output_filename, store_output, pid, ts_UID, "      \
+  "should_keep_finished, depend_on, depend_on_size, notify_errorlevel_to, " \
+  "notify_errorlevel_to_size, dependency_errorlevel, label, email, "         \
+  "num_slots, errorlevel, died_by_signal, signal, user_ms, system_ms, "      \
+  "real_ms, skipped, ptr, nchars, allocchars, enqueue_time, start_time, "    \
+  "end_time, enqueue_time_ms, start_time_ms, end_time_ms, order_id, "        \
+  "command_strip, work_dir, env_hash"
+#define JOB_VALUES                                                             \
+  "?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?"
+
+/* The statements run for every job are prepared once, in sqlite_open(),
+ * and take their values as bound parameters. */
+struct TableStatements {
+  const char *table;
+  sqlite3_stmt *insert;
+  sqlite3_stmt *replace;
+  sqlite3_stmt *remove;
+  sqlite3_stmt *select; /* all the rows, in their order */
+};
+
+/* In the order of JOBS_TABLE and FINISHED_TABLE */
+static struct TableStatements tables[2] = {{"Jobs"}, {"Finished"}};
+static sqlite3_stmt *set_order_stmt = NULL;
+static sqlite3_stmt *set_state_stmt = NULL;
+static sqlite3_stmt *set_jobids_stmt = NULL;
+static sqlite3_stmt *start_stmt = NULL;
+static sqlite3_stmt *retire_stmt = NULL;
+static sqlite3_stmt *env_insert_stmt = NULL;
+static sqlite3_stmt *env_select_stmt = NULL;
+static sqlite3_stmt *env_remove_stmt = NULL;
+
+static sqlite3_stmt *prepare_DB(const char *statement) {
+  sqlite3_stmt *stmt = NULL;
+
+  if (sqlite3_prepare_v3(db, statement, -1, SQLITE_PREPARE_PERSISTENT, &stmt,
+                         NULL) != SQLITE_OK)
+    fprintf(stderr, "[prepare_DB] SQL error: %s by %s\n", sqlite3_errmsg(db),
+            statement);
+  return stmt;
+}
+
+// return error code
+static int exec_DB(const char *who, const char *statement) {
+  char *err_msg = 0;
+  int rc = sqlite3_exec(db, statement, 0, 0, &err_msg);
   if (rc != SQLITE_OK) {
-    fprintf(stderr, "[check_order_id] SQL error: %s, sql: %s\n", sql, err_msg);
+    fprintf(stderr, "[%s] SQL error: %s\n", who, err_msg);
     sqlite3_free(err_msg);
-    err[0] = -1;
-  } else {
-    err[0] = 0;
+    return -1;
   }
-  return value;
+  return 0;
 }
 
-static int max_order_id(int* err) { return check_order_id("MAX", err); }
+/* Run a prepared statement with its bound values, and reset it for the
+ * next use. Returns an error code. */
+static int step_DB(const char *who, sqlite3_stmt *stmt) {
+  int rc;
 
-static int min_order_id(int* err) { return check_order_id("MIN", err); }
+  if (stmt == NULL)
+    return -1;
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+    fprintf(stderr, "[%s] SQL error: %s\n", who, sqlite3_errmsg(db));
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return (rc == SQLITE_DONE || rc == SQLITE_ROW) ? 0 : -1;
+}
 
-static int get_order_id(int jobid, int* err) {
-  char *err_msg = 0;
-  int value = 0;
-  sprintf(sql, "SELECT order_id FROM Jobs WHERE jobid=%d", jobid);
-  int rc = sqlite3_exec(db, sql, callback, &value, &err_msg);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "[get_order_id] SQL error: %s\n", err_msg);
-    sqlite3_free(err_msg);
-    err[0] = -1;
-  } else {
-    err[0] = 0;
+static void prepare_statements() {
+  char sql[1024];
+  int i;
+
+  for (i = 0; i < 2; ++i) {
+    struct TableStatements *t = &tables[i];
+
+    snprintf(sql, sizeof(sql),
+             "INSERT INTO %s (" JOB_COLUMNS ") VALUES (" JOB_VALUES ");",
+             t->table);
+    t->insert = prepare_DB(sql);
+    snprintf(sql, sizeof(sql),
+             "INSERT OR REPLACE INTO %s (" JOB_COLUMNS ") VALUES (" JOB_VALUES
+             ");",
+             t->table);
+    t->replace = prepare_DB(sql);
+    snprintf(sql, sizeof(sql), "DELETE FROM %s WHERE jobid=?;", t->table);
+    t->remove = prepare_DB(sql);
+    /* The rows of the finished list, not the history */
+    snprintf(sql, sizeof(sql), "SELECT " JOB_COLUMNS " FROM %s%s ORDER BY "
+             "order_id;", t->table,
+             i == FINISHED_TABLE ? " WHERE listed=1" : "");
+    t->select = prepare_DB(sql);
   }
-  return value;
+  set_order_stmt = prepare_DB("UPDATE Jobs SET order_id=? WHERE jobid=?;");
+  set_state_stmt = prepare_DB("UPDATE Jobs SET state=? WHERE jobid=?;");
+  set_jobids_stmt =
+      prepare_DB("INSERT OR REPLACE INTO Global (id, JOBIDs) VALUES (1, ?);");
+  start_stmt = prepare_DB("UPDATE Jobs SET state=?, pid=?, output_filename=?, "
+                          "start_time=?, start_time_ms=? WHERE jobid=?;");
+  /* Its environment goes with the job */
+  retire_stmt = prepare_DB(
+      "UPDATE Finished SET listed=0, env_hash=0 WHERE jobid=?;");
+  env_insert_stmt =
+      prepare_DB("INSERT OR REPLACE INTO Envs (hash, env) VALUES (?, ?);");
+  env_select_stmt = prepare_DB("SELECT env FROM Envs WHERE hash=?;");
+  env_remove_stmt = prepare_DB("DELETE FROM Envs WHERE hash=?;");
+}
+
+static void finalize_statements() {
+  int i;
+
+  for (i = 0; i < 2; ++i) {
+    sqlite3_finalize(tables[i].insert);
+    sqlite3_finalize(tables[i].replace);
+    sqlite3_finalize(tables[i].remove);
+    sqlite3_finalize(tables[i].select);
+    tables[i].insert = tables[i].replace = NULL;
+    tables[i].remove = tables[i].select = NULL;
+  }
+  sqlite3_finalize(set_order_stmt);
+  sqlite3_finalize(set_state_stmt);
+  sqlite3_finalize(set_jobids_stmt);
+  sqlite3_finalize(start_stmt);
+  sqlite3_finalize(retire_stmt);
+  sqlite3_finalize(env_insert_stmt);
+  sqlite3_finalize(env_select_stmt);
+  sqlite3_finalize(env_remove_stmt);
+  set_order_stmt = set_state_stmt = set_jobids_stmt = start_stmt = NULL;
+  retire_stmt = NULL;
+  env_insert_stmt = env_select_stmt = env_remove_stmt = NULL;
+}
+
+/* The order_id range of the rows already stored, of both tables, but for
+ * the history */
+static void sqlite_order_range(int *min, int *max) {
+  sqlite3_stmt *stmt = prepare_DB(
+      "SELECT MIN(order_id), MAX(order_id) FROM (SELECT order_id FROM Jobs "
+      "UNION ALL SELECT order_id FROM Finished WHERE listed=1);");
+
+  *min = *max = 0;
+  if (stmt == NULL)
+    return;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    *min = sqlite3_column_int(stmt, 0);
+    *max = sqlite3_column_int(stmt, 1);
+  }
+  sqlite3_finalize(stmt);
 }
 
-int close_sqlite() {
+static int sqlite_close() {
   // free(jobDB_Jobs);
+  finalize_statements();
+  sqlite3_close(history_db);
+  history_db = NULL;
   return sqlite3_close(db);
 }
 
-int open_sqlite() {
+static int sqlite_open(int sync_full) {
   const char *path = get_sqlite_path();
   char *zErrMsg = 0;
   int rc;
@@ -88,6 +227,8 @@ int open_sqlite() {
     sqlite3_close(db);
     return (-1);
   }
+  /* A server going down may still be writing its last transaction */
+  sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
 
   char *sql =
       "CREATE TABLE IF NOT EXISTS Jobs("
@@ -180,10 +321,58 @@ int open_sqlite() {
     // error_flag--;
   }
 
+  /* An environment is stored once, and the rows of its jobs hold its
+   * hash. The column is added to the tables of older versions too; it
+   * fails once it is there. */
+  sql = "CREATE TABLE IF NOT EXISTS Envs("
+        "hash INT PRIMARY KEY NOT NULL,"
+        "env TEXT NOT NULL);";
+  rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK) {
+    printf("[open_sqlite3] SQL error: %s\n", zErrMsg);
+    sqlite3_free(zErrMsg);
+    error_flag--;
+  }
+  sqlite3_exec(db, "ALTER TABLE Jobs ADD COLUMN env_hash INT NOT NULL DEFAULT 0;",
+               0, 0, NULL);
+  sqlite3_exec(db,
+               "ALTER TABLE Finished ADD COLUMN env_hash INT NOT NULL DEFAULT 0;",
+               0, 0, NULL);
+  /* A finished row is listed while its job is in the finished list, then
+   * it stays as history. The history is searched by user, label and
+   * failure, the newest first, one page at a time. */
+  sqlite3_exec(db,
+               "ALTER TABLE Finished ADD COLUMN listed INT NOT NULL DEFAULT 1;",
+               0, 0, NULL);
+  exec_DB("open_sqlite",
+          "CREATE INDEX IF NOT EXISTS Finished_listed ON Finished(order_id) "
+          "WHERE listed=1;"
+          "CREATE INDEX IF NOT EXISTS Finished_end ON Finished(end_time, "
+          "jobid);"
+          "CREATE INDEX IF NOT EXISTS Finished_user ON Finished(ts_UID, "
+          "end_time, jobid);"
+          "CREATE INDEX IF NOT EXISTS Finished_label ON Finished(label, "
+          "end_time, jobid);"
+          "CREATE INDEX IF NOT EXISTS Finished_failed ON Finished(end_time, "
+          "jobid) WHERE " HISTORY_FAILED ";"
+          "CREATE INDEX IF NOT EXISTS Finished_user_failed ON Finished("
+          "ts_UID, end_time, jobid) WHERE " HISTORY_FAILED ";");
+  /* The environments left by jobs the server lost track of */
+  exec_DB("open_sqlite", "DELETE FROM Envs WHERE hash NOT IN (SELECT env_hash "
+                         "FROM Jobs UNION SELECT env_hash FROM Finished WHERE "
+                         "listed=1);");
+
+  /* With a write-ahead log a commit is a sequential append, and a crash
+   * of the server never loses a committed transaction */
+  exec_DB("open_sqlite", "PRAGMA journal_mode=WAL;");
+  exec_DB("open_sqlite", sync_full ? "PRAGMA synchronous=FULL;"
+                                   : "PRAGMA synchronous=NORMAL;");
+
+  prepare_statements();
   return error_flag;
 }
 
-int get_jobids_DB() {
+static int sqlite_get_jobids() {
   char *err_msg = 0;
   char *sql = "SELECT JOBIDs FROM Global WHERE id=1;";
   int value = 0;
@@ -196,143 +385,154 @@ int get_jobids_DB() {
   return value;
 }
 
-// return error code
-int set_jobids_DB(int value) {
-  char *err_msg = 0;
-  sprintf(sql, "INSERT OR REPLACE INTO Global (id, JOBIDs) VALUES (1, %d);",
-          value);
-  int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "[set_jobids_DB] SQL error: %s\n", err_msg);
-    sqlite3_free(err_msg);
+static int sqlite_begin() {
+  return exec_DB("open_transaction", "BEGIN TRANSACTION;");
+}
+
+static int sqlite_commit() { return exec_DB("close_transaction", "COMMIT;"); }
+
+static int remove_DB(sqlite3_stmt *stmt, int jobid) {
+  if (stmt == NULL)
     return -1;
-  }
-  return 0;
+  sqlite3_bind_int(stmt, 1, jobid);
+  return step_DB("delete_DB", stmt);
 }
 
-// return error code
-int delete_DB(int jobid, const char *table) {
-  sprintf(sql, "DELETE FROM %s WHERE jobid=%d;", table, jobid);
-  char *errmsg = NULL;
-
-  if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
-    fprintf(stderr, "[delete_DB] SQL error: %s by %s\n", errmsg, sql);
-    sqlite3_free(errmsg);
-    return -1; //返回-1表示删除失败
-  }
-  return 0; //返回0表示删除成功
+/* The rows go in the transaction of the round, with the prepared
+ * statement bound to each jobid */
+static int sqlite_remove(const int *jobids, int n, int table) {
+  int err = 0;
+
+  for (int i = 0; i < n; ++i)
+    if (remove_DB(tables[table].remove, jobids[i]) != 0)
+      err = -1;
+  return err;
 }
 
-static int edit_DB(struct Job *job, const char *table, const char *action) {
-  struct Result *result = &(job->result);
-  struct Procinfo *info = &(job->info);
-  const char *label = job->label == NULL ? "(..)" : job->label;
-  const char *email = job->email == NULL ? "(..)" : job->email;
+/* The rows stay, as history */
+static int sqlite_retire(const int *jobids, int n) {
   int err = 0;
-  int order_id = get_order_id(job->jobid, &err);
-  if (err != 0) {
-    order_id = max_order_id(&err) + 1;
-    if (err !=0) return -1;
-  }
-  char *depend_on = ints_to_chars(job->depend_on_size, job->depend_on, ",");
-  char *notify_errorlevel_to = ints_to_chars(job->notify_errorlevel_to_size,
-                                             job->notify_errorlevel_to, ",");
-
-  sprintf(
-      sql,
-      "%s INTO %s (jobid, command, state, output_filename, store_output, pid, "
-      "ts_UID, should_keep_finished, depend_on, depend_on_size,"
-      "notify_errorlevel_to, notify_errorlevel_to_size, "
-      "dependency_errorlevel,label,email,num_slots,errorlevel,died_by_signal,"
-      "signal,user_ms,system_ms,real_ms,skipped,"
-      "ptr,nchars,allocchars,"
-      "enqueue_time,start_time,end_time,"
-      "enqueue_time_ms,start_time_ms,end_time_ms, "
-      "order_id, command_strip, work_dir)"
-      "VALUES (%d,'%s',%d,'%s',%d,%d,%d,%d,'%s',%d,'%s',%d,%d,'%s','%s',%d,"
-      "%d,%d,%d,%f,%f,%f,%d,"
-      "'%s',%d,%d,'%ld','%ld','%ld','%ld','%ld','%ld', "
-      "%d, %d,'%s');",
-      action, table, job->jobid, job->command, job->state, job->output_filename,
-      job->store_output, job->pid, job->ts_UID, job->should_keep_finished,
-      depend_on, // job->depend_on,
-      job->depend_on_size, notify_errorlevel_to, job->notify_errorlevel_to_size,
-      job->dependency_errorlevel, label, email, job->num_slots,
-      result->errorlevel, result->died_by_signal, result->signal,
-      result->user_ms, result->system_ms, result->real_ms, result->skipped,
-      info->ptr, info->nchars, info->allocchars, info->enqueue_time.tv_sec,
-      info->start_time.tv_sec, info->end_time.tv_sec,
-      info->enqueue_time.tv_usec, info->start_time.tv_usec,
-      info->end_time.tv_usec, order_id, job->command_strip, job->work_dir);
-  char *errmsg = NULL;
-  int rs = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
-  free(depend_on);
-  free(notify_errorlevel_to);
-  if (rs != SQLITE_OK) {
-    fprintf(stderr, "[insert_DB] SQL error: %s by %s\n", errmsg, sql);
-    sqlite3_free(errmsg);
-    return -1; // 返回-1表示插入失败
+
+  if (retire_stmt == NULL)
+    return -1;
+  for (int i = 0; i < n; ++i) {
+    sqlite3_bind_int(retire_stmt, 1, jobids[i]);
+    if (step_DB("retire_DB", retire_stmt) != 0)
+      err = -1;
   }
-  return 0; // 返回0表示插入成功
+  return err;
 }
 
-int insert_DB(struct Job *job, const char *table) {
-  return edit_DB(job, table, "INSERT");
+static int update_DB(const char *who, sqlite3_stmt *stmt, int value,
+                     int jobid) {
+  if (stmt == NULL)
+    return -1;
+  sqlite3_bind_int(stmt, 1, value);
+  sqlite3_bind_int(stmt, 2, jobid);
+  return step_DB(who, stmt);
 }
 
-int insert_or_replace_DB(struct Job *job, const char *table) {
-  return edit_DB(job, table, "INSERT OR REPLACE");
+static int sqlite_set_order(int jobid, int order_id) {
+  return update_DB("set_order_id_DB", set_order_stmt, order_id, jobid);
 }
 
-//return error code
-static int set_order_id_DB(int jobid, int order_id) {
-  char *err_msg = 0;
-  sprintf(sql, "UPDATE Jobs SET order_id=%d WHERE jobid=%d", order_id, jobid);
-  int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "[movetop_DB] SQL error: %s\n", err_msg);
-    sqlite3_free(err_msg);
+static int sqlite_set_state(int jobid, int state) {
+  return update_DB("set_state_DB", set_state_stmt, state, jobid);
+}
+
+static int sqlite_set_jobids(int value) {
+  if (set_jobids_stmt == NULL)
     return -1;
-  }
-  return 0;
+  sqlite3_bind_int(set_jobids_stmt, 1, value);
+  return step_DB("set_jobids_DB", set_jobids_stmt);
 }
 
-//return error code
-int set_state_DB(int jobid, int state) {
-  char *err_msg = 0;
-  sprintf(sql, "UPDATE Jobs SET state=%d WHERE jobid=%d", state, jobid);
-  int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "[movetop_DB] SQL error: %s\n", err_msg);
-    sqlite3_free(err_msg);
+static void bind_string(sqlite3_stmt *stmt, int col, const char *str) {
+  sqlite3_bind_text(stmt, col, str, -1, SQLITE_STATIC);
+}
+
+static int edit_DB(const struct JobRow *row, sqlite3_stmt *stmt) {
+  const struct Job *job = &row->job;
+  const struct Result *result = &(job->result);
+  const struct Procinfo *info = &(job->info);
+  const char *label = job->label == NULL ? "(..)" : job->label;
+  const char *email = job->email == NULL ? "(..)" : job->email;
+
+  if (stmt == NULL)
     return -1;
-  }
-  return 0;
+
+  /* The values are bound, so quotes in the strings need no escaping */
+  sqlite3_bind_int(stmt, 1, job->jobid);
+  bind_string(stmt, 2, NULLSTR(job->command));
+  sqlite3_bind_int(stmt, 3, job->state);
+  bind_string(stmt, 4, NULLSTR(job->output_filename));
+  sqlite3_bind_int(stmt, 5, job->store_output);
+  sqlite3_bind_int(stmt, 6, job->pid);
+  sqlite3_bind_int(stmt, 7, job->ts_UID);
+  sqlite3_bind_int(stmt, 8, job->should_keep_finished);
+  bind_string(stmt, 9, row->depend_on);
+  sqlite3_bind_int(stmt, 10, job->depend_on_size);
+  bind_string(stmt, 11, row->notify_errorlevel_to);
+  sqlite3_bind_int(stmt, 12, job->notify_errorlevel_to_size);
+  sqlite3_bind_int(stmt, 13, job->dependency_errorlevel);
+  bind_string(stmt, 14, label);
+  bind_string(stmt, 15, email);
+  sqlite3_bind_int(stmt, 16, job->num_slots);
+  sqlite3_bind_int(stmt, 17, result->errorlevel);
+  sqlite3_bind_int(stmt, 18, result->died_by_signal);
+  sqlite3_bind_int(stmt, 19, result->signal);
+  sqlite3_bind_double(stmt, 20, result->user_ms);
+  sqlite3_bind_double(stmt, 21, result->system_ms);
+  sqlite3_bind_double(stmt, 22, result->real_ms);
+  sqlite3_bind_int(stmt, 23, result->skipped);
+  bind_string(stmt, 24, NULLSTR(info->ptr));
+  sqlite3_bind_int(stmt, 25, info->nchars);
+  sqlite3_bind_int(stmt, 26, info->allocchars);
+  sqlite3_bind_int64(stmt, 27, info->enqueue_time.tv_sec);
+  sqlite3_bind_int64(stmt, 28, info->start_time.tv_sec);
+  sqlite3_bind_int64(stmt, 29, info->end_time.tv_sec);
+  sqlite3_bind_int64(stmt, 30, info->enqueue_time.tv_usec);
+  sqlite3_bind_int64(stmt, 31, info->start_time.tv_usec);
+  sqlite3_bind_int64(stmt, 32, info->end_time.tv_usec);
+  sqlite3_bind_int(stmt, 33, job->order_id);
+  sqlite3_bind_int(stmt, 34, job->command_strip);
+  bind_string(stmt, 35, NULLSTR(job->work_dir));
+  sqlite3_bind_int64(stmt, 36, (sqlite3_int64)row->env_hash);
+
+  return step_DB("insert_DB", stmt);
 }
 
-int swap_DB(int jobid0, int jobid1) {
-  int err0, err1, err = 0;
-  int id0 = get_order_id(jobid0, &err0);
-  int id1 = get_order_id(jobid1, &err1);
-  if (err0 == 0 && err1 == 0) {
-    err0 = set_order_id_DB(jobid0, id1);
-    err1 = set_order_id_DB(jobid1, id0);
-    if (err0 != 0 || err1 != 0) {
-      err = -1;
-    }
-  } else {
-    err = -1;
-  }
-  return err;
+static int sqlite_insert(const struct JobRow *row, int table, int replace) {
+  return edit_DB(row, replace ? tables[table].replace : tables[table].insert);
 }
 
-int movetop_DB(int jobid) {
-  int err;
-  int order_id = min_order_id(&err) - 1;
-  if (err != 0) {
-    return err;
-  }
-  return set_order_id_DB(jobid, order_id);
+/* Only the columns a start changes, unless the row is missing */
+static int sqlite_start(const struct JobRow *row) {
+  const struct Job *job = &row->job;
+
+  if (start_stmt == NULL)
+    return -1;
+  sqlite3_bind_int(start_stmt, 1, job->state);
+  sqlite3_bind_int(start_stmt, 2, job->pid);
+  bind_string(start_stmt, 3, NULLSTR(job->output_filename));
+  sqlite3_bind_int64(start_stmt, 4, job->info.start_time.tv_sec);
+  sqlite3_bind_int64(start_stmt, 5, job->info.start_time.tv_usec);
+  sqlite3_bind_int(start_stmt, 6, job->jobid);
+  if (step_DB("start_DB", start_stmt) != 0)
+    return -1;
+  if (sqlite3_changes(db) == 0)
+    return edit_DB(row, tables[JOBS_TABLE].replace);
+  return 0;
+}
+
+/* The row leaves Jobs only once it is in Finished. It replaces the row
+ * of the history with its jobid, if any. */
+static int sqlite_finish(const struct JobRow *row) {
+  int err = edit_DB(row, tables[FINISHED_TABLE].replace);
+
+  if (err == 0)
+    err = remove_DB(tables[JOBS_TABLE].remove, row->job.jobid);
+  return err;
 }
 
 /*
@@ -347,154 +547,229 @@ static void clear_DB(const char* table) {
 }
 */
 
-// return error code
-int read_jobid_DB(int **jobids, const char *table) {
-  int n;
-  sprintf(sql, "SELECT COUNT(*) FROM %s;", table);
-  char *errmsg = NULL;
-
-  if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
-    fprintf(stderr, "[read_jobid_DB0] SQL error: %s by %s\n",
-            sqlite3_errmsg(db), sql);
-    sqlite3_free(errmsg);
-    return -1; // 返回-1表示查询失败
-  }
-
-  // 从查询结果中读取数据
-  sqlite3_stmt *stmt;
-  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "[read_jobid_DB1] SQL error: %s by %s\n",
-            sqlite3_errmsg(db), sql);
-    return -2; // 返回-2表示查询失败
+/* The job of the row the statement is on */
+static struct Job *job_from_stmt(sqlite3_stmt *stmt) {
+  struct JobRow *row;
+  struct Job *job;
+  struct Job values = {0};
+  struct Result *result = &values.result;
+  struct Procinfo *info = &values.info;
+
+  /* The strings stay in the statement until the row copies them */
+  values.jobid = sqlite3_column_int(stmt, 0);
+  values.command = (char *)column_string(stmt, 1);
+  values.state = sqlite3_column_int(stmt, 2);
+  values.output_filename = (char *)column_string(stmt, 3);
+  values.store_output = sqlite3_column_int(stmt, 4);
+  values.pid = sqlite3_column_int(stmt, 5);
+  values.ts_UID = sqlite3_column_int(stmt, 6);
+  values.should_keep_finished = sqlite3_column_int(stmt, 7);
+  values.depend_on_size = sqlite3_column_int(stmt, 9);
+  values.notify_errorlevel_to_size = sqlite3_column_int(stmt, 11);
+  values.dependency_errorlevel = sqlite3_column_int(stmt, 12);
+  values.label = (char *)column_string(stmt, 13);
+  values.email = (char *)column_string(stmt, 14);
+  values.num_slots = sqlite3_column_int(stmt, 15);
+
+  result->errorlevel = sqlite3_column_int(stmt, 16);
+  result->died_by_signal = sqlite3_column_int(stmt, 17);
+  result->signal = sqlite3_column_int(stmt, 18);
+  result->user_ms = (float)sqlite3_column_double(stmt, 19);
+  result->system_ms = (float)sqlite3_column_double(stmt, 20);
+  result->real_ms = (float)sqlite3_column_double(stmt, 21);
+  result->skipped = sqlite3_column_int(stmt, 22);
+
+  info->ptr = (char *)column_string(stmt, 23);
+  info->enqueue_time.tv_sec = sqlite3_column_int64(stmt, 26);
+  info->start_time.tv_sec = sqlite3_column_int64(stmt, 27);
+  info->end_time.tv_sec = sqlite3_column_int64(stmt, 28);
+  info->enqueue_time.tv_usec = sqlite3_column_int64(stmt, 29);
+  info->start_time.tv_usec = sqlite3_column_int64(stmt, 30);
+  info->end_time.tv_usec = sqlite3_column_int64(stmt, 31);
+  values.order_id = sqlite3_column_int(stmt, 32);
+  values.command_strip = sqlite3_column_int(stmt, 33);
+  values.work_dir = (char *)column_string(stmt, 34);
+
+  row = new_job_row(&values, (const char *)sqlite3_column_text(stmt, 8),
+                    (const char *)sqlite3_column_text(stmt, 10));
+  row->env_hash = (uint64_t)sqlite3_column_int64(stmt, 35);
+
+  /* The rows of older versions hold their info inline, with the exit
+   * status that s_job_info() now prints by itself */
+  if (row->job.info.ptr != NULL) {
+    char *status = strstr(row->job.info.ptr, "Exit status: ");
+    if (status != NULL)
+      *status = '\0';
   }
+  job = job_from_row(row);
+  free(row);
+  return job;
+}
 
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    n = sqlite3_column_int(stmt, 0);
-  }
-  if (n == 0)
-    return 0;
-  *jobids = (int *)malloc(n * sizeof(int));
+/* One pass over the table, instead of a query for each job */
+static int sqlite_read_all(int table, void (*add)(struct Job *job)) {
+  sqlite3_stmt *stmt = tables[table].select;
+  int n = 0;
+  int rc;
 
-  sprintf(sql, "SELECT jobid FROM %s ORDER BY order_id;", table);
-  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "[read_jobid_DB2] SQL error: %s from %s\n",
-            sqlite3_errmsg(db), sql);
-    debug_write("test0");
-    return -3; // 返回-1表示查询失败
+  if (stmt == NULL)
+    return -1;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    add(job_from_stmt(stmt));
+    ++n;
   }
-
-  int i = 0;
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    (*jobids)[i++] = sqlite3_column_int(stmt, 0);
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "[read_all_DB] SQL error: %s from %s\n",
+            sqlite3_errmsg(db), tables[table].table);
+    n = -1;
   }
-
-  return n; // 返回0表示查询成功
+  sqlite3_reset(stmt);
+  return n;
 }
 
-struct Job *read_DB(int jobid, const char *table) {
-  struct Job *job = (struct Job *)malloc(sizeof(struct Job) * 1);
-#ifdef TASKSET
-  job->cores = NULL;
-#endif
-  struct Result *result = &(job->result);
-  struct Procinfo *info = &(job->info);
+static int sqlite_insert_env(uint64_t hash, const char *env) {
+  if (env_insert_stmt == NULL)
+    return -1;
+  sqlite3_bind_int64(env_insert_stmt, 1, (sqlite3_int64)hash);
+  bind_string(env_insert_stmt, 2, env);
+  return step_DB("insert_env_DB", env_insert_stmt);
+}
 
-  sprintf(sql, "SELECT * FROM %s WHERE jobid=%d;", table, jobid);
-  char *errmsg = NULL;
+static int sqlite_remove_env(uint64_t hash) {
+  if (env_remove_stmt == NULL)
+    return -1;
+  sqlite3_bind_int64(env_remove_stmt, 1, (sqlite3_int64)hash);
+  return step_DB("remove_env_DB", env_remove_stmt);
+}
 
-  if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
-    fprintf(stderr, "[read_DB0] SQL error: %s\n", errmsg);
-    sqlite3_free(errmsg);
-    return NULL; // 返回-1表示查询失败
-  }
+static char *sqlite_read_env(uint64_t hash) {
+  char *env = NULL;
+
+  if (env_select_stmt == NULL)
+    return NULL;
+  sqlite3_bind_int64(env_select_stmt, 1, (sqlite3_int64)hash);
+  if (sqlite3_step(env_select_stmt) == SQLITE_ROW)
+    env = strdup((const char *)sqlite3_column_text(env_select_stmt, 0));
+  sqlite3_reset(env_select_stmt);
+  sqlite3_clear_bindings(env_select_stmt);
+  return env;
+}
 
-  // 从查询结果中读取数据
-  sqlite3_stmt *stmt;
-  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "[read_DB1] SQL error: %s\n", sqlite3_errmsg(db));
-    return NULL; // 返回-1表示查询失败
+static int open_history() {
+  if (history_db != NULL)
+    return 0;
+  if (sqlite3_open_v2(get_sqlite_path(), &history_db, SQLITE_OPEN_READONLY,
+                      NULL) != SQLITE_OK) {
+    fprintf(stderr, "[history_DB] Can't open database: %s\n",
+            sqlite3_errmsg(history_db));
+    sqlite3_close(history_db);
+    history_db = NULL;
+    return -1;
   }
+  sqlite3_busy_timeout(history_db, HISTORY_BUSY_TIMEOUT_MS);
+  return 0;
+}
 
-  rc = sqlite3_step(stmt);
-  if (rc == SQLITE_ROW) {
-    // 从查询结果中读取数据
-    job->jobid = sqlite3_column_int(stmt, 0);
-
-    strcpy(sql, (const char *)sqlite3_column_text(stmt, 1));
-    copy_with_nullcheck(&(job->command), sql);
-
-    job->state = sqlite3_column_int(stmt, 2);
-
-    strcpy(sql, (const char *)sqlite3_column_text(stmt, 3));
-    copy_with_nullcheck(&(job->output_filename), sql);
-
-    job->store_output = sqlite3_column_int(stmt, 4);
-    job->pid = sqlite3_column_int(stmt, 5);
-    job->ts_UID = sqlite3_column_int(stmt, 6);
-    job->should_keep_finished = sqlite3_column_int(stmt, 7);
-
-    // job->depend_on_size = sqlite3_column_bytes(stmt, 9);
-    // job->notify_errorlevel_to_size = sqlite3_column_bytes(stmt, 11);
-    job->depend_on_size = sqlite3_column_int(stmt, 9);
-    if (job->depend_on_size == 0) {
-      job->depend_on = NULL;
-    } else {
-      strcpy(sql, (const char *)sqlite3_column_text(stmt, 8));
-      job->depend_on = chars_to_ints(&job->depend_on_size, sql, ",");
-    }
-
-    job->notify_errorlevel_to_size = sqlite3_column_int(stmt, 11);
-    if (job->notify_errorlevel_to_size == 0) {
-      job->notify_errorlevel_to = NULL;
-    } else {
-      strcpy(sql, (const char *)sqlite3_column_text(stmt, 10));
-      job->notify_errorlevel_to =
-          chars_to_ints(&job->notify_errorlevel_to_size, sql, ",");
-    }
-
-    job->dependency_errorlevel = sqlite3_column_int(stmt, 12);
-
-    strcpy(sql, (const char *)sqlite3_column_text(stmt, 13));
-    copy_with_nullcheck(&(job->label), sql);
-
-    strcpy(sql, (const char *)sqlite3_column_text(stmt, 14));
-    copy_with_nullcheck(&(job->email), sql);
-
-    job->num_slots = sqlite3_column_int(stmt, 15);
-
-    result->errorlevel = sqlite3_column_int(stmt, 16);
-    result->died_by_signal = sqlite3_column_int(stmt, 17);
-    result->signal = sqlite3_column_int(stmt, 18);
-    result->user_ms = (float)sqlite3_column_double(stmt, 19);
-    result->system_ms = (float)sqlite3_column_double(stmt, 20);
-    result->real_ms = (float)sqlite3_column_double(stmt, 21);
-    result->skipped = sqlite3_column_int(stmt, 22);
-
-    strcpy(sql, (const char *)sqlite3_column_text(stmt, 23));
-    copy_with_nullcheck(&(info->ptr), sql);
-
-    info->nchars = sqlite3_column_bytes(stmt, 24) / sizeof(char);
-    info->allocchars = sqlite3_column_bytes(stmt, 25) / sizeof(char);
-
-    info->enqueue_time.tv_sec = sqlite3_column_int64(stmt, 26);
-    info->start_time.tv_sec = sqlite3_column_int64(stmt, 27);
-    info->end_time.tv_sec = sqlite3_column_int64(stmt, 28);
-
-    info->enqueue_time.tv_usec = sqlite3_column_int64(stmt, 29);
-    info->start_time.tv_usec = sqlite3_column_int64(stmt, 30);
-    info->end_time.tv_usec = sqlite3_column_int64(stmt, 31);
-    job->command_strip = sqlite3_column_int(stmt, 33);
+/* A page of the rows of Finished, retired or not, by end time and jobid
+ * from the newest. The server loop reads them on a read-only connection
+ * of its own, which the write-ahead log does not make wait for the
+ * persistence thread. */
+static int sqlite_history(const struct HistoryQuery *q,
+                          void (*add)(const struct Job *job, void *arg),
+                          void *arg) {
+  char sql[1024];
+  sqlite3_stmt *stmt = NULL;
+  int len;
+  int n = 0;
+  int rc;
 
-    strcpy(sql, (const char *)sqlite3_column_text(stmt, 34));
-    copy_with_nullcheck(&(job->work_dir), sql);
+  if (open_history() != 0)
+    return -1;
 
+  len = snprintf(sql, sizeof(sql),
+                 "SELECT jobid, ts_UID, label, command, command_strip, "
+                 "num_slots, errorlevel, died_by_signal, signal, skipped, "
+                 "real_ms, start_time, start_time_ms, end_time, end_time_ms "
+                 "FROM Finished WHERE (end_time, jobid) < (?1, ?2)");
+  if (q->ts_UID >= 0)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND ts_UID=?3");
+  if (q->since > 0)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND end_time>=?4");
+  if (q->label != NULL)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND label=?5");
+  if (q->failed)
+    len += snprintf(sql + len, sizeof(sql) - len, " AND " HISTORY_FAILED);
+  snprintf(sql + len, sizeof(sql) - len,
+           " ORDER BY end_time DESC, jobid DESC LIMIT ?6;");
+
+  if (sqlite3_prepare_v2(history_db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "[history_DB] SQL error: %s by %s\n",
+            sqlite3_errmsg(history_db), sql);
+    return -1;
+  }
+  if (q->before_jobid == 0) {
+    sqlite3_bind_int64(stmt, 1, INT64_MAX);
+    sqlite3_bind_int(stmt, 2, INT_MAX);
   } else {
-    fprintf(stderr, "[read_DB2] SQL error: %s\n", sqlite3_errmsg(db));
-    return NULL; // 返回-1表示查询失败
+    sqlite3_bind_int64(stmt, 1, q->before_time);
+    sqlite3_bind_int(stmt, 2, q->before_jobid);
   }
-
-  return job; // 返回0表示查询成功
+  sqlite3_bind_int(stmt, 3, q->ts_UID);
+  sqlite3_bind_int64(stmt, 4, q->since);
+  if (q->label != NULL)
+    bind_string(stmt, 5, q->label);
+  sqlite3_bind_int(stmt, 6, q->limit);
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    struct Job job = {0};
+
+    job.jobid = sqlite3_column_int(stmt, 0);
+    job.ts_UID = sqlite3_column_int(stmt, 1);
+    job.label = (char *)column_string(stmt, 2);
+    job.command = (char *)sqlite3_column_text(stmt, 3);
+    job.command_strip = sqlite3_column_int(stmt, 4);
+    job.num_slots = sqlite3_column_int(stmt, 5);
+    job.state = FINISHED;
+    job.result.errorlevel = sqlite3_column_int(stmt, 6);
+    job.result.died_by_signal = sqlite3_column_int(stmt, 7);
+    job.result.signal = sqlite3_column_int(stmt, 8);
+    job.result.skipped = sqlite3_column_int(stmt, 9);
+    job.result.real_ms = (float)sqlite3_column_double(stmt, 10);
+    job.info.start_time.tv_sec = sqlite3_column_int64(stmt, 11);
+    job.info.start_time.tv_usec = sqlite3_column_int64(stmt, 12);
+    job.info.end_time.tv_sec = sqlite3_column_int64(stmt, 13);
+    job.info.end_time.tv_usec = sqlite3_column_int64(stmt, 14);
+    add(&job, arg);
+    ++n;
+  }
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "[history_DB] SQL error: %s\n",
+            sqlite3_errmsg(history_db));
+    n = -1;
+  }
+  sqlite3_finalize(stmt);
+  return n;
 }
+
+const struct StoreBackend sqlite_store = {
+    .name = "sqlite",
+    .open = sqlite_open,
+    .close = sqlite_close,
+    .get_jobids = sqlite_get_jobids,
+    .read_all = sqlite_read_all,
+    .order_range = sqlite_order_range,
+    .begin = sqlite_begin,
+    .commit = sqlite_commit,
+    .insert = sqlite_insert,
+    .start = sqlite_start,
+    .finish = sqlite_finish,
+    .remove = sqlite_remove,
+    .retire = sqlite_retire,
+    .set_state = sqlite_set_state,
+    .set_order = sqlite_set_order,
+    .set_jobids = sqlite_set_jobids,
+    .insert_env = sqlite_insert_env,
+    .remove_env = sqlite_remove_env,
+    .read_env = sqlite_read_env,
+    .history = sqlite_history,
+};
@@ -0,0 +1,816 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2009  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/* The state of the server is kept by a storage backend: the SQLite
+ * database (sqlite.c), or the binary journal (journal.c), chosen by
+ * TS_STORE when the server starts. The functions *_DB() of this file are
+ * the same for both. */
+static const struct StoreBackend *store = &sqlite_store;
+
+/* The order of the rows in Jobs is kept here, instead of being queried
+ * on each write: new jobs go after last_order_id, urgent ones before
+ * first_order_id. 0 is never used, it means not stored yet. */
+static int first_order_id = -1;
+static int last_order_id = 0;
+
+/* How the writes reach the disk, from TS_DB_SYNC: "op", the default,
+ * commits every write by itself, and a new job is only acknowledged once
+ * it is on disk (see durable_DB); "loop" groups the writes of one
+ * server_loop() round in a transaction, committed once they are applied;
+ * a number N keeps the transaction open for up to N ms. */
+enum { SYNC_PER_OP = -1, SYNC_PER_LOOP = 0 };
+static int sync_interval = SYNC_PER_OP;
+static int transaction_open = 0;
+static int transaction_depth = 0;
+static struct timeval transaction_start;
+
+/* In "loop" mode, a thread behind the server keeps grouping the rounds
+ * in one transaction, but not for longer than this */
+enum { MAX_GROUP_MS = 1000 };
+
+/* The writes are not run by the server loop: each one is queued as an
+ * operation, with a copy of the values it needs, and the persistence
+ * thread applies them in order. A slow, locked or checkpointing database
+ * then delays no client. Until start_persist_DB() the operations are
+ * applied at once, as the restore needs. The writes come first. */
+enum DBOpType {
+  OP_INSERT,
+  OP_REPLACE,
+  OP_ENV,
+  OP_REMOVE_ENV,
+  OP_START,
+  OP_FINISH,
+  OP_DELETE,
+  OP_RETIRE,
+  OP_SET_ORDER,
+  OP_SET_STATE,
+  OP_SET_JOBIDS,
+  OP_BEGIN,
+  OP_COMMIT,
+  OP_ROUND,
+  OP_BARRIER,
+  OP_STOP
+};
+
+struct DBOp {
+  enum DBOpType type;
+  int table;
+  int jobid;
+  int value;  /* the state, order_id, JOBIDs or number of jobids */
+  void *data; /* a struct JobRow, the body of OP_ENV or the jobids of
+                 OP_DELETE */
+  uint64_t hash; /* of OP_ENV and OP_REMOVE_ENV */
+};
+
+/* A ring of operations with one producer, the server loop, and one
+ * consumer, the persistence thread: head and tail only grow, and each one
+ * is moved by one side. The lock is only taken to sleep and wake up. */
+enum { PERSIST_QUEUE_SIZE = 4096 }; /* a power of 2 */
+
+static struct {
+  struct DBOp ops[PERSIST_QUEUE_SIZE];
+  atomic_uint head; /* the next to apply */
+  atomic_uint tail; /* the next free */
+  atomic_int thread_sleeping;
+  atomic_int loop_sleeping;
+  atomic_int barriers_done;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t barrier;
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .not_empty = PTHREAD_COND_INITIALIZER,
+           .not_full = PTHREAD_COND_INITIALIZER,
+           .barrier = PTHREAD_COND_INITIALIZER};
+
+static pthread_t persist_thread;
+static pid_t persist_pid = 0; /* the server running the thread, if any */
+static int barriers_sent = 0;
+static int round_writes = 0;
+
+/* For --stats. The thread writes the atomic ones, the loop the others. */
+static struct {
+  unsigned int peak_depth;
+  long stalls;
+  atomic_long ops;
+  atomic_long commits;
+  atomic_long commit_us;
+  atomic_long last_commit_us;
+  atomic_long max_commit_us;
+} persist_stats;
+
+static int table_index(const char *table) {
+  return strcmp(table, "Finished") == 0 ? FINISHED_TABLE : JOBS_TABLE;
+}
+
+static long elapsed_us(const struct timeval *since) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) * 1000000L +
+         (now.tv_usec - since->tv_usec);
+}
+
+static int open_transaction() {
+  if (transaction_open)
+    return 0;
+  transaction_open = 1;
+  gettimeofday(&transaction_start, NULL);
+  return store->begin();
+}
+
+static int close_transaction() {
+  struct timeval start;
+  long us;
+  int rc;
+
+  if (!transaction_open)
+    return 0;
+  transaction_open = 0;
+  gettimeofday(&start, NULL);
+  rc = store->commit();
+  us = elapsed_us(&start);
+
+  atomic_fetch_add(&persist_stats.commits, 1);
+  atomic_fetch_add(&persist_stats.commit_us, us);
+  atomic_store(&persist_stats.last_commit_us, us);
+  if (us > atomic_load(&persist_stats.max_commit_us))
+    atomic_store(&persist_stats.max_commit_us, us);
+  return rc;
+}
+
+/* Commit the transaction of the grouped modes if it is due. caught_up
+ * tells that no other operation is waiting behind a round. */
+static void commit_if_due(int caught_up) {
+  long interval;
+
+  if (!transaction_open || transaction_depth > 0)
+    return;
+  if (sync_interval == SYNC_PER_LOOP && caught_up) {
+    close_transaction();
+    return;
+  }
+  interval = sync_interval > 0 ? sync_interval : MAX_GROUP_MS;
+  if (elapsed_us(&transaction_start) >= interval * 1000)
+    close_transaction();
+}
+
+/* The ms until commit_if_due() commits without any round, -1 if never */
+static int commit_due_ms() {
+  long left;
+
+  if (!transaction_open || transaction_depth > 0)
+    return -1;
+  left = (sync_interval > 0 ? sync_interval : MAX_GROUP_MS) * 1000L -
+         elapsed_us(&transaction_start);
+  return left <= 0 ? 0 : (left + 999) / 1000;
+}
+
+static void apply_op(struct DBOp *op, int caught_up) {
+  /* Every write joins the open transaction; in "op" mode it is its own */
+  if (op->type <= OP_SET_JOBIDS)
+    open_transaction();
+
+  switch (op->type) {
+  case OP_INSERT:
+    store->insert(op->data, op->table, 0);
+    break;
+  case OP_REPLACE:
+    store->insert(op->data, op->table, 1);
+    break;
+  case OP_ENV:
+    store->insert_env(op->hash, op->data);
+    break;
+  case OP_REMOVE_ENV:
+    store->remove_env(op->hash);
+    break;
+  case OP_START:
+    store->start(op->data);
+    break;
+  case OP_FINISH:
+    store->finish(op->data);
+    break;
+  case OP_DELETE:
+    store->remove(op->data, op->value, op->table);
+    break;
+  case OP_RETIRE:
+    store->retire(op->data, op->value);
+    break;
+  case OP_SET_ORDER:
+    store->set_order(op->jobid, op->value);
+    break;
+  case OP_SET_STATE:
+    store->set_state(op->jobid, op->value);
+    break;
+  case OP_SET_JOBIDS:
+    store->set_jobids(op->value);
+    break;
+  case OP_BEGIN:
+    if (transaction_depth++ == 0)
+      open_transaction();
+    break;
+  case OP_COMMIT:
+    --transaction_depth;
+    break;
+  case OP_ROUND:
+    commit_if_due(caught_up);
+    break;
+  case OP_BARRIER:
+  case OP_STOP:
+    if (transaction_depth == 0)
+      close_transaction();
+    break;
+  }
+
+  if ((op->type <= OP_SET_JOBIDS || op->type == OP_COMMIT) &&
+      sync_interval == SYNC_PER_OP && transaction_depth == 0)
+    close_transaction();
+  free(op->data);
+  op->data = NULL;
+}
+
+static void wake(pthread_cond_t *cond) {
+  pthread_mutex_lock(&queue.lock);
+  pthread_cond_signal(cond);
+  pthread_mutex_unlock(&queue.lock);
+}
+
+/* Sleep until an operation is queued, or for timeout ms if not -1. The
+ * flag is set before looking at the queue, and submit_op() looks at the
+ * flag after queuing, so one of them sees the other. */
+static void persist_wait(int timeout) {
+  struct timespec until;
+
+  if (timeout >= 0) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout / 1000;
+    until.tv_nsec += (timeout % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+  }
+  pthread_mutex_lock(&queue.lock);
+  atomic_store(&queue.thread_sleeping, 1);
+  while (atomic_load(&queue.head) == atomic_load(&queue.tail)) {
+    if (timeout < 0)
+      pthread_cond_wait(&queue.not_empty, &queue.lock);
+    else if (pthread_cond_timedwait(&queue.not_empty, &queue.lock,
+                                    &until) != 0)
+      break;
+  }
+  atomic_store(&queue.thread_sleeping, 0);
+  pthread_mutex_unlock(&queue.lock);
+}
+
+static void *persist_main(void *arg) {
+  for (;;) {
+    unsigned int head = atomic_load(&queue.head);
+    struct DBOp *op;
+    enum DBOpType type;
+    int value;
+
+    if (head == atomic_load(&queue.tail)) {
+      persist_wait(commit_due_ms());
+      commit_if_due(0);
+      continue;
+    }
+
+    op = &queue.ops[head & (PERSIST_QUEUE_SIZE - 1)];
+    type = op->type;
+    value = op->value;
+    apply_op(op, head + 1 == atomic_load(&queue.tail));
+    atomic_fetch_add(&persist_stats.ops, 1);
+    atomic_store(&queue.head, head + 1);
+    if (atomic_load(&queue.loop_sleeping))
+      wake(&queue.not_full);
+
+    if (type == OP_BARRIER || type == OP_STOP) {
+      pthread_mutex_lock(&queue.lock);
+      atomic_store(&queue.barriers_done, value);
+      pthread_cond_broadcast(&queue.barrier);
+      pthread_mutex_unlock(&queue.lock);
+    }
+    if (type == OP_STOP)
+      return NULL;
+  }
+}
+
+/* The operations the ring had no room for, in order, until it has. The
+ * loop never waits for the disk to write: it stops taking connections
+ * instead (see persist_backlog_DB). */
+struct SpilledOp {
+  struct DBOp op;
+  struct SpilledOp *next;
+};
+static struct SpilledOp *spill_head = NULL;
+static struct SpilledOp **spill_tail = &spill_head;
+static int spilled = 0;
+
+static int ring_full(unsigned int tail) {
+  return tail - atomic_load(&queue.head) == PERSIST_QUEUE_SIZE;
+}
+
+/* Wait until the ring has room, only for flush_DB(1) and the stop */
+static void wait_ring_room(unsigned int tail) {
+  pthread_mutex_lock(&queue.lock);
+  atomic_store(&queue.loop_sleeping, 1);
+  while (ring_full(tail))
+    pthread_cond_wait(&queue.not_full, &queue.lock);
+  atomic_store(&queue.loop_sleeping, 0);
+  pthread_mutex_unlock(&queue.lock);
+}
+
+static void ring_push(struct DBOp op) {
+  unsigned int tail = atomic_load(&queue.tail);
+  unsigned int depth;
+
+  queue.ops[tail & (PERSIST_QUEUE_SIZE - 1)] = op;
+  atomic_store(&queue.tail, tail + 1);
+
+  depth = tail + 1 - atomic_load(&queue.head);
+  if (depth > persist_stats.peak_depth)
+    persist_stats.peak_depth = depth;
+  if (atomic_load(&queue.thread_sleeping))
+    wake(&queue.not_empty);
+}
+
+/* Move the spilled operations to the ring, as many as fit, or all of
+ * them if wait */
+static void drain_spill(int wait) {
+  while (spill_head != NULL) {
+    struct SpilledOp *s = spill_head;
+    unsigned int tail = atomic_load(&queue.tail);
+
+    if (ring_full(tail)) {
+      if (!wait)
+        return;
+      wait_ring_room(tail);
+    }
+    ring_push(s->op);
+    spill_head = s->next;
+    if (spill_head == NULL)
+      spill_tail = &spill_head;
+    spilled--;
+    free(s);
+  }
+}
+
+static void queue_op(struct DBOp op) {
+  struct SpilledOp *s;
+
+  if (op.type <= OP_SET_JOBIDS)
+    round_writes = 1;
+  if (persist_pid == 0) {
+    apply_op(&op, 1);
+    return;
+  }
+
+  drain_spill(0);
+  if (spill_head == NULL && !ring_full(atomic_load(&queue.tail))) {
+    ring_push(op);
+    return;
+  }
+
+  /* The disk is a whole ring behind */
+  s = (struct SpilledOp *)malloc(sizeof(*s));
+  if (s == NULL)
+    error("Cannot spill a database operation");
+  s->op = op;
+  s->next = NULL;
+  *spill_tail = s;
+  spill_tail = &s->next;
+  if (spilled++ == 0)
+    persist_stats.stalls++;
+}
+
+/* The operations waiting for room in the ring, after moving what fits.
+ * While there are any, the server loop takes no new connections, and
+ * comes back to call this again. */
+int persist_backlog_DB() {
+  drain_spill(0);
+  return spilled;
+}
+
+static void submit_op(enum DBOpType type, int table, int jobid, int value,
+                      void *data) {
+  struct DBOp op = {type, table, jobid, value, data, 0};
+
+  queue_op(op);
+}
+
+/* Hand the writes to the persistence thread, once the restore is done */
+void start_persist_DB() {
+  sigset_t all, old;
+
+  if (persist_pid != 0)
+    return;
+  /* The signals are for the server loop */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if (pthread_create(&persist_thread, NULL, persist_main, NULL) != 0)
+    warning("Cannot start the persistence thread, writing synchronously");
+  else
+    persist_pid = getpid();
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Apply and commit everything queued, and end the thread */
+static void stop_persist_DB() {
+  if (persist_pid == 0)
+    return;
+  submit_op(OP_STOP, 0, 0, ++barriers_sent, NULL);
+  drain_spill(1);
+  pthread_join(persist_thread, NULL);
+  persist_pid = 0;
+}
+
+/* End the round of the server loop: in "loop" mode its writes are
+ * committed once the thread has applied them. If wait, also return only
+ * when everything queued is applied and committed. */
+void flush_DB(int wait) {
+  int barrier;
+
+  if (round_writes) {
+    round_writes = 0;
+    submit_op(OP_ROUND, 0, 0, 0, NULL);
+  }
+  if (!wait)
+    return;
+
+  barrier = ++barriers_sent;
+  submit_op(OP_BARRIER, 0, 0, barrier, NULL);
+  if (persist_pid == 0)
+    return;
+  drain_spill(1);
+  pthread_mutex_lock(&queue.lock);
+  while (atomic_load(&queue.barriers_done) < barrier)
+    pthread_cond_wait(&queue.barrier, &queue.lock);
+  pthread_mutex_unlock(&queue.lock);
+}
+
+/* Before a new job is acknowledged: in "op" mode, wait until it is
+ * committed, so no job a client was told about is lost in a crash. The
+ * grouped modes trade that for not waiting on the disk. */
+void durable_DB() {
+  if (sync_interval == SYNC_PER_OP)
+    flush_DB(1);
+}
+
+/* Group many writes in a single transaction (one sync to disk). They
+ * nest, and in the grouped modes the rounds do the commit. */
+int begin_transaction_DB() {
+  submit_op(OP_BEGIN, 0, 0, 0, NULL);
+  return 0;
+}
+
+int commit_transaction_DB() {
+  submit_op(OP_COMMIT, 0, 0, 0, NULL);
+  return 0;
+}
+
+static char *row_copy(char **pos, const char *str) {
+  char *res;
+
+  if (str == NULL)
+    return NULL;
+  res = *pos;
+  strcpy(res, str);
+  *pos += strlen(str) + 1;
+  return res;
+}
+
+/* The stored values of the job in one block, its strings included. The
+ * dependencies come as text, as they are stored. */
+struct JobRow *new_job_row(const struct Job *job, const char *depend_on,
+                           const char *notify_errorlevel_to) {
+  const char *strings[] = {job->command,         job->work_dir,
+                           job->label,           job->email,
+                           job->output_filename, job->info.ptr,
+                           depend_on,            notify_errorlevel_to};
+  struct JobRow *row;
+  struct Job *r;
+  size_t size = 0;
+  char *pos;
+  int i;
+
+  for (i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i)
+    if (strings[i] != NULL)
+      size += strlen(strings[i]) + 1;
+  row = (struct JobRow *)calloc(1, sizeof(*row) + size);
+  if (row == NULL)
+    error("Cannot allocate the stored row of the job %i", job->jobid);
+
+  r = &row->job;
+  r->jobid = job->jobid;
+  r->command_strip = job->command_strip;
+  r->state = job->state;
+  r->result = job->result;
+  r->store_output = job->store_output;
+  r->pid = job->pid;
+  r->ts_UID = job->ts_UID;
+  r->should_keep_finished = job->should_keep_finished;
+  r->depend_on_size = job->depend_on_size;
+  r->notify_errorlevel_to_size = job->notify_errorlevel_to_size;
+  r->dependency_errorlevel = job->dependency_errorlevel;
+  r->info = job->info;
+  r->num_slots = job->num_slots;
+  r->order_id = job->order_id;
+
+  pos = row->text;
+  r->command = row_copy(&pos, job->command);
+  r->work_dir = row_copy(&pos, job->work_dir);
+  r->label = row_copy(&pos, job->label);
+  r->email = row_copy(&pos, job->email);
+  r->output_filename = row_copy(&pos, job->output_filename);
+  r->info.ptr = row_copy(&pos, job->info.ptr);
+  row->depend_on = row_copy(&pos, depend_on);
+  row->notify_errorlevel_to = row_copy(&pos, notify_errorlevel_to);
+  return row;
+}
+
+/* The integers of a depend_on or notify_errorlevel_to text */
+static int *text_ints(const char *text, int *size) {
+  char *str = strdup(text);
+  int *res;
+
+  if (str == NULL)
+    error("Cannot allocate memory for the dependencies");
+  res = chars_to_ints(size, str, ",");
+  free(str);
+  return res;
+}
+
+/* A job of the server, from a row of a backend */
+struct Job *job_from_row(const struct JobRow *row) {
+  const struct Job *r = &row->job;
+  struct Job *job = job_alloc();
+
+#ifdef TASKSET
+  job->cores = NULL;
+#endif
+  job->jobid = r->jobid;
+  job_set_strings(job, r->command, r->work_dir, r->label, r->email);
+  job->command_strip = r->command_strip;
+  job->state = r->state;
+  job->result = r->result;
+  if (r->output_filename != NULL)
+    job->output_filename = strdup(r->output_filename);
+  job->store_output = r->store_output;
+  job->pid = r->pid;
+  job->ts_UID = r->ts_UID;
+  job->should_keep_finished = r->should_keep_finished;
+  job->dependency_errorlevel = r->dependency_errorlevel;
+  job->num_slots = r->num_slots;
+  job->order_id = r->order_id;
+  if (row->env_hash != 0)
+    job->env = env_restore(job->ts_UID, row->env_hash);
+
+  job->depend_on_size = r->depend_on_size;
+  if (job->depend_on_size > 0 && row->depend_on != NULL)
+    job->depend_on = text_ints(row->depend_on, &job->depend_on_size);
+  else
+    job->depend_on_size = 0;
+  job->notify_errorlevel_to_size = r->notify_errorlevel_to_size;
+  if (job->notify_errorlevel_to_size > 0 && row->notify_errorlevel_to != NULL)
+    job->notify_errorlevel_to =
+        text_ints(row->notify_errorlevel_to, &job->notify_errorlevel_to_size);
+  else
+    job->notify_errorlevel_to_size = 0;
+
+  /* The info is stored without its final 0 counted, as in pinfo_addinfo() */
+  job->info = r->info;
+  job->info.ptr = NULL;
+  job->info.nchars = job->info.allocchars = 0;
+  if (r->info.ptr != NULL) {
+    job->info.ptr = strdup(r->info.ptr);
+    job->info.nchars = strlen(r->info.ptr);
+    job->info.allocchars = job->info.nchars + 1;
+  }
+  return job;
+}
+
+static struct JobRow *job_row(struct Job *job) {
+  char *depend_on = ints_to_chars(job->depend_on_size, job->depend_on, ",");
+  char *notify_errorlevel_to = ints_to_chars(job->notify_errorlevel_to_size,
+                                             job->notify_errorlevel_to, ",");
+  struct JobRow *row = new_job_row(job, depend_on, notify_errorlevel_to);
+
+  row->env_hash = job->env != NULL ? job->env->key : 0;
+  free(depend_on);
+  free(notify_errorlevel_to);
+  return row;
+}
+
+static void submit_row(enum DBOpType type, struct Job *job, int table) {
+  if (job->order_id == 0)
+    job->order_id = ++last_order_id;
+  submit_op(type, table, job->jobid, 0, job_row(job));
+}
+
+/* The writes below only queue the operation, so they cannot fail: the
+ * persistence thread reports the errors of the backend. */
+int insert_DB(struct Job *job, const char *table) {
+  submit_row(OP_INSERT, job, table_index(table));
+  return 0;
+}
+
+int insert_or_replace_DB(struct Job *job, const char *table) {
+  submit_row(OP_REPLACE, job, table_index(table));
+  return 0;
+}
+
+/* Record the start of a job in Jobs: its state, pid, start time and
+ * output file, and nothing else if its row is there */
+int start_DB(struct Job *job) {
+  submit_row(OP_START, job, JOBS_TABLE);
+  return 0;
+}
+
+/* Move the row of a finished job from Jobs to Finished */
+int finish_DB(struct Job *job) {
+  submit_row(OP_FINISH, job, FINISHED_TABLE);
+  return 0;
+}
+
+int delete_DB(int jobid, const char *table) {
+  return delete_jobs_DB(&jobid, 1, table);
+}
+
+static int *copy_jobids(const int *jobids, int n) {
+  int *copy = (int *)malloc(n * sizeof(int));
+
+  if (copy == NULL)
+    error("Cannot allocate %i jobids to store", n);
+  memcpy(copy, jobids, n * sizeof(int));
+  return copy;
+}
+
+int delete_jobs_DB(const int *jobids, int n, const char *table) {
+  if (n <= 0)
+    return 0;
+  submit_op(OP_DELETE, table_index(table), 0, n, copy_jobids(jobids, n));
+  return 0;
+}
+
+/* The finished jobs dropped from the list: the store may keep their rows
+ * for ts --history */
+int retire_jobs_DB(const int *jobids, int n) {
+  if (n <= 0)
+    return 0;
+  submit_op(OP_RETIRE, FINISHED_TABLE, 0, n, copy_jobids(jobids, n));
+  return 0;
+}
+
+int set_jobids_DB(int value) {
+  submit_op(OP_SET_JOBIDS, 0, 0, value, NULL);
+  return 0;
+}
+
+int set_state_DB(int jobid, int state) {
+  submit_op(OP_SET_STATE, 0, jobid, state, NULL);
+  return 0;
+}
+
+static int set_order_id_DB(struct Job *job, int order_id) {
+  job->order_id = order_id;
+  submit_op(OP_SET_ORDER, 0, job->jobid, order_id, NULL);
+  return 0;
+}
+
+int swap_DB(struct Job *job0, struct Job *job1) {
+  int id0 = job0->order_id;
+  int id1 = job1->order_id;
+
+  set_order_id_DB(job0, id1);
+  set_order_id_DB(job1, id0);
+  return 0;
+}
+
+int movetop_DB(struct Job *job) {
+  return set_order_id_DB(job, first_order_id--);
+}
+
+/* The reads are only for the restore, before the thread starts */
+int get_jobids_DB() { return store->get_jobids(); }
+
+/* Give every job of the table to add(), in their order. Returns the
+ * number of jobs, or -1 if the table cannot be read. */
+int read_all_DB(const char *table, void (*add)(struct Job *job)) {
+  return store->read_all(table_index(table), add);
+}
+
+/* A page of the finished jobs stored, newest first. The server loop reads
+ * them itself, apart from the persistence thread, so the last writes may
+ * not be there yet. -1 if the store keeps no history. */
+int history_DB(const struct HistoryQuery *q,
+               void (*add)(const struct Job *job, void *arg), void *arg) {
+  if (store->history == NULL)
+    return -1;
+  return store->history(q, add, arg);
+}
+
+/* The environments are stored once, apart from the rows of their jobs,
+ * which only hold their key (envstore.c). The store writes a copy of env,
+ * the server keeps its own. */
+int insert_env_DB(uint64_t hash, const char *env) {
+  struct DBOp op = {OP_ENV, 0, 0, 0, strdup(env), hash};
+
+  if (op.data == NULL) {
+    warning("Cannot copy an environment to store it");
+    return -1;
+  }
+
+  queue_op(op);
+  return 0;
+}
+
+int remove_env_DB(uint64_t hash) {
+  struct DBOp op = {OP_REMOVE_ENV, 0, 0, 0, NULL, hash};
+
+  queue_op(op);
+  return 0;
+}
+
+/* The environment stored under that key, or NULL. Only the restore reads
+ * them, before the persistence thread starts: then the server keeps the
+ * bodies of its environments (envstore.c). */
+char *read_env_DB(uint64_t hash) {
+  return store->read_env(hash);
+}
+
+int open_store() {
+  const char *str;
+  int min, max;
+  int rc;
+
+  str = getenv("TS_STORE");
+  if (str != NULL && strcmp(str, journal_store.name) == 0)
+    store = &journal_store;
+  else if (str != NULL && strcmp(str, sqlite_store.name) != 0)
+    warning("Unknown TS_STORE \"%s\", using %s", str, sqlite_store.name);
+
+  sync_interval = get_env("TS_DB_SYNC", SYNC_PER_OP);
+  str = getenv("TS_DB_SYNC");
+  if (str != NULL && strcmp(str, "op") == 0)
+    sync_interval = SYNC_PER_OP;
+  else if (str != NULL && strcmp(str, "loop") == 0)
+    sync_interval = SYNC_PER_LOOP;
+
+  rc = store->open(sync_interval == SYNC_PER_OP);
+  if (rc != 0)
+    return rc;
+
+  /* Continue the order of the rows already stored, of both tables */
+  store->order_range(&min, &max);
+  first_order_id = min <= 0 ? min - 1 : -1;
+  last_order_id = max > 0 ? max : 0;
+  return 0;
+}
+
+int close_store() {
+  /* A forked child has no persistence thread, and the store is not its
+   * own; an error() in the thread cannot wait for itself */
+  if (persist_pid != 0 && persist_pid != getpid())
+    return 0;
+  if (persist_pid != 0 && pthread_equal(pthread_self(), persist_thread))
+    return 0;
+  stop_persist_DB();
+  close_transaction();
+  return store->close();
+}
+
+void s_send_persist_stats(int s) {
+  char line[256];
+  long commits = atomic_load(&persist_stats.commits);
+  unsigned int depth = atomic_load(&queue.tail) - atomic_load(&queue.head);
+
+  snprintf(line, sizeof(line),
+           "Store: %s, %u operations waiting (peak %u of %i), %i spilled, "
+           "%li applied, %li stalls\n",
+           store->name, depth, persist_stats.peak_depth, PERSIST_QUEUE_SIZE,
+           spilled, atomic_load(&persist_stats.ops), persist_stats.stalls);
+  send_list_line(s, line);
+  snprintf(line, sizeof(line),
+           "Store commits: %li, latency %.2f ms average, %.2f ms last, "
+           "%.2f ms max\n",
+           commits,
+           commits ? atomic_load(&persist_stats.commit_us) / 1000.0 / commits
+                   : 0.0,
+           atomic_load(&persist_stats.last_commit_us) / 1000.0,
+           atomic_load(&persist_stats.max_commit_us) / 1000.0);
+  send_list_line(s, line);
+}
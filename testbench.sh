@@ -149,3 +149,305 @@ if [ $? -ne 0 ]; then
 fi
 
 ./ts -K
+
+# The server asks before it goes down
+kill_server() {
+  echo Yes | ./ts -K > /dev/null
+  # A client connecting before the socket is gone finds no one answering
+  SOCKET=${TS_SOCKET:-${TMPDIR:-/tmp}/socket-ts.root}
+  while [ -S "$SOCKET" ]; do
+    sleep 0.1
+  done
+}
+# The jobid of "New JobID: N"
+jobid() {
+  echo ${1##* }
+}
+
+# Test killing all the jobs with several clients connected
+kill_server
+./ts -S 1 > /dev/null
+./ts sleep 10 > /dev/null
+./ts sleep 1 > /dev/null
+J1=`./ts sleep 1`
+./ts sleep 1 > /dev/null
+./ts -w > /dev/null 2>&1 &
+./ts -r `jobid "$J1"` > /dev/null
+echo Yes | ./ts -T > /dev/null
+LINES=`./ts -l | grep -E "queued|running" | wc -l`
+if [ $LINES -ne 0 ]; then
+  echo "Error killing all the jobs."
+  exit 1
+fi
+
+kill_server
+
+# Test a detached job whose runner dies before connecting
+./ts > /dev/null
+J=`./ts sleep 1`
+mkdir -p gone
+J1=`cd gone && ../ts --detach -D \`jobid "$J"\` true`
+rmdir gone
+./ts -w `jobid "$J1"` > /dev/null
+if ! ./ts -i `jobid "$J1"` | grep -q "exit code -1"; then
+  echo "Error failing a job whose runner did not start."
+  exit 1
+fi
+
+kill_server
+
+# Test a --batch submission
+./ts > /dev/null
+printf 'true\n# a comment\n\nexit 3\ntrue\n' > batch.txt
+J=`./ts --batch batch.txt | tail -1`
+FIRST=`echo "$J" | sed 's/.*: \([0-9]*\)-.*/\1/'`
+LAST=`echo "$J" | sed 's/.*-//'`
+rm -f batch.txt
+if [ $((LAST - FIRST)) -ne 2 ]; then
+  echo "Error queueing a batch of 3 commands."
+  exit 1
+fi
+./ts -w $LAST > /dev/null 2>&1
+./ts -w $((FIRST + 1)) > /dev/null 2>&1
+if [ $? -ne 3 ]; then
+  echo "Error running the commands of a batch."
+  exit 1
+fi
+if ./ts -d --batch - < /dev/null > /dev/null 2>&1; then
+  echo "Error refusing dependencies in a batch."
+  exit 1
+fi
+
+kill_server
+
+# Test a dependency fan-out: the jobs run in the queue order once the
+# job they wait for ends
+./ts > /dev/null
+./ts -S 1 > /dev/null
+J=`./ts sleep 1`
+J1=`./ts --detach -D \`jobid "$J"\` true`
+J2=`./ts --detach -D \`jobid "$J"\` true`
+J3=`./ts --detach -D \`jobid "$J"\` true`
+./ts -u `jobid "$J3"` > /dev/null
+./ts -w `jobid "$J2"` > /dev/null
+ORDER=`./ts -l | awk '$2 == "finished" { print $1 }' | tail -3 | tr '\n' ' '`
+if [ "$ORDER" != "`jobid "$J3"` `jobid "$J1"` `jobid "$J2"` " ]; then
+  echo "Error running the dependent jobs in order: $ORDER"
+  exit 1
+fi
+
+kill_server
+
+# Test the journal replay after a torn record at its end: the jobs of the
+# snapshot are back, and what comes after the cut is kept
+(
+  JOURNAL_DB=`mktemp -u`
+  export TS_STORE=journal TS_SQLITE_PATH=$JOURNAL_DB
+  ./ts > /dev/null
+  J=`./ts --detach -D 1 true`
+  ./ts -w `jobid "$J"` > /dev/null
+  kill_server
+  printf '\100\0\0\0torn' >> $JOURNAL_DB.journal
+  ./ts > /dev/null
+  J2=`./ts --detach -D 1 true`
+  ./ts -w `jobid "$J2"` > /dev/null
+  if grep -q torn $JOURNAL_DB.journal; then
+    echo "Error cutting the torn record off the journal."
+    exit 1
+  fi
+  kill_server
+  ./ts > /dev/null
+  FOUND=`./ts -l | grep -c "^\(\`jobid "$J"\`\|\`jobid "$J2"\`\) "`
+  kill_server
+  rm -f $JOURNAL_DB.journal $JOURNAL_DB.snapshot
+  if [ $FOUND -ne 2 ]; then
+    echo "Error replaying the journal after a torn record."
+    exit 1
+  fi
+) || exit 1
+
+# Test the environment shared by two jobs: uploaded once, shown by ts -i
+# for both, also after a restart
+(
+  export TS_ENV='echo shared-env'
+  ./ts > /dev/null
+  J=`./ts true`
+  J2=`./ts true`
+  ./ts -w `jobid "$J2"` > /dev/null
+  UPLOADS=`./ts --stats | sed -n 's/^Environments:.* \([0-9]*\) uploaded.*/\1/p'`
+  if [ "$UPLOADS" != 1 ]; then
+    echo "Error uploading a shared environment once: $UPLOADS"
+    exit 1
+  fi
+  kill_server
+  ./ts > /dev/null
+  FOUND=`(./ts -i \`jobid "$J"\`; ./ts -i \`jobid "$J2"\`) | grep -c '^shared-env$'`
+  kill_server
+  if [ $FOUND -ne 2 ]; then
+    echo "Error showing the shared environment of the jobs."
+    exit 1
+  fi
+) || exit 1
+
+# Test a restart with queued jobs: they are restored, and run in the
+# queue order
+(
+  export TS_SLOTS=1
+  ./ts > /dev/null
+  J=`./ts --detach sleep 1`
+  J1=`./ts --detach true`
+  J2=`./ts --detach true`
+  J3=`./ts --detach true`
+  ./ts -u `jobid "$J3"` > /dev/null
+  kill_server
+  ./ts > /dev/null
+  ./ts -w `jobid "$J2"` > /dev/null
+  ORDER=`./ts -l | awk '$2 == "finished" { print $1 }' | tail -3 | tr '\n' ' '`
+  kill_server
+  if [ "$ORDER" != "`jobid "$J3"` `jobid "$J1"` `jobid "$J2"` " ]; then
+    echo "Error restoring the queued jobs in order: $ORDER"
+    exit 1
+  fi
+) || exit 1
+
+# Test the history: the jobs evicted from the finished list stay in it,
+# the newest first
+(
+  export TS_MAXFINISHED=1
+  ./ts > /dev/null
+  J=`./ts -L hist-ok true`
+  J2=`./ts -L hist-fail false`
+  ./ts -w `jobid "$J2"` > /dev/null
+  kill_server
+  ./ts > /dev/null
+  ALL=`./ts --history | awk 'NR > 1 && $3 ~ /^hist-/ { print $1 }' | head -2 | tr '\n' ' '`
+  FAILED=`./ts --history --failed --label hist-fail | awk 'NR == 2 { print $1 }' | tr '\n' ' '`
+  kill_server
+  rm -f hist-ok.* hist-fail.*
+  if [ "$ALL" != "`jobid "$J2"` `jobid "$J"` " ]; then
+    echo "Error listing the history: $ALL"
+    exit 1
+  fi
+  if [ "$FAILED" != "`jobid "$J2"` " ]; then
+    echo "Error filtering the history: $FAILED"
+    exit 1
+  fi
+) || exit 1
+
+# Test the filters of the list, evaluated in the server
+(
+  export TS_SLOTS=1
+  ./ts > /dev/null
+  F1=`./ts -L filter-a true`
+  F2=`./ts -L filter-b false`
+  ./ts -w `jobid "$F2"` > /dev/null
+  R=`./ts -L filter-run sleep 10`
+  Q=`./ts -L filter-a true`
+  RUNNING=`./ts --state running --fields id`
+  LAST=`./ts --state finished --offset -1 --fields id,elevel | tr '\t' ' '`
+  LABELED=`./ts --label 'filter-a*' --fields id | tr '\n' ' '`
+  JSON=`./ts --jobs \`jobid "$F1"\` --fields id,label -M json`
+  ./ts -k `jobid "$R"` > /dev/null
+  kill_server
+  rm -f filter-*.*
+  if [ "$RUNNING" != "`jobid "$R"`" ]; then
+    echo "Error listing the running jobs: $RUNNING"
+    exit 1
+  fi
+  if [ "$LAST" != "`jobid "$F2"` 1" ]; then
+    echo "Error listing the last finished job: $LAST"
+    exit 1
+  fi
+  if [ "$LABELED" != "`jobid "$Q"` `jobid "$F1"` " ]; then
+    echo "Error listing the jobs by label: $LABELED"
+    exit 1
+  fi
+  if [ "$JSON" != "[{\"ID\":`jobid "$F1"`,\"Label\":\"filter-a\"}]" ]; then
+    echo "Error listing the fields in JSON: $JSON"
+    exit 1
+  fi
+) || exit 1
+
+# Test the events of ts --watch
+(
+  export TS_SLOTS=1
+  ./ts > /dev/null
+  ./ts --watch --label 'watch-*' > watch.events &
+  WATCHER=$!
+  sleep 0.5
+  W1=`./ts -L watch-a sh -c 'exit 2'`
+  ./ts -L other true > /dev/null
+  W2=`./ts -L watch-b true`
+  ./ts -w `jobid "$W2"` > /dev/null
+  ./ts -r `jobid "$W2"` > /dev/null
+  sleep 0.5
+  kill $WATCHER
+  # The events of each job in order, the jobs one after the other
+  EVENTS=`sort -s -n -k1,1 watch.events | awk '{ print $1, $2, $4 }' |
+    tr '\n' ','`
+  kill_server
+  rm -f watch.events watch-*.* other.*
+  W1=`jobid "$W1"`
+  W2=`jobid "$W2"`
+  if [ "$EVENTS" != "$W1 submitted ,$W1 started ,$W1 finished 2,$W2 submitted ,$W2 started ,$W2 finished 0,$W2 removed ," ]; then
+    echo "Error watching the events: $EVENTS"
+    exit 1
+  fi
+) || exit 1
+
+# Test the listing and the states from the snapshot of the server
+(
+  SOCKET=${TS_SOCKET:-${TMPDIR:-/tmp}/socket-ts.root}
+  ./ts > /dev/null
+  S1=`./ts -L snap-a sh -c 'exit 1'`
+  ./ts -w `jobid "$S1"` > /dev/null
+  STATE=`./ts -s \`jobid "$S1"\``
+  LOCAL=`./ts --label 'snap-*' --fields id,state,elevel,command`
+  SERVER=`TS_SNAPSHOT=0 ./ts --label 'snap-*' --fields id,state,elevel,command`
+  PUBLISHED=no
+  [ -f "$SOCKET.state" ] && PUBLISHED=yes
+  kill_server
+  rm -f snap-*.*
+  if [ "$STATE" != "finished" ]; then
+    echo "Error in the state from the snapshot: $STATE"
+    exit 1
+  fi
+  if [ "$LOCAL" != "$SERVER" ]; then
+    echo "Error in the list from the snapshot: $LOCAL"
+    exit 1
+  fi
+  if [ $PUBLISHED != yes ] || [ -e "$SOCKET.state" ]; then
+    echo "Error publishing the snapshot."
+    exit 1
+  fi
+) || exit 1
+
+# Test the detached jobs the server runs itself, and one with an option
+# it does not know, left to a runner
+(
+  TS_SPAWN=1 ./ts > /dev/null
+  L1=`./ts --detach -L spawn-a sh -c 'echo out; exit 3'`
+  L2=`./ts --detach -z -L spawn-b sh -c 'exit 4'`
+  L3=`./ts --detach -L spawn-c no-such-command`
+  ./ts -w `jobid "$L1"` > /dev/null
+  E1=$?
+  ./ts -w `jobid "$L2"` > /dev/null
+  E2=$?
+  ./ts -w `jobid "$L3"` > /dev/null
+  E3=$?
+  OUT=`cat spawn-a.\`jobid "$L1"\``
+  kill_server
+  rm -f spawn-*.*
+  if [ $E1 -ne 3 ] || [ "$OUT" != "out" ]; then
+    echo "Error in a job run by the server: $E1 $OUT"
+    exit 1
+  fi
+  if [ $E2 -ne 4 ]; then
+    echo "Error in a job left to a runner: $E2"
+    exit 1
+  fi
+  if [ $E3 -ne 255 ]; then
+    echo "Error in a job the server could not run: $E3"
+    exit 1
+  fi
+) || exit 1
@@ -298,6 +298,9 @@ void kill_pids(int parent_pid, int signal, const char* cmd) {
   DIR *dir;
   struct dirent *entry;
 
+  /* Its state changes with the signal */
+  procstat_forget(parent_pid);
+
   snprintf(path, sizeof(path), "/proc/%d/task", parent_pid);
 
   if ((dir = opendir(path)) == NULL) {